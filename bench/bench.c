@@ -0,0 +1,379 @@
+/*
+ * End to end benchmark: replay -> parse -> decode -> present.
+ *
+ * Every corpus file is replayed through the capture replay backend as fast as possible
+ * and fed to the decoder, running on the mock VE and mock display. Results are written
+ * as JSON and compared against a baseline, a stage slower than the threshold or a new
+ * allocation in the frame path fails the run. So does a missing baseline or a corpus
+ * missing from it, which would otherwise pass unchecked. Stage times are medians, a mean
+ * is too easily moved by a single preempted frame. There is no software decoder to
+ * compare with, the output says so instead of leaving the figure out silently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <stdatomic.h>
+
+#include "capture.h"
+#include "jpeg.h"
+#include "jpeg_dec_main.h"
+#include "ve.h"
+#include "ve_scheduler.h"
+#include "mock_display.h"
+
+#define BENCH_DEFAULT_FRAMES 300
+#define BENCH_DEFAULT_THRESHOLD_PCT 15
+#define BENCH_MAX_CORPORA 64
+#define BENCH_MAX_FRAMES 10000
+// Parsing takes about as long as reading the clock, so it is timed over repeated runs
+#define BENCH_PARSE_REPEAT 32
+// Differences below this are timer noise, not regressions
+#define BENCH_NOISE_FLOOR_NS 1000
+#define BENCH_BACKEND "mock-ve"
+
+#define BENCH_RESULT_FORMAT "    {\"corpus\": \"%63[^\"]\", \"backend\": \"%15[^\"]\", \"frames\": %u, \"parse_ns\": %lf, \"decode_ns\": %lf, \"present_ns\": %lf, \"fps\": %lf, \"mb_per_s\": %lf, \"allocs_per_frame\": %lf"
+
+typedef struct {
+    char corpus[64];
+    char backend[16];
+    uint32_t frames;
+    double parse_ns;
+    double decode_ns;
+    double present_ns;
+    double fps;
+    double mb_per_s;
+    double allocs_per_frame;
+    int regression;
+} bench_result_t;
+
+// Counted through -Wl,--wrap, only while a frame is in flight
+static atomic_uint_fast64_t allocations = 0;
+static atomic_int count_allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	if (atomic_load(&count_allocations)) atomic_fetch_add(&allocations, 1);
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+	if (atomic_load(&count_allocations)) atomic_fetch_add(&allocations, 1);
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+	if (atomic_load(&count_allocations)) atomic_fetch_add(&allocations, 1);
+	return __real_realloc(ptr, size);
+}
+
+static uint64_t parse_samples[BENCH_MAX_FRAMES];
+static uint64_t decode_samples[BENCH_MAX_FRAMES];
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double median(uint64_t *samples, uint32_t count) {
+	qsort(samples, count, sizeof(uint64_t), compare_samples);
+
+	return count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+}
+
+static int run_corpus(const char *dir, const char *name, uint32_t frame_count, bench_result_t *result) {
+	char spec[512];
+	capture_source_t capture;
+	capture_frame_t frame;
+	jpeg_decoder_t decoder;
+	mock_display_stats_t present;
+	struct jpeg_t jpeg;
+	uint64_t bytes = 0;
+	uint64_t parse_total = 0;
+	uint64_t start, parsed, decoded, first;
+	uint32_t i, j;
+
+	snprintf(spec, sizeof(spec), "%s%s/%s@0", CAPTURE_REPLAY_PREFIX, dir, name);
+	capture_init(&capture, spec);
+
+	if (capture_open(&capture) || capture_start(&capture)) {
+		printf("Failed to open corpus %s\n", name);
+		return -1;
+	}
+
+	if (hw_init(&decoder, 0, capture.width, capture.height) != 0) {
+		capture_close(&capture);
+		return -1;
+	}
+
+	// The first frame sets up the display, keep it out of the numbers
+	if (capture_dequeue(&capture, &frame) == 0) {
+		hw_decode_jpeg_main(&decoder, frame.data, frame.length, 0, 0);
+		capture_requeue(&capture, &frame);
+	}
+
+	mock_display_reset_stats();
+	atomic_store(&allocations, 0);
+
+	first = ve_sched_now_ns();
+
+	for (i = 0; i < frame_count; i++) {
+		if (capture_dequeue(&capture, &frame)) {
+			break;
+		}
+
+		atomic_store(&count_allocations, 1);
+
+		start = ve_sched_now_ns();
+
+		for (j = 0; j < BENCH_PARSE_REPEAT; j++) {
+			memset(&jpeg, 0, sizeof(jpeg));
+			parse_jpeg(&jpeg, frame.data, frame.length);
+		}
+
+		parsed = ve_sched_now_ns();
+
+		hw_decode_jpeg_main(&decoder, frame.data, frame.length, 0, 0);
+
+		decoded = ve_sched_now_ns();
+
+		atomic_store(&count_allocations, 0);
+
+		parse_samples[i] = (parsed - start) / BENCH_PARSE_REPEAT;
+		parse_total += parsed - start;
+		// hw_decode_jpeg_main parses again, only count the decode part
+		decode_samples[i] = (decoded - parsed) > parse_samples[i] ? (decoded - parsed) - parse_samples[i] : 0;
+		bytes += frame.length;
+
+		capture_requeue(&capture, &frame);
+	}
+
+	// Without the repeated parses, so fps is what the pipeline sustains
+	uint64_t elapsed = ve_sched_now_ns() - first - parse_total * (BENCH_PARSE_REPEAT - 1) / BENCH_PARSE_REPEAT;
+
+	hw_close(&decoder);
+	mock_display_stats(&present);
+
+	capture_stop(&capture);
+	capture_close(&capture);
+
+	if (i == 0) {
+		printf("No frames decoded from %s\n", name);
+		return -1;
+	}
+
+	memset(result, 0, sizeof(bench_result_t));
+	snprintf(result->corpus, sizeof(result->corpus), "%.*s", (int)(strrchr(name, '.') ? strrchr(name, '.') - name : strlen(name)), name);
+	snprintf(result->backend, sizeof(result->backend), "%s", BENCH_BACKEND);
+	result->frames = i;
+	result->parse_ns = median(parse_samples, i);
+	result->decode_ns = median(decode_samples, i);
+	result->present_ns = present.frames ? (double)present.latency_sum / present.frames : 0;
+	result->fps = elapsed ? i * 1e9 / elapsed : 0;
+	result->mb_per_s = elapsed ? bytes * 1e3 / elapsed : 0;
+	result->allocs_per_frame = (double)atomic_load(&allocations) / i;
+
+	return 0;
+}
+
+static int load_baseline(const char *path, bench_result_t *baseline, int max) {
+	char line[1024];
+	int count = 0;
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL) {
+		return 0;
+	}
+
+	while (count < max && fgets(line, sizeof(line), file)) {
+		bench_result_t *b = &baseline[count];
+
+		if (sscanf(line, BENCH_RESULT_FORMAT, b->corpus, b->backend, &b->frames, &b->parse_ns, &b->decode_ns, &b->present_ns, &b->fps, &b->mb_per_s, &b->allocs_per_frame) == 9) {
+			count++;
+		}
+	}
+
+	fclose(file);
+
+	return count;
+}
+
+static int slower(double value, double reference, int threshold_pct) {
+	return reference > 0 && value > reference * (100 + threshold_pct) / 100 && value - reference > BENCH_NOISE_FLOOR_NS;
+}
+
+// Present latency is dominated by thread wake ups and is reported only
+static int compare(bench_result_t *result, bench_result_t *baseline, int baseline_count, int threshold_pct) {
+	for (int i = 0; i < baseline_count; i++) {
+		bench_result_t *b = &baseline[i];
+
+		if (strcmp(b->corpus, result->corpus) || strcmp(b->backend, result->backend)) {
+			continue;
+		}
+
+		if (slower(result->parse_ns, b->parse_ns, threshold_pct)) {
+			printf("REGRESSION %s: parse %.0f ns/frame, baseline %.0f\n", result->corpus, result->parse_ns, b->parse_ns);
+			result->regression = 1;
+		}
+
+		if (slower(result->decode_ns, b->decode_ns, threshold_pct)) {
+			printf("REGRESSION %s: decode %.0f ns/frame, baseline %.0f\n", result->corpus, result->decode_ns, b->decode_ns);
+			result->regression = 1;
+		}
+
+		if (result->allocs_per_frame > b->allocs_per_frame) {
+			printf("REGRESSION %s: %.2f allocations/frame, baseline %.2f\n", result->corpus, result->allocs_per_frame, b->allocs_per_frame);
+			result->regression = 1;
+		}
+
+		return result->regression;
+	}
+
+	printf("REGRESSION %s: not in the baseline, record it on the board with make bench-baseline\n", result->corpus);
+	result->regression = 1;
+
+	return 1;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-n frames] [-b baseline.json] [-t threshold_pct] [-o output.json] corpus_dir\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	static bench_result_t results[BENCH_MAX_CORPORA];
+	static bench_result_t baseline[BENCH_MAX_CORPORA];
+	char *names[BENCH_MAX_CORPORA];
+	const char *baseline_path = NULL;
+	const char *output_path = NULL;
+	uint32_t frame_count = BENCH_DEFAULT_FRAMES;
+	int threshold_pct = BENCH_DEFAULT_THRESHOLD_PCT;
+	int name_count = 0;
+	int result_count = 0;
+	int regressions = 0;
+	int baseline_count = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:t:o:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			frame_count = atoi(optarg);
+
+			if (frame_count > BENCH_MAX_FRAMES) {
+				frame_count = BENCH_MAX_FRAMES;
+			}
+			break;
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 't':
+			threshold_pct = atoi(optarg);
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *dir = argv[optind];
+	DIR *corpus_dir = opendir(dir);
+	struct dirent *entry;
+
+	if (corpus_dir == NULL) {
+		printf("Failed to open corpus dir %s\n", dir);
+		return 1;
+	}
+
+	while ((entry = readdir(corpus_dir)) != NULL && name_count < BENCH_MAX_CORPORA) {
+		const char *ext = strrchr(entry->d_name, '.');
+
+		if (ext && (strcmp(ext, ".mjpeg") == 0 || strcmp(ext, ".avi") == 0)) {
+			names[name_count++] = strdup(entry->d_name);
+		}
+	}
+
+	closedir(corpus_dir);
+
+	qsort(names, name_count, sizeof(char*), compare_names);
+
+	if (baseline_path) {
+		baseline_count = load_baseline(baseline_path, baseline, BENCH_MAX_CORPORA);
+
+		if (baseline_count == 0) {
+			printf("No baseline results in %s, record them on the board with make bench-baseline\n", baseline_path);
+			return 1;
+		}
+
+		printf("Loaded %i baseline results from %s\n", baseline_count, baseline_path);
+	}
+
+	ve_open();
+	ve_sched_init(VE_SCHED_ROUND_ROBIN);
+
+	for (int i = 0; i < name_count; i++) {
+		bench_result_t *result = &results[result_count];
+
+		if (run_corpus(dir, names[i], frame_count, result) == 0) {
+			if (baseline_path) {
+				regressions += compare(result, baseline, baseline_count, threshold_pct);
+			}
+
+			result_count++;
+		}
+
+		free(names[i]);
+	}
+
+	ve_close();
+
+	FILE *out = output_path ? fopen(output_path, "w") : stdout;
+
+	if (out == NULL) {
+		printf("Failed to write %s\n", output_path);
+		return 1;
+	}
+
+	fprintf(out, "{\n  \"threshold_pct\": %i,\n  \"regressions\": %i,\n  \"software\": \"unavailable\",\n  \"results\": [\n", threshold_pct, regressions);
+
+	// One result per line, load_baseline relies on it
+	for (int i = 0; i < result_count; i++) {
+		bench_result_t *r = &results[i];
+		fprintf(out, "    {\"corpus\": \"%s\", \"backend\": \"%s\", \"frames\": %u, \"parse_ns\": %.0f, \"decode_ns\": %.0f, \"present_ns\": %.0f, \"fps\": %.1f, \"mb_per_s\": %.1f, \"allocs_per_frame\": %.2f, \"regression\": %i}%s\n",
+			r->corpus, r->backend, r->frames, r->parse_ns, r->decode_ns, r->present_ns, r->fps, r->mb_per_s, r->allocs_per_frame, r->regression,
+			i + 1 < result_count ? "," : "");
+	}
+
+	fprintf(out, "  ]\n}\n");
+
+	if (out != stdout) {
+		fclose(out);
+		printf("Results written to %s\n", output_path);
+	}
+
+	if (regressions) {
+		printf("%i corpora regressed more than %i%% or have no baseline\n", regressions, threshold_pct);
+		return 1;
+	}
+
+	return 0;
+}
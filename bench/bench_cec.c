@@ -0,0 +1,313 @@
+/*
+ * CEC control path benchmark.
+ *
+ * Writes a recorded style sequence of camera control vendor commands, a knob turned in
+ * bursts the way the switcher sends them, and plays it through the replay CEC adapter
+ * at the recorded rate. The camera is mocked through -Wl,--wrap=ioctl, every
+ * VIDIOC_S_CTRL is timed from the receipt of the newest CEC message taken by the
+ * control loop. Sets made straight from the CEC message and the ones held back by the
+ * control rate limit and set by a later flush are reported apart.
+ *
+ * With -t the run fails when the p99 of the direct sets goes over the given microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/videodev2.h>
+
+#include "atem.h"
+#include "cec_controls.h"
+
+#define BENCH_SEQUENCE_FILE "output/bench_cec.txt"
+#define BENCH_DEFAULT_MESSAGES 200
+#define BENCH_MAX_MESSAGES 100000
+#define BENCH_DEFAULT_INTERVAL_MS 25
+#define BENCH_BURST_LENGTH 20
+#define BENCH_BURST_GAP_MS 300
+#define BENCH_SETTLE_MS 500
+
+struct bench_control {
+	uint32_t id;
+	const char *name;
+	int32_t minimum;
+	int32_t maximum;
+	int32_t value;
+};
+
+static struct bench_control controls[] = {
+	{ V4L2_CID_BRIGHTNESS, "Brightness", -64, 64, 0 },
+	{ V4L2_CID_CONTRAST, "Contrast", 0, 95, 32 },
+	{ V4L2_CID_SATURATION, "Saturation", 0, 100, 64 },
+	{ V4L2_CID_GAMMA, "Gamma", 100, 300, 100 },
+	{ V4L2_CID_GAIN, "Gain", 0, 255, 0 },
+	{ V4L2_CID_WHITE_BALANCE_TEMPERATURE, "White Balance Temperature", 2800, 6500, 4600 },
+};
+
+#define BENCH_CONTROL_COUNT (sizeof(controls) / sizeof(controls[0]))
+
+struct bench_samples {
+	uint64_t values[BENCH_MAX_MESSAGES];
+	uint32_t count;
+};
+
+static struct bench_samples direct_samples;
+static struct bench_samples flush_samples;
+static struct bench_samples *current_samples = &direct_samples;
+
+int __real_ioctl(int fd, unsigned long request, ...);
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct bench_control* find_control(uint32_t id) {
+	for (uint32_t i = 0; i < BENCH_CONTROL_COUNT; i++) {
+		if (controls[i].id == id) {
+			return &controls[i];
+		}
+	}
+
+	return NULL;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void*);
+	va_end(args);
+
+	if (request == VIDIOC_QUERYCTRL) {
+		struct v4l2_queryctrl *query = arg;
+		uint32_t after = query->id & ~V4L2_CTRL_FLAG_NEXT_CTRL;
+
+		// Ids are listed in ascending order
+		for (uint32_t i = 0; i < BENCH_CONTROL_COUNT; i++) {
+			if (controls[i].id > after) {
+				memset(query, 0, sizeof(*query));
+				query->id = controls[i].id;
+				query->type = V4L2_CTRL_TYPE_INTEGER;
+				query->minimum = controls[i].minimum;
+				query->maximum = controls[i].maximum;
+				query->step = 1;
+				snprintf((char*) query->name, sizeof(query->name), "%s", controls[i].name);
+				return 0;
+			}
+		}
+
+		return -1;
+	}
+
+	if (request == VIDIOC_G_CTRL || request == VIDIOC_S_CTRL) {
+		struct v4l2_control *ctrl = arg;
+		struct bench_control *control = find_control(ctrl->id);
+
+		if (control == NULL) {
+			return -1;
+		}
+
+		if (request == VIDIOC_G_CTRL) {
+			ctrl->value = control->value;
+			return 0;
+		}
+
+		if (current_samples->count < BENCH_MAX_MESSAGES) {
+			current_samples->values[current_samples->count++] = now_ns() - cec_controls_last_rx_ns();
+		}
+
+		control->value = ctrl->value;
+		return 0;
+	}
+
+	return __real_ioctl(fd, request, arg);
+}
+
+// Returns the length of the sequence in ms
+static uint64_t write_sequence(const char *path, uint32_t message_count, uint32_t interval_ms) {
+	static const uint8_t opcodes[] = { CEC_DEV_CONTRAST_CODE, CEC_DEV_SATURATION_CODE, CEC_DEV_WHITE_BALANCE_TEMP, CEC_DEV_PIVOT_CODE };
+	FILE *out = fopen(path, "w");
+	uint64_t length_ms = 0;
+
+	if (out == NULL) {
+		return 0;
+	}
+
+	fprintf(out, "# delay_ms header opcode data...\n");
+
+	for (uint32_t i = 0; i < message_count; i++) {
+		uint32_t burst = i / BENCH_BURST_LENGTH;
+		uint32_t step = i % BENCH_BURST_LENGTH;
+		uint8_t opcode = opcodes[burst % sizeof(opcodes)];
+		uint32_t delay = step == 0 && i > 0 ? BENCH_BURST_GAP_MS : interval_ms;
+
+		length_ms += delay;
+
+		// Odd bursts turn the knob back down
+		uint32_t position = burst & 1 ? BENCH_BURST_LENGTH - step : step + 1;
+
+		if (opcode == CEC_DEV_WHITE_BALANCE_TEMP) {
+			fprintf(out, "%u 01 %02x %02x\n", delay, opcode, (position * 255 / BENCH_BURST_LENGTH) & 0xff);
+		} else {
+			uint32_t value = position * 2048 / BENCH_BURST_LENGTH;
+			fprintf(out, "%u 01 %02x %02x %02x\n", delay, opcode, value & 0xff, value >> 8);
+		}
+	}
+
+	fclose(out);
+
+	return length_ms;
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Returns the p99 in ns
+static uint64_t report(const char *name, struct bench_samples *samples) {
+	if (samples->count == 0) {
+		printf("%s: no sets\n", name);
+		return 0;
+	}
+
+	qsort(samples->values, samples->count, sizeof(uint64_t), compare_samples);
+
+	uint64_t p99 = samples->values[(uint64_t) samples->count * 99 / 100];
+
+	printf("%s: %u sets  median: %llu us  p99: %llu us  max: %llu us\n",
+		name,
+		samples->count,
+		(unsigned long long) samples->values[samples->count / 2] / 1000,
+		(unsigned long long) p99 / 1000,
+		(unsigned long long) samples->values[samples->count - 1] / 1000
+	);
+
+	return p99;
+}
+
+int main(int argc, char *argv[]) {
+	video_device_t video_device;
+	struct epoll_event event;
+	uint32_t message_count = BENCH_DEFAULT_MESSAGES;
+	uint32_t interval_ms = BENCH_DEFAULT_INTERVAL_MS;
+	uint64_t max_p99_us = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:i:r:t:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				message_count = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				interval_ms = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				control_catalog_set_max_rate(atoi(optarg));
+				break;
+			case 't':
+				max_p99_us = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				printf("Usage: %s [-n messages] [-i interval_ms] [-r control_rate] [-t max_p99_us]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (message_count == 0 || message_count > BENCH_MAX_MESSAGES) {
+		message_count = BENCH_DEFAULT_MESSAGES;
+	}
+
+	mkdir("output", 0755);
+
+	uint64_t length_ms = write_sequence(BENCH_SEQUENCE_FILE, message_count, interval_ms);
+
+	if (length_ms == 0) {
+		printf("Failed to write %s\n", BENCH_SEQUENCE_FILE);
+		return 1;
+	}
+
+	memset(&video_device, 0, sizeof(video_device));
+	video_device.device_file = 3;
+	control_catalog_build(&video_device.controls, video_device.device_file);
+
+	cec_controls_set_adapter("replay:" BENCH_SEQUENCE_FILE);
+	init_cec_controls();
+
+	// The same wake ups as the control loop in main.c
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int cec_fd = cec_controls_event_fd();
+	int flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	event.events = EPOLLIN;
+	event.data.fd = cec_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cec_fd, &event);
+	event.data.fd = flush_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, flush_fd, &event);
+
+	uint64_t end_ns = now_ns() + (length_ms + BENCH_SETTLE_MS) * 1000000ULL;
+
+	while (now_ns() < end_ns) {
+		struct itimerspec flush_at = {};
+		uint64_t expirations;
+		uint64_t next_flush = control_catalog_next_flush_ns(&video_device.controls);
+
+		flush_at.it_value.tv_sec = next_flush / 1000000000ULL;
+		flush_at.it_value.tv_nsec = next_flush % 1000000000ULL;
+		timerfd_settime(flush_fd, TFD_TIMER_ABSTIME, &flush_at, NULL);
+
+		if (epoll_wait(epoll_fd, &event, 1, 100) <= 0) {
+			continue;
+		}
+
+		if (event.data.fd == cec_fd) {
+			poll_cec_events(&video_device);
+		} else if (read(flush_fd, &expirations, sizeof(expirations)) > 0) {
+			current_samples = &flush_samples;
+			control_catalog_flush(&video_device.controls, video_device.device_file);
+			current_samples = &direct_samples;
+		}
+	}
+
+	stop_cec_controls();
+	close(flush_fd);
+	close(epoll_fd);
+
+	if (direct_samples.count + flush_samples.count == 0) {
+		printf("No control was set\n");
+		return 1;
+	}
+
+	printf("CEC messages: %u over %llu ms, controls submitted: %u, coalesced: %u, applied: %u\n",
+		message_count,
+		(unsigned long long) length_ms,
+		video_device.controls.submitted,
+		video_device.controls.coalesced,
+		video_device.controls.applied
+	);
+
+	uint64_t p99 = report("CEC to S_CTRL, direct", &direct_samples);
+	report("CEC to S_CTRL, rate limited", &flush_samples);
+
+	if (max_p99_us > 0 && p99 / 1000 > max_p99_us) {
+		printf("p99 latency over %llu us\n", (unsigned long long) max_p99_us);
+		return 1;
+	}
+
+	return 0;
+}
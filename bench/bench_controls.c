@@ -0,0 +1,182 @@
+/*
+ * Control file reload benchmark.
+ *
+ * Writes a pretty printed control file, the way the web UI saves it, with one line per
+ * value and a device section larger than a single read chunk, then times load_file_controls
+ * on it. The device is mocked through -Wl,--wrap=ioctl and the file values match the
+ * device, so the numbers are parse and lookup cost only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include "control-file.h"
+
+#define BENCH_DEFAULT_RELOADS 1000
+#define BENCH_MAX_RELOADS 100000
+#define BENCH_CONTROL_COUNT 64
+#define BENCH_CONTROL_VALUE 7
+
+#ifndef CTRL_DIR
+#error "Build with the same CTRL_DIR as src/control-file.c"
+#endif
+
+static uint64_t samples[BENCH_MAX_RELOADS];
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void control_name(char *name, size_t size, int index) {
+	snprintf(name, size, "Bench Control %i", index);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void*);
+	va_end(args);
+
+	if (request == VIDIOC_QUERYCTRL) {
+		struct v4l2_queryctrl *query = arg;
+		uint32_t next = (query->id & ~V4L2_CTRL_FLAG_NEXT_CTRL) + 1;
+
+		if (next < V4L2_CID_BASE) {
+			next = V4L2_CID_BASE;
+		}
+
+		if (next >= V4L2_CID_BASE + BENCH_CONTROL_COUNT) {
+			return -1;
+		}
+
+		memset(query, 0, sizeof(*query));
+		query->id = next;
+		query->type = V4L2_CTRL_TYPE_INTEGER;
+		query->maximum = 255;
+		query->step = 1;
+		control_name((char*) query->name, sizeof(query->name), next - V4L2_CID_BASE);
+
+		return 0;
+	}
+
+	if (request == VIDIOC_G_CTRL) {
+		((struct v4l2_control*) arg)->value = BENCH_CONTROL_VALUE;
+		return 0;
+	}
+
+	// Nothing is set while the file matches the device
+	return 0;
+}
+
+static int write_control_file(const char *path) {
+	char name[32];
+	FILE *out = fopen(path, "w");
+
+	if (out == NULL) {
+		return -1;
+	}
+
+	fprintf(out, "{\n  \"device\": [\n");
+
+	for (int i = 0; i < BENCH_CONTROL_COUNT; i++) {
+		control_name(name, sizeof(name), i);
+		fprintf(out, "    {\n      \"ctrlName\": \"%s\",\n      \"ctrlValue\": %i\n    }%s\n", name, BENCH_CONTROL_VALUE, i + 1 < BENCH_CONTROL_COUNT ? "," : "");
+	}
+
+	// Display params missing from the file keep their current values
+	fprintf(out, "  ],\n  \"display\": {\n");
+	fprintf(out, "    \"fcc\": {\n      \"enable\": 0,\n      \"hr_hue_min\": 0,\n      \"hr_hue_max\": 0\n    },\n");
+	fprintf(out, "    \"bws\": {\n      \"enable\": 0,\n      \"min\": 0,\n      \"max\": 0\n    },\n");
+	fprintf(out, "    \"lti\": {\n      \"enable\": 0,\n      \"c0\": 0,\n      \"c1\": 0\n    }\n");
+	fprintf(out, "  }\n}\n");
+
+	return fclose(out);
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	video_device_t video_device;
+	struct stat file_stat;
+	uint32_t reloads = BENCH_DEFAULT_RELOADS;
+	int changes = 0;
+	int needs_write = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				reloads = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				printf("Usage: %s [-n reloads]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (reloads == 0 || reloads > BENCH_MAX_RELOADS) {
+		reloads = BENCH_DEFAULT_RELOADS;
+	}
+
+	mkdir(CTRL_DIR, 0755);
+
+	if (write_control_file(CTRL_DIR "/ctrl.json") != 0 || stat(CTRL_DIR "/ctrl.json", &file_stat) != 0) {
+		printf("Failed to write %s/ctrl.json\n", CTRL_DIR);
+		return 1;
+	}
+
+	memset(&video_device, 0, sizeof(video_device));
+	video_device.device_file = 3;
+	control_catalog_build(&video_device.controls, video_device.device_file);
+
+	// The control file code logs every reload, keep it out of the timing
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+
+	for (uint32_t i = 0; i < reloads; i++) {
+		uint64_t start = now_ns();
+		load_file_controls(&video_device, &changes, &needs_write);
+		samples[i] = now_ns() - start;
+	}
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+
+	release_file_controls();
+
+	qsort(samples, reloads, sizeof(uint64_t), compare_samples);
+
+	printf("Control file: %lli bytes, %i device controls\n", (long long) file_stat.st_size, video_device.controls.count);
+	printf("Reloads: %u  median: %llu ns  p99: %llu ns  max: %llu ns\n",
+		reloads,
+		(unsigned long long) samples[reloads / 2],
+		(unsigned long long) samples[(uint64_t) reloads * 99 / 100],
+		(unsigned long long) samples[reloads - 1]
+	);
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Chroma grading benchmark.
+ *
+ * Times chroma_grade_planes on 1080p chroma planes, 4:2:0 and 4:2:2, against the frame
+ * interval, in place and through the cached staging blocks chroma_grade_apply uses. The
+ * planes hold a smooth colour gradient with noise, restored before each pass outside of
+ * the timing. The vector path and the table path must agree to the bit.
+ *
+ * By default the planes are cached heap memory. With -d they are in a DRM dumb buffer,
+ * mapped write combined like the display buffers the decoder grades, which is the number
+ * that matters on the board. The run fails when the p99 of the staged grade goes over -b
+ * percent of the frame interval, 25 by default, the rest is left to the decode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+
+#include "chroma_grade.h"
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_DEFAULT_FRAMES 300
+#define BENCH_MAX_FRAMES 10000
+#define BENCH_DEFAULT_FPS 30
+#define BENCH_DEFAULT_BUDGET_PERCENT 25
+#define BENCH_DRM_DEVICE "/dev/dri/card0"
+
+static uint64_t samples[BENCH_MAX_FRAMES];
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void fill_planes(uint8_t *u, uint8_t *v, uint32_t width, uint32_t height) {
+	uint32_t seed = 1;
+
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+
+			int noise = (seed >> 16) % 9 - 4;
+
+			u[y * width + x] = 64 + (x * 128 / width) + noise;
+			v[y * width + x] = 64 + (y * 128 / height) - noise;
+		}
+	}
+}
+
+// Both work planes in one dumb buffer, NULL when there is no DRM device
+static uint8_t* map_display_memory(uint32_t size) {
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+	int fd = open(BENCH_DRM_DEVICE, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	memset(&create, 0, sizeof(create));
+	create.width = BENCH_WIDTH;
+	create.height = (size + BENCH_WIDTH - 1) / BENCH_WIDTH;
+	create.bpp = 8;
+
+	memset(&map, 0, sizeof(map));
+
+	if (ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map.handle = create.handle;
+
+	if (ioctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// The fd stays open for the run, the buffer goes with the process
+	void *memory = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map.offset);
+
+	return memory == MAP_FAILED ? NULL : memory;
+}
+
+typedef void (*grade_function_t)(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size);
+
+// Returns the p99 in ns
+static uint64_t run(const char *name, grade_function_t function, chroma_grade_t *grade, const uint8_t *u, const uint8_t *v, uint8_t *work_u, uint8_t *work_v, uint32_t size, uint32_t frames) {
+	for (uint32_t i = 0; i < frames; i++) {
+		memcpy(work_u, u, size);
+		memcpy(work_v, v, size);
+
+		uint64_t start = now_ns();
+		function(grade, work_u, work_v, size);
+		samples[i] = now_ns() - start;
+	}
+
+	qsort(samples, frames, sizeof(uint64_t), compare_samples);
+
+	printf("  %-7s median: %llu us  p99: %llu us  max: %llu us\n",
+		name,
+		(unsigned long long) samples[frames / 2] / 1000,
+		(unsigned long long) samples[(uint64_t) frames * 99 / 100] / 1000,
+		(unsigned long long) samples[frames - 1] / 1000
+	);
+
+	return samples[(uint64_t) frames * 99 / 100];
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t frames = BENCH_DEFAULT_FRAMES;
+	uint32_t fps = BENCH_DEFAULT_FPS;
+	uint32_t budget_percent = BENCH_DEFAULT_BUDGET_PERCENT;
+	int hue = 30;
+	int tint = 20;
+	int display_memory = 0;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:u:t:f:b:dh")) != -1) {
+		switch (opt) {
+			case 'n':
+				frames = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				hue = atoi(optarg);
+				break;
+			case 't':
+				tint = atoi(optarg);
+				break;
+			case 'f':
+				fps = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				budget_percent = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				display_memory = 1;
+				break;
+			default:
+				printf("Usage: %s [-n frames] [-u hue] [-t tint] [-f fps] [-b budget_percent] [-d]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (frames == 0 || frames > BENCH_MAX_FRAMES) {
+		frames = BENCH_DEFAULT_FRAMES;
+	}
+
+	if (fps == 0) {
+		fps = BENCH_DEFAULT_FPS;
+	}
+
+	uint64_t budget_ns = 1000000000ULL / fps * budget_percent / 100;
+
+	// 4:2:2 planes are the larger, 4:2:0 uses the first half
+	uint32_t max_size = (BENCH_WIDTH / 2) * BENCH_HEIGHT;
+	uint8_t *u = malloc(max_size);
+	uint8_t *v = malloc(max_size);
+	uint8_t *work_u;
+	uint8_t *work_v;
+	uint8_t *display = NULL;
+	uint8_t *lut_u = malloc(max_size);
+	uint8_t *lut_v = malloc(max_size);
+
+	if (display_memory) {
+		display = map_display_memory(max_size * 2);
+
+		if (display == NULL) {
+			printf("No dumb buffer from %s, -d needs the display\n", BENCH_DRM_DEVICE);
+			return 1;
+		}
+
+		work_u = display;
+		work_v = display + max_size;
+	} else {
+		work_u = malloc(max_size);
+		work_v = malloc(max_size);
+	}
+
+	printf("Planes in %s\n", display_memory ? "a write combined dumb buffer" : "cached heap memory");
+
+	chroma_grade_t grade;
+	memset(&grade, 0, sizeof(grade));
+
+	uint64_t start = now_ns();
+	chroma_grade_build(&grade, hue, tint);
+	uint64_t build_ns = now_ns() - start;
+
+	printf("Hue %i, tint %i, coefficients built in %llu us\n", hue, tint, (unsigned long long) build_ns / 1000);
+
+	for (int format = 0; format < 2; format++) {
+		uint32_t chroma_height = format == 0 ? BENCH_HEIGHT / 2 : BENCH_HEIGHT;
+		uint32_t size = (BENCH_WIDTH / 2) * chroma_height;
+
+		fill_planes(u, v, BENCH_WIDTH / 2, chroma_height);
+
+		printf("%ix%i %s, %u chroma samples per plane, budget %llu us\n",
+			BENCH_WIDTH, BENCH_HEIGHT, format == 0 ? "4:2:0" : "4:2:2", size, (unsigned long long) budget_ns / 1000);
+
+		// The first table pass also fills the table, measured apart
+		memcpy(lut_u, u, size);
+		memcpy(lut_v, v, size);
+		grade.lut_valid = 0;
+		start = now_ns();
+		chroma_grade_planes_lut(&grade, lut_u, lut_v, size);
+		printf("  table fill and first pass: %llu us\n", (unsigned long long) (now_ns() - start) / 1000);
+
+		run("planes", chroma_grade_planes, &grade, u, v, work_u, work_v, size, frames);
+		uint64_t p99 = run("staged", chroma_grade_planes_staged, &grade, u, v, work_u, work_v, size, frames);
+		run("table", chroma_grade_planes_lut, &grade, u, v, lut_u, lut_v, size, frames);
+
+		if (memcmp(work_u, lut_u, size) != 0 || memcmp(work_v, lut_v, size) != 0) {
+			printf("  The vector and table results differ\n");
+			failed = 1;
+		}
+
+		if (p99 > budget_ns) {
+			printf("  p99 over the budget\n");
+			failed = 1;
+		}
+	}
+
+	chroma_grade_release(&grade);
+	free(u);
+	free(v);
+
+	if (!display_memory) {
+		free(work_u);
+		free(work_v);
+	}
+
+	free(lut_u);
+	free(lut_v);
+
+	return failed;
+}
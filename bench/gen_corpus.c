@@ -0,0 +1,383 @@
+/*
+ * Generates the MJPEG benchmark corpora.
+ *
+ * A small baseline JPEG encoder (standard Annex K tables) writing synthetic moving
+ * gradients, so the corpora are deterministic and do not need to be stored as binaries.
+ * Every combination of subsampling (0x11, 0x21, 0x22), restart interval (DRI) and
+ * huffman tables (DHT, or none like most UVC cameras send) is written at 720p, 1080p and 4K.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define CORPUS_FRAMES 3
+
+static const uint8_t zigzag[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t luma_quant[64] = {
+	16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const uint8_t chroma_quant[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+
+static const uint8_t dc_luma_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t dc_chroma_bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t ac_luma_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t ac_luma_vals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+static const uint8_t ac_chroma_bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t ac_chroma_vals[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+struct huff_code {
+	uint16_t code[256];
+	uint8_t size[256];
+};
+
+struct bit_writer {
+	FILE *out;
+	uint32_t buffer;
+	int count;
+};
+
+static struct huff_code dc_luma, dc_chroma, ac_luma, ac_chroma;
+static float dct_cos[8][8];
+
+static void build_dct_table() {
+	for (int k = 0; k < 8; k++) {
+		for (int j = 0; j < 8; j++) {
+			dct_cos[k][j] = cosf((2 * j + 1) * k * (float)M_PI / 16) * (k == 0 ? (float)M_SQRT1_2 : 1.0f) / 2;
+		}
+	}
+}
+
+static void build_huffman(struct huff_code *h, const uint8_t bits[16], const uint8_t *vals) {
+	int code = 0;
+	int k = 0;
+
+	memset(h, 0, sizeof(struct huff_code));
+
+	for (int len = 1; len <= 16; len++) {
+		for (int i = 0; i < bits[len - 1]; i++) {
+			h->code[vals[k]] = code;
+			h->size[vals[k]] = len;
+			code++;
+			k++;
+		}
+
+		code <<= 1;
+	}
+}
+
+static void put_bits(struct bit_writer *w, uint32_t value, int size) {
+	w->buffer = (w->buffer << size) | (value & ((1 << size) - 1));
+	w->count += size;
+
+	while (w->count >= 8) {
+		uint8_t byte = (w->buffer >> (w->count - 8)) & 0xff;
+		fputc(byte, w->out);
+
+		if (byte == 0xff) {
+			fputc(0x00, w->out);
+		}
+
+		w->count -= 8;
+	}
+}
+
+static void flush_bits(struct bit_writer *w) {
+	if (w->count > 0) {
+		put_bits(w, 0x7f, 8 - w->count);
+	}
+
+	w->buffer = 0;
+	w->count = 0;
+}
+
+static void put_marker(FILE *out, uint8_t marker, uint16_t length) {
+	fputc(0xff, out);
+	fputc(marker, out);
+	fputc(length >> 8, out);
+	fputc(length & 0xff, out);
+}
+
+static void put_dht(FILE *out, uint8_t class_id, const uint8_t bits[16], const uint8_t *vals) {
+	int count = 0;
+
+	for (int i = 0; i < 16; i++) {
+		count += bits[i];
+	}
+
+	put_marker(out, 0xc4, 2 + 1 + 16 + count);
+	fputc(class_id, out);
+	fwrite(bits, 1, 16, out);
+	fwrite(vals, 1, count, out);
+}
+
+static int value_size(int value) {
+	int size = 0;
+
+	if (value < 0) {
+		value = -value;
+	}
+
+	while (value) {
+		size++;
+		value >>= 1;
+	}
+
+	return size;
+}
+
+static void encode_block(struct bit_writer *w, const float in[64], const uint8_t *quant, int *prev_dc, struct huff_code *dc, struct huff_code *ac) {
+	float tmp[64];
+	int coeff[64];
+	int i, j, k;
+
+	// Separable float DCT
+	for (i = 0; i < 8; i++) {
+		for (k = 0; k < 8; k++) {
+			float sum = 0;
+			for (j = 0; j < 8; j++) {
+				sum += in[i * 8 + j] * dct_cos[k][j];
+			}
+			tmp[i * 8 + k] = sum;
+		}
+	}
+
+	for (k = 0; k < 8; k++) {
+		for (j = 0; j < 8; j++) {
+			float sum = 0;
+			for (i = 0; i < 8; i++) {
+				sum += tmp[i * 8 + j] * dct_cos[k][i];
+			}
+			coeff[k * 8 + j] = (int)lroundf(sum / quant[k * 8 + j]);
+		}
+	}
+
+	int diff = coeff[0] - *prev_dc;
+	int size = value_size(diff);
+	*prev_dc = coeff[0];
+
+	put_bits(w, dc->code[size], dc->size[size]);
+
+	if (size) {
+		put_bits(w, diff < 0 ? diff - 1 : diff, size);
+	}
+
+	int run = 0;
+
+	for (i = 1; i < 64; i++) {
+		int value = coeff[zigzag[i]];
+
+		if (value == 0) {
+			run++;
+			continue;
+		}
+
+		while (run > 15) {
+			put_bits(w, ac->code[0xf0], ac->size[0xf0]);
+			run -= 16;
+		}
+
+		size = value_size(value);
+		put_bits(w, ac->code[(run << 4) | size], ac->size[(run << 4) | size]);
+		put_bits(w, value < 0 ? value - 1 : value, size);
+		run = 0;
+	}
+
+	if (run) {
+		put_bits(w, ac->code[0], ac->size[0]);
+	}
+}
+
+static float sample(int comp, int x, int y, int frame) {
+	// Moving diagonal gradients with some texture so AC coefficients are not all zero
+	int t = frame * 16;
+
+	switch (comp) {
+	case 0:
+		return (float)(((x + t) ^ (y >> 2)) & 0xff) - 128;
+	case 1:
+		return (float)((x * 255 / 4096 + t) & 0xff) - 128;
+	default:
+		return (float)((y * 255 / 2160 + t) & 0xff) - 128;
+	}
+}
+
+static void write_frame(FILE *out, int width, int height, int samp_h, int samp_v, int with_dri, int with_dht, int frame) {
+	int mcu_w = 8 * samp_h;
+	int mcu_h = 8 * samp_v;
+	int mcus_x = (width + mcu_w - 1) / mcu_w;
+	int mcus_y = (height + mcu_h - 1) / mcu_h;
+	int restart_interval = with_dri ? mcus_x : 0;
+	int prev_dc[3] = { 0, 0, 0 };
+	int restart = 0;
+	float block[64];
+	struct bit_writer w = { out, 0, 0 };
+
+	fputc(0xff, out);
+	fputc(0xd8, out);
+
+	put_marker(out, 0xdb, 2 + 65 * 2);
+	fputc(0x00, out);
+	for (int i = 0; i < 64; i++) fputc(luma_quant[zigzag[i]], out);
+	fputc(0x01, out);
+	for (int i = 0; i < 64; i++) fputc(chroma_quant[zigzag[i]], out);
+
+	put_marker(out, 0xc0, 2 + 6 + 9);
+	fputc(8, out);
+	fputc(height >> 8, out);
+	fputc(height & 0xff, out);
+	fputc(width >> 8, out);
+	fputc(width & 0xff, out);
+	fputc(3, out);
+	fputc(1, out); fputc((samp_h << 4) | samp_v, out); fputc(0, out);
+	fputc(2, out); fputc(0x11, out); fputc(1, out);
+	fputc(3, out); fputc(0x11, out); fputc(1, out);
+
+	if (with_dht) {
+		put_dht(out, 0x00, dc_luma_bits, dc_vals);
+		put_dht(out, 0x10, ac_luma_bits, ac_luma_vals);
+		put_dht(out, 0x01, dc_chroma_bits, dc_vals);
+		put_dht(out, 0x11, ac_chroma_bits, ac_chroma_vals);
+	}
+
+	if (with_dri) {
+		put_marker(out, 0xdd, 4);
+		fputc(restart_interval >> 8, out);
+		fputc(restart_interval & 0xff, out);
+	}
+
+	put_marker(out, 0xda, 2 + 1 + 6 + 3);
+	fputc(3, out);
+	fputc(1, out); fputc(0x00, out);
+	fputc(2, out); fputc(0x11, out);
+	fputc(3, out); fputc(0x11, out);
+	fputc(0, out); fputc(63, out); fputc(0, out);
+
+	for (int my = 0; my < mcus_y; my++) {
+		for (int mx = 0; mx < mcus_x; mx++) {
+			int mcu = my * mcus_x + mx;
+
+			if (restart_interval && mcu > 0 && (mcu % restart_interval) == 0) {
+				flush_bits(&w);
+				fputc(0xff, out);
+				fputc(0xd0 + (restart & 7), out);
+				restart++;
+				prev_dc[0] = prev_dc[1] = prev_dc[2] = 0;
+			}
+
+			for (int by = 0; by < samp_v; by++) {
+				for (int bx = 0; bx < samp_h; bx++) {
+					for (int i = 0; i < 64; i++) {
+						int x = mx * mcu_w + bx * 8 + (i % 8);
+						int y = my * mcu_h + by * 8 + (i / 8);
+						block[i] = sample(0, x, y, frame);
+					}
+					encode_block(&w, block, luma_quant, &prev_dc[0], &dc_luma, &ac_luma);
+				}
+			}
+
+			for (int c = 1; c < 3; c++) {
+				for (int i = 0; i < 64; i++) {
+					int x = mx * mcu_w + (i % 8) * samp_h;
+					int y = my * mcu_h + (i / 8) * samp_v;
+					block[i] = sample(c, x, y, frame);
+				}
+				encode_block(&w, block, chroma_quant, &prev_dc[c], &dc_chroma, &ac_chroma);
+			}
+		}
+	}
+
+	flush_bits(&w);
+
+	fputc(0xff, out);
+	fputc(0xd9, out);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct { const char *name; int width; int height; } sizes[] = {
+		{ "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4k", 3840, 2160 }
+	};
+	static const int formats[] = { 0x11, 0x21, 0x22 };
+	char path[512];
+
+	if (argc < 2) {
+		printf("Usage: %s output_dir\n", argv[0]);
+		return 1;
+	}
+
+	build_dct_table();
+	build_huffman(&dc_luma, dc_luma_bits, dc_vals);
+	build_huffman(&dc_chroma, dc_chroma_bits, dc_vals);
+	build_huffman(&ac_luma, ac_luma_bits, ac_luma_vals);
+	build_huffman(&ac_chroma, ac_chroma_bits, ac_chroma_vals);
+
+	for (int s = 0; s < 3; s++) {
+		for (int f = 0; f < 3; f++) {
+			for (int dri = 0; dri < 2; dri++) {
+				for (int dht = 0; dht < 2; dht++) {
+					snprintf(path, sizeof(path), "%s/%s_%02x%s%s.mjpeg", argv[1], sizes[s].name, formats[f], dri ? "_dri" : "", dht ? "_dht" : "");
+
+					FILE *out = fopen(path, "wb");
+
+					if (out == NULL) {
+						printf("Failed to write %s\n", path);
+						return 1;
+					}
+
+					for (int frame = 0; frame < CORPUS_FRAMES; frame++) {
+						write_frame(out, sizes[s].width, sizes[s].height, formats[f] >> 4, formats[f] & 0xf, dri, dht, frame);
+					}
+
+					fclose(out);
+					printf("Wrote %s\n", path);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,409 @@
+/*
+ * Mock of the DRM display for the benchmark harness.
+ *
+ * Keeps the same triple buffer queues as display.c, with a display thread that
+ * "flips" as soon as a buffer is queued, so the harness sees the real handoff cost.
+ * Only non tiled sources are supported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "display.h"
+#include "mock_display.h"
+
+typedef uint8_t buffer_t[DISPLAY_BUFFER_COUNT];
+
+struct mock_source {
+	uint8_t initialized;
+	int width;
+	int height;
+	uint32_t u_offset;
+	uint32_t v_offset;
+	uint8_t *maps[DISPLAY_BUFFER_COUNT + 1];
+	// Replaced by reconfigure_display, freed on the first flip of the new maps
+	uint8_t *retired_maps[DISPLAY_BUFFER_COUNT + 1];
+
+	buffer_t current_display_buffer;
+	buffer_t current_available_buffer;
+	uint8_t on_screen_buffer;
+	uint64_t queued_at[DISPLAY_BUFFER_COUNT + 1];
+	pthread_cond_t available_buffer_cond;
+};
+
+static struct mock_source sources[DISPLAY_MAX_SOURCES];
+static int active_source = 0;
+static int initialized_sources = 0;
+
+static pthread_mutex_t current_values_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t display_buffer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t display_thread;
+static uint8_t run_video_update = 0;
+
+static mock_display_stats_t stats;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void forward(buffer_t arr) {
+	arr[0] = arr[1];
+	arr[1] = arr[2];
+	arr[2] = 0;
+}
+
+static void put(buffer_t arr, uint8_t data) {
+	if (arr[0] == 0) {
+		arr[0] = data;
+	} else if (arr[1] == 0) {
+		arr[1] = data;
+	} else if (arr[2] == 0) {
+		arr[2] = data;
+	}
+}
+
+static int valid_source(int source) {
+	return source >= 0 && source < DISPLAY_MAX_SOURCES;
+}
+
+static void* display_thread_loop(void *data) {
+	struct mock_source *src;
+	uint8_t pending;
+	uint8_t prev;
+	int i;
+
+	pthread_mutex_lock(&current_values_lock);
+
+	while (run_video_update) {
+		pending = 0;
+
+		for (i = 0; i < DISPLAY_MAX_SOURCES; i++) {
+			src = &sources[i];
+
+			if (!src->initialized || !src->current_display_buffer[0]) {
+				continue;
+			}
+
+			pending = src->current_display_buffer[0];
+			forward(src->current_display_buffer);
+
+			uint64_t latency = now_ns() - src->queued_at[pending];
+			stats.frames++;
+			stats.latency_sum += latency;
+
+			if (latency > stats.latency_max) {
+				stats.latency_max = latency;
+			}
+
+			prev = src->on_screen_buffer;
+			src->on_screen_buffer = pending;
+
+			for (int j = 1; j <= DISPLAY_BUFFER_COUNT; j++) {
+				free(src->retired_maps[j]);
+				src->retired_maps[j] = NULL;
+			}
+
+			if (prev) {
+				put(src->current_available_buffer, prev);
+				pthread_cond_broadcast(&src->available_buffer_cond);
+			}
+		}
+
+		if (!pending) {
+			pthread_cond_wait(&display_buffer_cond, &current_values_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	return NULL;
+}
+
+// Kept like display.c does, nothing is applied
+static struct drm_sun4i_fcc_params fcc;
+static struct drm_sun8i_bws_params bws;
+static struct drm_sun8i_lti_params lti;
+
+void start_drm() {
+}
+
+void stop_drm() {
+}
+
+void get_drm_fcc(struct drm_sun4i_fcc_params *fcc_out) {
+	memcpy(fcc_out, &fcc, sizeof(fcc));
+}
+
+int set_drm_fcc(struct drm_sun4i_fcc_params *fcc_in) {
+	if (memcmp(fcc_in, &fcc, sizeof(fcc)) == 0) {
+		return 0;
+	}
+
+	memcpy(&fcc, fcc_in, sizeof(fcc));
+
+	return 1;
+}
+
+void get_drm_bws(struct drm_sun8i_bws_params *bws_out) {
+	memcpy(bws_out, &bws, sizeof(bws));
+}
+
+int set_drm_bws(struct drm_sun8i_bws_params *bws_in) {
+	if (memcmp(bws_in, &bws, sizeof(bws)) == 0) {
+		return 0;
+	}
+
+	memcpy(&bws, bws_in, sizeof(bws));
+
+	return 1;
+}
+
+void get_drm_lti(struct drm_sun8i_lti_params *lti_out) {
+	memcpy(lti_out, &lti, sizeof(lti));
+}
+
+int set_drm_lti(struct drm_sun8i_lti_params *lti_in) {
+	if (memcmp(lti_in, &lti, sizeof(lti)) == 0) {
+		return 0;
+	}
+
+	memcpy(&lti, lti_in, sizeof(lti));
+
+	return 1;
+}
+
+int set_drm_hue_tint(int hue, int tint) {
+	return 1;
+}
+
+// Same layout as the DRM buffers, planes aligned to 32 pixels
+static void layout_maps(struct mock_source *src, uint8_t **maps, int width, int height, int format) {
+	int chroma_pitch_divisor = (format == 0x21 || format == 0x22) ? 2 : 1;
+	int chroma_height_divisor = (format == 0x12 || format == 0x22) ? 2 : 1;
+	int i;
+
+	int luma_stride = (width + 31) & ~31;
+	int luma_size = luma_stride * ((height + 31) & ~31);
+	int chroma_size = (luma_stride / chroma_pitch_divisor) * ((height + 31) & ~31) / chroma_height_divisor;
+
+	src->width = width;
+	src->height = height;
+	src->u_offset = luma_size;
+	src->v_offset = luma_size + chroma_size;
+
+	for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		maps[i] = calloc(1, luma_size + chroma_size * 2);
+	}
+}
+
+void init_display(int source, int width, int height, int format) {
+	struct mock_source *src;
+	int i;
+
+	if (!valid_source(source)) {
+		return;
+	}
+
+	src = &sources[source];
+
+	layout_maps(src, src->maps, width, height, format);
+
+	pthread_mutex_lock(&current_values_lock);
+
+	pthread_cond_init(&src->available_buffer_cond, NULL);
+
+	memset(src->current_display_buffer, 0, sizeof(buffer_t));
+	memset(src->current_available_buffer, 0, sizeof(buffer_t));
+	src->on_screen_buffer = 0;
+
+	for (i = 0; i < DISPLAY_BUFFER_COUNT; i++) {
+		src->current_available_buffer[i] = i + 1;
+	}
+
+	src->initialized = 1;
+	initialized_sources++;
+
+	if (!run_video_update) {
+		run_video_update = 1;
+		pthread_create(&display_thread, NULL, display_thread_loop, NULL);
+	}
+
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+int reconfigure_display(int source, int width, int height, int format) {
+	struct mock_source *src;
+	uint8_t *maps[DISPLAY_BUFFER_COUNT + 1] = {};
+	int i;
+
+	if (!valid_source(source) || !sources[source].initialized) {
+		return 0;
+	}
+
+	src = &sources[source];
+
+	pthread_mutex_lock(&current_values_lock);
+
+	layout_maps(src, maps, width, height, format);
+
+	for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		// Maps never shown are dropped, the retired ones are still on screen
+		if (src->retired_maps[i]) {
+			free(src->maps[i]);
+		} else {
+			src->retired_maps[i] = src->maps[i];
+		}
+
+		src->maps[i] = maps[i];
+	}
+
+	memset(src->current_display_buffer, 0, sizeof(buffer_t));
+	src->on_screen_buffer = 0;
+
+	for (i = 0; i < DISPLAY_BUFFER_COUNT; i++) {
+		src->current_available_buffer[i] = i + 1;
+	}
+
+	pthread_cond_broadcast(&src->available_buffer_cond);
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	return 1;
+}
+
+void terminate_display(int source) {
+	int join = 0;
+
+	if (!valid_source(source)) {
+		return;
+	}
+
+	pthread_mutex_lock(&current_values_lock);
+
+	if (sources[source].initialized) {
+		sources[source].initialized = 0;
+		initialized_sources--;
+		pthread_cond_broadcast(&sources[source].available_buffer_cond);
+	}
+
+	if (initialized_sources == 0 && run_video_update) {
+		run_video_update = 0;
+		pthread_cond_signal(&display_buffer_cond);
+		join = 1;
+	}
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	if (join) {
+		pthread_join(display_thread, NULL);
+	}
+}
+
+void deallocate_buffers(int source) {
+	int i;
+
+	if (!valid_source(source)) {
+		return;
+	}
+
+	for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		free(sources[source].maps[i]);
+		free(sources[source].retired_maps[i]);
+		sources[source].maps[i] = NULL;
+		sources[source].retired_maps[i] = NULL;
+	}
+}
+
+void set_display_layout(int layout, int source_count) {
+}
+
+void set_active_source(int source) {
+	active_source = source;
+}
+
+int get_active_source() {
+	return active_source;
+}
+
+int get_display_refresh_rate() {
+	return 0;
+}
+
+int get_buffer_number(int source) {
+	struct mock_source *src;
+	uint8_t write_buffer = 0;
+
+	if (!valid_source(source)) {
+		return 0;
+	}
+
+	src = &sources[source];
+
+	pthread_mutex_lock(&current_values_lock);
+
+	while (src->initialized && !src->current_available_buffer[0] && src->current_display_buffer[0]) {
+		pthread_cond_wait(&src->available_buffer_cond, &current_values_lock);
+	}
+
+	if (src->initialized) {
+		write_buffer = src->current_available_buffer[0];
+		forward(src->current_available_buffer);
+	}
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	return write_buffer;
+}
+
+void put_buffer(int source, uint8_t buffer_number, uint64_t capture_ns) {
+	if (!valid_source(source)) {
+		return;
+	}
+
+	pthread_mutex_lock(&current_values_lock);
+
+	sources[source].queued_at[buffer_number] = now_ns();
+	put(sources[source].current_display_buffer, buffer_number);
+	pthread_cond_signal(&display_buffer_cond);
+
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+int get_dma_fd(int source, int buffer_number) {
+	return source * DISPLAY_BUFFER_COUNT + buffer_number;
+}
+
+uint8_t* get_buffer_map(int source, int buffer_number) {
+	return sources[source].maps[buffer_number];
+}
+
+void get_offsets(int source, uint32_t *u_offset, uint32_t *v_offset) {
+	*u_offset = sources[source].u_offset;
+	*v_offset = sources[source].v_offset;
+}
+
+int get_tile(int source, uint32_t *luma_offset, uint32_t *chroma_offset, uint32_t *line_stride) {
+	*luma_offset = 0;
+	*chroma_offset = 0;
+	*line_stride = 0;
+
+	return 0;
+}
+
+void mock_display_stats(mock_display_stats_t *stats_out) {
+	pthread_mutex_lock(&current_values_lock);
+	*stats_out = stats;
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+void mock_display_reset_stats() {
+	pthread_mutex_lock(&current_values_lock);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&current_values_lock);
+}
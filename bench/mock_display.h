@@ -0,0 +1,16 @@
+#ifndef _MOCK_DISPLAY_H_
+#define _MOCK_DISPLAY_H_
+
+#include <inttypes.h>
+
+typedef struct {
+    uint64_t frames;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+} mock_display_stats_t;
+
+// Time from put_buffer until the display thread picks the buffer up
+void mock_display_stats(mock_display_stats_t *stats);
+void mock_display_reset_stats();
+
+#endif
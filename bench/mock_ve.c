@@ -0,0 +1,91 @@
+/*
+ * Mock of the Cedar VE for the benchmark harness.
+ *
+ * Registers are plain memory and the engine completes instantly, so the benchmark
+ * measures everything around the hardware decode: parsing, input copy, register
+ * programming (quantization and huffman tables), scheduling and the buffer handoff.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ve.h"
+
+#define MOCK_VE_REGS_SIZE 0x1000
+
+// Fake physical base of the DMA buffers, same split as ve_get_dma_vaddr on the board
+#define MOCK_DMA_BASE 0xc0000000UL
+
+static uint32_t regs[MOCK_VE_REGS_SIZE / 4];
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ve_open(void)
+{
+	memset(regs, 0, sizeof(regs));
+	return 1;
+}
+
+void ve_close(void)
+{
+}
+
+int ve_get_version(void)
+{
+	return 0x1680;
+}
+
+int ve_wait(int timeout)
+{
+	return 0;
+}
+
+void *ve_get(int engine, uint32_t flags)
+{
+	pthread_mutex_lock(&device_lock);
+	regs[VE_CTRL / 4] = engine | flags;
+
+	return regs;
+}
+
+void ve_put(void)
+{
+	regs[VE_CTRL / 4] = 0x7;
+	pthread_mutex_unlock(&device_lock);
+}
+
+void* ve_get_dma_vaddr(int dma_fd)
+{
+	return (void*)(MOCK_DMA_BASE + ((unsigned long)dma_fd << 24));
+}
+
+void ve_put_dma_vaddrs()
+{
+}
+
+void *ve_malloc(int size, int write)
+{
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 4096, size)) {
+		return NULL;
+	}
+
+	return ptr;
+}
+
+void ve_free(void *ptr)
+{
+	free(ptr);
+}
+
+uint32_t ve_virt2phys(void *ptr)
+{
+	return (uint32_t)(uintptr_t)ptr;
+}
+
+void ve_flush_cache(void *start, int len)
+{
+}
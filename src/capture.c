@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "capture.h"
+
+void capture_init(capture_source_t *source, const char *spec) {
+	const char *at;
+
+	memset(source, 0, sizeof(capture_source_t));
+
+	for (int i = 0; i < CAPTURE_MAX_BUFFER_COUNT; i++) {
+		source->buffer_memory_map[i] = MAP_FAILED;
+	}
+
+	source->video_device.device_file = -1;
+	source->buffer_count = CAPTURE_DEFAULT_BUFFER_COUNT;
+
+	if (strncmp(spec, CAPTURE_REPLAY_PREFIX, strlen(CAPTURE_REPLAY_PREFIX)) == 0) {
+		source->type = CAPTURE_TYPE_REPLAY;
+		source->ops = &capture_replay_ops;
+		source->path = strdup(spec + strlen(CAPTURE_REPLAY_PREFIX));
+		source->replay_fps = CAPTURE_REPLAY_DEFAULT_FPS;
+
+		at = strrchr(source->path, '@');
+
+		if (at != NULL) {
+			source->replay_fps = atoi(at + 1);
+			((char*)source->path)[at - source->path] = 0;
+		}
+	} else {
+		source->type = CAPTURE_TYPE_V4L2;
+		source->ops = &capture_v4l2_ops;
+		source->path = spec;
+	}
+}
+
+int capture_open(capture_source_t *source) {
+	return source->ops->open(source);
+}
+
+int capture_start(capture_source_t *source) {
+	return source->ops->start(source);
+}
+
+int capture_dequeue(capture_source_t *source, capture_frame_t *frame) {
+	return source->ops->dequeue(source, frame);
+}
+
+int capture_requeue(capture_source_t *source, capture_frame_t *frame) {
+	return source->ops->requeue(source, frame);
+}
+
+int capture_drain(capture_source_t *source, capture_frame_t *frame) {
+	capture_frame_t newer;
+	int skipped = 0;
+
+	// Bounded by the queue, a source that is always ready can't hold the loop here
+	while (skipped + 1 < (int) source->buffer_count && source->ops->ready(source)) {
+		int result = capture_dequeue(source, &newer);
+
+		if (result == CAPTURE_AGAIN) {
+			break;
+		}
+
+		if (result != 0 || capture_requeue(source, frame) != 0) {
+			return -1;
+		}
+
+		*frame = newer;
+		skipped++;
+	}
+
+	return skipped;
+}
+
+void capture_stop(capture_source_t *source) {
+	source->ops->stop(source);
+}
+
+void capture_close(capture_source_t *source) {
+	source->ops->close(source);
+}
+
+int capture_event_fd(capture_source_t *source) {
+	return source->ops->event_fd(source);
+}
+
+int capture_restart(capture_source_t *source) {
+	return source->ops->restart(source);
+}
+
+int capture_wait(capture_source_t *source, int timeout_ms) {
+	return source->ops->wait(source, timeout_ms);
+}
+
+video_device_t* capture_video_device(capture_source_t *source) {
+	if (source->type != CAPTURE_TYPE_V4L2) {
+		return NULL;
+	}
+
+	return &source->video_device;
+}
+
+uint64_t capture_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
@@ -0,0 +1,108 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <inttypes.h>
+#include <linux/videodev2.h>
+
+#include "device.h"
+#include "capture_mode.h"
+
+// Buffers requested from the driver, more absorb decode hiccups, fewer keep the queue short
+#define CAPTURE_DEFAULT_BUFFER_COUNT 3
+#define CAPTURE_MAX_BUFFER_COUNT 8
+
+// Returned by dequeue when no frame is ready yet
+#define CAPTURE_AGAIN 1
+
+#define CAPTURE_TYPE_V4L2 0
+#define CAPTURE_TYPE_REPLAY 1
+
+#define CAPTURE_REPLAY_PREFIX "replay:"
+#define CAPTURE_REPLAY_DEFAULT_FPS 30
+
+typedef struct {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t index;
+    uint32_t sequence;
+    uint64_t timestamp_ns;
+    // timestamp_ns is CLOCK_MONOTONIC, taken when the driver captured the frame
+    uint8_t monotonic;
+} capture_frame_t;
+
+typedef struct capture_source capture_source_t;
+
+typedef struct {
+    int (*open)(capture_source_t *source);
+    int (*start)(capture_source_t *source);
+    // 0 with a frame, CAPTURE_AGAIN when none is ready, -1 when the source failed
+    int (*dequeue)(capture_source_t *source, capture_frame_t *frame);
+    // Whether a frame can be dequeued without waiting
+    int (*ready)(capture_source_t *source);
+    // Turns readable when a frame is ready, -1 when dequeue waits for the frame itself
+    int (*event_fd)(capture_source_t *source);
+    // Stops and starts the stream again with every buffer queued, 0 on success
+    int (*restart)(capture_source_t *source);
+    int (*requeue)(capture_source_t *source, capture_frame_t *frame);
+    void (*stop)(capture_source_t *source);
+    void (*close)(capture_source_t *source);
+    // Sleeps until the source may open again, 0 when it looks ready before the timeout
+    int (*wait)(capture_source_t *source, int timeout_ms);
+} capture_ops_t;
+
+struct capture_source {
+    int type;
+    const char *path;
+    const capture_ops_t *ops;
+
+    uint32_t width;
+    uint32_t height;
+    uint64_t frame_interval_ns;
+
+    // Requested, set before open. The driver may give a different count.
+    uint32_t buffer_count;
+
+    // V4L2 backend
+    video_device_t video_device;
+    struct v4l2_format current_format;
+    struct v4l2_fmtdesc current_format_desc;
+    capture_mode_t mode;
+    void *buffer_memory_map[CAPTURE_MAX_BUFFER_COUNT];
+    unsigned int buffer_memory_map_size[CAPTURE_MAX_BUFFER_COUNT];
+    // The node was missing or just appeared, the next wait after a failed open is cut short once
+    int settle_pending;
+
+    // Replay backend
+    uint32_t replay_fps;
+    void *replay;
+};
+
+extern const capture_ops_t capture_v4l2_ops;
+extern const capture_ops_t capture_replay_ops;
+
+// spec is a V4L2 device path, or replay:<file or - for stdin>[@fps]. fps 0 replays as fast as possible.
+void capture_init(capture_source_t *source, const char *spec);
+
+int capture_open(capture_source_t *source);
+int capture_start(capture_source_t *source);
+int capture_dequeue(capture_source_t *source, capture_frame_t *frame);
+int capture_requeue(capture_source_t *source, capture_frame_t *frame);
+
+// Latest frame mode: while a newer frame is ready, frame is requeued and replaced by it.
+// Returns the number of stale frames skipped, -1 when the source failed.
+int capture_drain(capture_source_t *source, capture_frame_t *frame);
+void capture_stop(capture_source_t *source);
+void capture_close(capture_source_t *source);
+
+int capture_event_fd(capture_source_t *source);
+int capture_restart(capture_source_t *source);
+
+// After a failed open. A V4L2 source wakes as soon as the device node shows up again.
+int capture_wait(capture_source_t *source, int timeout_ms);
+
+// NULL when the source has no device controls
+video_device_t* capture_video_device(capture_source_t *source);
+
+uint64_t capture_now_ns();
+
+#endif
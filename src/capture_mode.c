@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "capture_mode.h"
+
+/*
+ * Cache file layout, native byte order as it never leaves the board:
+ *
+ *   capture_modes_file_header_t
+ *   capture_mode_record_t records[count]
+ *
+ * A record holds what the mode was picked for, a change of policy, target size or display
+ * rate enumerates again.
+ */
+#define CAPTURE_MODES_MAGIC 0x444d5643
+#define CAPTURE_MODES_VERSION 1
+#define CAPTURE_MODES_TMP_FILE CAPTURE_MODES_FILE ".tmp"
+#define CAPTURE_MODE_CACHE_SIZE 16
+
+// A frame rate within this of a divisor of the refresh rate counts as one, 29.97 for 60 Hz
+#define DIVISOR_TOLERANCE 0.01
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+} capture_modes_file_header_t;
+
+typedef struct {
+	char usb_id[CAPTURE_MODE_ID_MAX];
+
+	uint8_t policy;
+	uint8_t reserved[3];
+	uint32_t target_width;
+	uint32_t target_height;
+	uint32_t refresh_rate;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t interval_count;
+	struct v4l2_fract intervals[CAPTURE_MODE_MAX_INTERVALS];
+} capture_mode_record_t;
+
+static int policy = CAPTURE_MODE_MAX_FPS;
+static uint32_t target_width = CAPTURE_MODE_DEFAULT_WIDTH;
+static uint32_t target_height = CAPTURE_MODE_DEFAULT_HEIGHT;
+static uint32_t display_refresh_rate = 0;
+
+// Shared by the device threads of all cameras
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static capture_mode_record_t cache[CAPTURE_MODE_CACHE_SIZE];
+static int cache_count = 0;
+static int cache_loaded = 0;
+
+void capture_mode_set_policy(int new_policy, uint32_t width, uint32_t height, uint32_t refresh_rate) {
+	policy = new_policy;
+	target_width = width ? width : CAPTURE_MODE_DEFAULT_WIDTH;
+	target_height = height ? height : CAPTURE_MODE_DEFAULT_HEIGHT;
+	display_refresh_rate = refresh_rate;
+
+	if (policy == CAPTURE_MODE_DISPLAY_RATE && refresh_rate == 0) {
+		printf("Display refresh rate unknown, capturing at the highest frame rate\n");
+		fflush(stdout);
+		policy = CAPTURE_MODE_MAX_FPS;
+	}
+}
+
+// Must be called with cache_lock held
+static void load_cache() {
+	capture_modes_file_header_t header;
+
+	cache_loaded = 1;
+	cache_count = 0;
+
+	FILE *in = fopen(CAPTURE_MODES_FILE, "rb");
+
+	if (in == NULL) {
+		return;
+	}
+
+	if (
+		fread(&header, sizeof(header), 1, in) == 1 &&
+		header.magic == CAPTURE_MODES_MAGIC &&
+		header.version == CAPTURE_MODES_VERSION &&
+		header.count <= CAPTURE_MODE_CACHE_SIZE &&
+		fread(cache, sizeof(capture_mode_record_t), header.count, in) == header.count
+	) {
+		cache_count = header.count;
+	}
+
+	fclose(in);
+}
+
+// Must be called with cache_lock held
+static void write_cache() {
+	capture_modes_file_header_t header;
+
+	FILE *out = fopen(CAPTURE_MODES_TMP_FILE, "wb");
+
+	if (out == NULL) {
+		printf("Failed to write capture modes: %s\n", strerror(errno));
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CAPTURE_MODES_MAGIC;
+	header.version = CAPTURE_MODES_VERSION;
+	header.count = cache_count;
+
+	int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+	failed |= fwrite(cache, sizeof(capture_mode_record_t), cache_count, out) != (size_t) cache_count;
+	failed |= fflush(out) != 0 || fsync(fileno(out)) != 0;
+	failed |= fclose(out) != 0;
+
+	if (failed || rename(CAPTURE_MODES_TMP_FILE, CAPTURE_MODES_FILE) != 0) {
+		printf("Failed to write capture modes: %s\n", strerror(errno));
+		unlink(CAPTURE_MODES_TMP_FILE);
+	}
+}
+
+// Must be called with cache_lock held
+static int find_record(const char *usb_id) {
+	for (int i = 0; i < cache_count; i++) {
+		capture_mode_record_t *record = &cache[i];
+
+		if (
+			strcmp(record->usb_id, usb_id) == 0 &&
+			record->policy == policy &&
+			record->target_width == target_width &&
+			record->target_height == target_height &&
+			record->refresh_rate == display_refresh_rate
+		) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int read_sysfs_id(const char *device, const char *name, char *value, size_t size) {
+	char path[PATH_MAX];
+
+	// device is the USB interface, the ids are on the USB device above it
+	snprintf(path, sizeof(path), "/sys/class/video4linux/%s/device/../%s", device, name);
+
+	FILE *in = fopen(path, "r");
+
+	if (in == NULL) {
+		return -1;
+	}
+
+	int found = fgets(value, size, in) != NULL;
+
+	fclose(in);
+
+	if (!found) {
+		return -1;
+	}
+
+	value[strcspn(value, "\n")] = 0;
+
+	return 0;
+}
+
+static void read_usb_id(const char *path, const char *card, char *usb_id, size_t size) {
+	char real_path[PATH_MAX];
+	char vendor[8];
+	char product[8];
+
+	// by-id and by-path links resolve to the videoN node
+	if (realpath(path, real_path) != NULL) {
+		const char *device = strrchr(real_path, '/');
+		device = device ? device + 1 : real_path;
+
+		if (read_sysfs_id(device, "idVendor", vendor, sizeof(vendor)) == 0 && read_sysfs_id(device, "idProduct", product, sizeof(product)) == 0) {
+			snprintf(usb_id, size, "%s:%s", vendor, product);
+			return;
+		}
+	}
+
+	snprintf(usb_id, size, "%s", card);
+}
+
+// Frame rates compared as fractions, intervals are numerator / denominator seconds
+static int faster(const struct v4l2_fract *a, const struct v4l2_fract *b) {
+	return (uint64_t) a->numerator * b->denominator < (uint64_t) b->numerator * a->denominator;
+}
+
+static double fps(const struct v4l2_fract *interval) {
+	return interval->numerator ? (double) interval->denominator / interval->numerator : 0;
+}
+
+static uint32_t align_down(uint32_t value, uint32_t min, uint32_t max, uint32_t step) {
+	value = value < min ? min : value > max ? max : value;
+
+	if (step > 1) {
+		value = min + ((value - min) / step) * step;
+	}
+
+	return value;
+}
+
+// The target size when offered, otherwise the largest one inside it, otherwise the smallest
+static int choose_size(int fd, uint32_t *width, uint32_t *height) {
+	struct v4l2_frmsizeenum size;
+	uint64_t best_area = 0;
+	int best_inside = 0;
+	int found = 0;
+
+	memset(&size, 0, sizeof(size));
+	size.pixel_format = V4L2_PIX_FMT_MJPEG;
+
+	for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+		uint32_t w;
+		uint32_t h;
+
+		if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			w = size.discrete.width;
+			h = size.discrete.height;
+		} else {
+			w = align_down(target_width, size.stepwise.min_width, size.stepwise.max_width, size.stepwise.step_width);
+			h = align_down(target_height, size.stepwise.min_height, size.stepwise.max_height, size.stepwise.step_height);
+		}
+
+		uint64_t area = (uint64_t) w * h;
+		int inside = w <= target_width && h <= target_height;
+
+		if (
+			!found ||
+			(inside && !best_inside) ||
+			(inside && best_inside && area > best_area) ||
+			(!inside && !best_inside && area < best_area)
+		) {
+			*width = w;
+			*height = h;
+			best_area = area;
+			best_inside = inside;
+			found = 1;
+		}
+
+		// Stepwise and continuous sizes are reported once
+		if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+			break;
+		}
+	}
+
+	return found;
+}
+
+static void add_interval(capture_mode_t *mode, uint32_t numerator, uint32_t denominator) {
+	if (mode->interval_count >= CAPTURE_MODE_MAX_INTERVALS || numerator == 0 || denominator == 0) {
+		return;
+	}
+
+	mode->intervals[mode->interval_count].numerator = numerator;
+	mode->intervals[mode->interval_count].denominator = denominator;
+	mode->interval_count++;
+}
+
+static int compare_intervals(const void *a, const void *b) {
+	const struct v4l2_fract *x = a;
+	const struct v4l2_fract *y = b;
+
+	return faster(x, y) ? -1 : faster(y, x);
+}
+
+static void enumerate_intervals(int fd, capture_mode_t *mode) {
+	struct v4l2_frmivalenum interval;
+
+	memset(&interval, 0, sizeof(interval));
+	interval.pixel_format = V4L2_PIX_FMT_MJPEG;
+	interval.width = mode->width;
+	interval.height = mode->height;
+
+	for (interval.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0; interval.index++) {
+		if (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+			add_interval(mode, interval.discrete.numerator, interval.discrete.denominator);
+			continue;
+		}
+
+		// Stepwise and continuous: the fastest, the display rate when inside, the slowest
+		struct v4l2_fract display = { 1, display_refresh_rate };
+
+		add_interval(mode, interval.stepwise.min.numerator, interval.stepwise.min.denominator);
+
+		if (display_refresh_rate && !faster(&display, &interval.stepwise.min) && !faster(&interval.stepwise.max, &display)) {
+			add_interval(mode, display.numerator, display.denominator);
+		}
+
+		add_interval(mode, interval.stepwise.max.numerator, interval.stepwise.max.denominator);
+		break;
+	}
+
+	qsort(mode->intervals, mode->interval_count, sizeof(struct v4l2_fract), compare_intervals);
+}
+
+// Fastest first already, with the display policy the list starts at the fastest rate that
+// divides the refresh rate, or the fastest one not above it
+static void apply_policy(capture_mode_t *mode) {
+	uint32_t first;
+
+	if (policy != CAPTURE_MODE_DISPLAY_RATE || mode->interval_count == 0) {
+		return;
+	}
+
+	uint32_t not_above = mode->interval_count;
+	uint32_t divisor = mode->interval_count;
+
+	for (uint32_t i = 0; i < mode->interval_count; i++) {
+		double rate = fps(&mode->intervals[i]);
+		double ratio = display_refresh_rate / rate;
+
+		if (rate > display_refresh_rate * (1 + DIVISOR_TOLERANCE)) {
+			continue;
+		}
+
+		if (not_above == mode->interval_count) {
+			not_above = i;
+		}
+
+		if (fabs(ratio - round(ratio)) < DIVISOR_TOLERANCE * ratio) {
+			divisor = i;
+			break;
+		}
+	}
+
+	if (divisor < mode->interval_count) {
+		first = divisor;
+	} else if (not_above < mode->interval_count) {
+		first = not_above;
+	} else {
+		// All faster than the display, the slowest is the closest
+		first = mode->interval_count - 1;
+	}
+
+	memmove(mode->intervals, mode->intervals + first, (mode->interval_count - first) * sizeof(struct v4l2_fract));
+	mode->interval_count -= first;
+}
+
+static int from_cache(capture_mode_t *mode) {
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (!cache_loaded) {
+		load_cache();
+	}
+
+	int index = find_record(mode->usb_id);
+
+	// A damaged file can hold any count, the record is dropped and the camera enumerated
+	if (index >= 0 && (cache[index].interval_count == 0 || cache[index].interval_count > CAPTURE_MODE_MAX_INTERVALS)) {
+		printf("Camera %s: cached mode has %u frame rates, enumerating again\n", mode->usb_id, cache[index].interval_count);
+		memmove(cache + index, cache + index + 1, (cache_count - index - 1) * sizeof(capture_mode_record_t));
+		cache_count--;
+		write_cache();
+		index = -1;
+	}
+
+	if (index >= 0) {
+		capture_mode_record_t *record = &cache[index];
+
+		mode->width = record->width;
+		mode->height = record->height;
+		mode->interval_count = record->interval_count;
+		memcpy(mode->intervals, record->intervals, sizeof(mode->intervals));
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return found;
+}
+
+int capture_mode_negotiate(int fd, const char *path, const char *card, capture_mode_t *mode) {
+	memset(mode, 0, sizeof(capture_mode_t));
+
+	read_usb_id(path, card, mode->usb_id, sizeof(mode->usb_id));
+
+	if (from_cache(mode)) {
+		mode->from_cache = 1;
+		printf("Camera %s: cached mode %ux%u at %.2f fps\n", mode->usb_id, mode->width, mode->height, fps(&mode->intervals[0]));
+		fflush(stdout);
+		return 0;
+	}
+
+	if (!choose_size(fd, &mode->width, &mode->height)) {
+		// Drivers without size enumeration take the target as is
+		printf("Camera %s does not enumerate MJPEG sizes\n", mode->usb_id);
+		mode->width = target_width;
+		mode->height = target_height;
+	}
+
+	enumerate_intervals(fd, mode);
+	apply_policy(mode);
+
+	printf("Camera %s: %ux%u, %u frame rates, starting at %.2f fps\n",
+		mode->usb_id,
+		mode->width,
+		mode->height,
+		mode->interval_count,
+		mode->interval_count ? fps(&mode->intervals[0]) : 0
+	);
+	fflush(stdout);
+
+	return 0;
+}
+
+void capture_mode_apply_interval(int fd, capture_mode_t *mode) {
+	struct v4l2_streamparm parm;
+
+	if (mode->interval_index >= mode->interval_count) {
+		return;
+	}
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (ioctl(fd, VIDIOC_G_PARM, &parm) != 0 || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+		return;
+	}
+
+	parm.parm.capture.timeperframe = mode->intervals[mode->interval_index];
+
+	if (ioctl(fd, VIDIOC_S_PARM, &parm) != 0) {
+		printf("Failed setting frame interval: %s\n", strerror(errno));
+		fflush(stdout);
+	}
+}
+
+int capture_mode_step_down(int fd, capture_mode_t *mode) {
+	if (mode->interval_index + 1 >= mode->interval_count) {
+		return -1;
+	}
+
+	mode->interval_index++;
+
+	printf("Camera %s: not enough USB bandwidth, trying %.2f fps\n", mode->usb_id, fps(&mode->intervals[mode->interval_index]));
+	fflush(stdout);
+
+	capture_mode_apply_interval(fd, mode);
+
+	return 0;
+}
+
+void capture_mode_confirm(capture_mode_t *mode) {
+	capture_mode_record_t record;
+
+	// Without rates there is nothing enumeration would not find as fast, and from_cache
+	// would drop the record again
+	if (mode->from_cache || mode->interval_count == 0) {
+		return;
+	}
+
+	memset(&record, 0, sizeof(record));
+	snprintf(record.usb_id, sizeof(record.usb_id), "%s", mode->usb_id);
+	record.policy = policy;
+	record.target_width = target_width;
+	record.target_height = target_height;
+	record.refresh_rate = display_refresh_rate;
+	record.width = mode->width;
+	record.height = mode->height;
+
+	// Every rate is kept, the bandwidth may have been short only this time (a shared bus, a
+	// second camera of the same model), each open starts from the fastest again
+	record.interval_count = mode->interval_count;
+	memcpy(record.intervals, mode->intervals, sizeof(record.intervals));
+
+	pthread_mutex_lock(&cache_lock);
+
+	int index = find_record(mode->usb_id);
+
+	if (index < 0) {
+		// Full, the oldest camera goes
+		if (cache_count == CAPTURE_MODE_CACHE_SIZE) {
+			memmove(cache, cache + 1, (CAPTURE_MODE_CACHE_SIZE - 1) * sizeof(capture_mode_record_t));
+			cache_count--;
+		}
+
+		index = cache_count++;
+	}
+
+	cache[index] = record;
+	write_cache();
+
+	pthread_mutex_unlock(&cache_lock);
+
+	// Matches its record now, a restart of the stream does not write it again
+	mode->from_cache = 1;
+}
+
+void capture_mode_forget(capture_mode_t *mode) {
+	pthread_mutex_lock(&cache_lock);
+
+	int index = find_record(mode->usb_id);
+
+	if (index >= 0) {
+		memmove(cache + index, cache + index + 1, (cache_count - index - 1) * sizeof(capture_mode_record_t));
+		cache_count--;
+		write_cache();
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	mode->from_cache = 0;
+}
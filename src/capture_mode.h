@@ -0,0 +1,61 @@
+#ifndef _CAPTURE_MODE_H_
+#define _CAPTURE_MODE_H_
+
+#include <inttypes.h>
+#include <linux/videodev2.h>
+
+// MJPEG size and frame interval negotiation for V4L2 cameras. The chosen mode is cached per
+// camera USB id, a replugged camera is set up again without enumerating.
+
+#ifndef CAPTURE_MODES_FILE
+#define CAPTURE_MODES_FILE "/var/www/camview/capture_modes.bin"
+#endif
+
+// Highest frame rate at the target size
+#define CAPTURE_MODE_MAX_FPS 0
+// Highest frame rate the display refresh rate is a multiple of, so frames are shown evenly
+#define CAPTURE_MODE_DISPLAY_RATE 1
+
+#define CAPTURE_MODE_DEFAULT_WIDTH 1920
+#define CAPTURE_MODE_DEFAULT_HEIGHT 1080
+
+#define CAPTURE_MODE_MAX_INTERVALS 16
+#define CAPTURE_MODE_ID_MAX 32
+
+typedef struct {
+    // vendor:product of the USB camera, the driver card name when it is not USB
+    char usb_id[CAPTURE_MODE_ID_MAX];
+
+    uint32_t width;
+    uint32_t height;
+
+    // At that size, the chosen interval first then the slower ones, stepped through when
+    // the USB bandwidth does not allow the stream
+    struct v4l2_fract intervals[CAPTURE_MODE_MAX_INTERVALS];
+    uint32_t interval_count;
+    uint32_t interval_index;
+
+    uint8_t from_cache;
+} capture_mode_t;
+
+// Before the cameras are opened. refresh_rate is the display's, in Hz, 0 when unknown.
+void capture_mode_set_policy(int policy, uint32_t width, uint32_t height, uint32_t refresh_rate);
+
+// Picks the size and intervals for the camera, from the cache or by enumeration. The caller
+// has found the MJPEG format already, a camera that enumerates no sizes or rates gets the
+// target size at its default rate, so this always returns 0.
+int capture_mode_negotiate(int fd, const char *path, const char *card, capture_mode_t *mode);
+
+// Sets the current interval with VIDIOC_S_PARM, after the format is set
+void capture_mode_apply_interval(int fd, capture_mode_t *mode);
+
+// STREAMON ran out of USB bandwidth, sets the next slower interval. Returns 0 when there was one.
+int capture_mode_step_down(int fd, capture_mode_t *mode);
+
+// The stream is running, the mode is remembered for the camera
+void capture_mode_confirm(capture_mode_t *mode);
+
+// The cached mode did not apply, the next open enumerates again
+void capture_mode_forget(capture_mode_t *mode);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "jpeg.h"
+
+// Replays MJPEG frames from a file, a pipe or stdin ("-").
+// Files are memory mapped and may hold concatenated JPEG frames or an AVI/MJPEG container,
+// frames are handed out straight from the mapping. Pipes carry concatenated frames only.
+
+#define REPLAY_MAX_FRAME_SIZE (16 * 1024 * 1024)
+#define REPLAY_READ_CHUNK 65536
+#define REPLAY_INITIAL_INDEX_SIZE 256
+
+struct replay_frame_entry {
+	size_t offset;
+	size_t length;
+};
+
+struct replay_state {
+	int fd;
+	int is_stream;
+
+	// File mode
+	uint8_t *map;
+	size_t map_size;
+	struct replay_frame_entry *frames;
+	uint32_t frame_count;
+	uint32_t frame_capacity;
+	uint32_t next_frame;
+
+	// Stream mode
+	uint8_t *buffer;
+	size_t buffer_used;
+	size_t frame_length;
+
+	uint32_t sequence;
+	uint64_t start_ns;
+};
+
+static void add_frame(struct replay_state *state, size_t offset, size_t length) {
+	if (length < 4 || length > REPLAY_MAX_FRAME_SIZE) {
+		return;
+	}
+
+	if (state->frame_count == state->frame_capacity) {
+		state->frame_capacity = state->frame_capacity ? state->frame_capacity * 2 : REPLAY_INITIAL_INDEX_SIZE;
+		state->frames = realloc(state->frames, state->frame_capacity * sizeof(struct replay_frame_entry));
+	}
+
+	state->frames[state->frame_count].offset = offset;
+	state->frames[state->frame_count].length = length;
+	state->frame_count++;
+}
+
+static uint32_t read_le32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Walks RIFF chunks between pos and end, descending into LIST chunks.
+// Video chunks are named ##dc (compressed) or ##db (uncompressed, still JPEG for MJPEG AVIs).
+// Sizes are compared against what is left, pos + size can wrap size_t on 32 bit.
+static void index_avi_chunks(struct replay_state *state, size_t pos, size_t end) {
+	while (end - pos >= 8) {
+		const uint8_t *chunk = state->map + pos;
+		size_t size = read_le32(chunk + 4);
+		int is_list = memcmp(chunk, "LIST", 4) == 0 || memcmp(chunk, "RIFF", 4) == 0;
+
+		// A recording that was cut short, or written as a stream with sizes left at 0, has
+		// lists running past the end of the file. They are read up to the end.
+		if (is_list && (size == 0 || size > end - pos - 8)) {
+			size = end - pos - 8;
+		}
+
+		if (size > end - pos - 8) {
+			break;
+		}
+
+		if (is_list) {
+			// The list type comes first
+			if (size >= 4) {
+				index_avi_chunks(state, pos + 12, pos + 8 + size);
+			}
+		} else if (chunk[2] == 'd' && (chunk[3] == 'c' || chunk[3] == 'b')) {
+			add_frame(state, pos + 8, size);
+		}
+
+		// The pad byte of an odd sized chunk can be cut off at the end of the file
+		if ((size & 1) && size == end - pos - 8) {
+			break;
+		}
+
+		pos += 8 + size + (size & 1);
+	}
+}
+
+static void index_jpeg_frames(struct replay_state *state) {
+	size_t pos = 0;
+	size_t start;
+
+	while (pos + 1 < state->map_size) {
+		if (state->map[pos] != 0xff || state->map[pos + 1] != 0xd8) {
+			pos++;
+			continue;
+		}
+
+		start = pos;
+		pos += 2;
+
+		// 0xFF 0xD9 cannot show up inside entropy coded data, it is always stuffed
+		while (pos + 1 < state->map_size && !(state->map[pos] == 0xff && state->map[pos + 1] == 0xd9)) {
+			pos++;
+		}
+
+		if (pos + 1 >= state->map_size) {
+			break;
+		}
+
+		pos += 2;
+		add_frame(state, start, pos - start);
+	}
+}
+
+// Makes sure the stream buffer starts with a complete frame. Returns 0 on success.
+static int stream_fill_frame(struct replay_state *state) {
+	size_t pos;
+	ssize_t result;
+
+	while (1) {
+		// Drop garbage before SOI
+		pos = 0;
+
+		while (pos + 1 < state->buffer_used && !(state->buffer[pos] == 0xff && state->buffer[pos + 1] == 0xd8)) {
+			pos++;
+		}
+
+		if (pos > 0) {
+			memmove(state->buffer, state->buffer + pos, state->buffer_used - pos);
+			state->buffer_used -= pos;
+		}
+
+		for (pos = 2; pos + 1 < state->buffer_used; pos++) {
+			if (state->buffer[pos] == 0xff && state->buffer[pos + 1] == 0xd9) {
+				state->frame_length = pos + 2;
+				return 0;
+			}
+		}
+
+		if (state->buffer_used + REPLAY_READ_CHUNK > REPLAY_MAX_FRAME_SIZE) {
+			printf("Replay frame larger than %i bytes, dropping data\n", REPLAY_MAX_FRAME_SIZE);
+			fflush(stdout);
+			state->buffer_used = 0;
+		}
+
+		result = read(state->fd, state->buffer + state->buffer_used, REPLAY_READ_CHUNK);
+
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (result <= 0) {
+			printf("Replay stream ended\n");
+			fflush(stdout);
+			return -1;
+		}
+
+		state->buffer_used += result;
+	}
+}
+
+static int replay_open(capture_source_t *source) {
+	struct replay_state *state;
+	struct stat st;
+	struct jpeg_t jpeg;
+	uint8_t *first_frame;
+	uint32_t first_length;
+
+	printf("Opening replay source %s at %u fps\n", source->path, source->replay_fps);
+	fflush(stdout);
+
+	state = calloc(1, sizeof(struct replay_state));
+
+	if (strcmp(source->path, "-") == 0) {
+		state->fd = dup(STDIN_FILENO);
+	} else {
+		state->fd = open(source->path, O_RDONLY);
+	}
+
+	if (state->fd == -1) {
+		printf("Failed opening replay source %s: %s\n", source->path, strerror(errno));
+		free(state);
+		return -1;
+	}
+
+	state->is_stream = fstat(state->fd, &st) != 0 || !S_ISREG(st.st_mode);
+
+	if (state->is_stream) {
+		state->buffer = malloc(REPLAY_MAX_FRAME_SIZE);
+
+		if (stream_fill_frame(state) != 0) {
+			goto err;
+		}
+
+		first_frame = state->buffer;
+		first_length = state->frame_length;
+	} else {
+		state->map_size = st.st_size;
+		state->map = mmap(NULL, state->map_size, PROT_READ, MAP_SHARED, state->fd, 0);
+
+		if (state->map == MAP_FAILED) {
+			printf("Failed mapping replay file: %s\n", strerror(errno));
+			state->map = NULL;
+			goto err;
+		}
+
+		if (state->map_size > 12 && memcmp(state->map, "RIFF", 4) == 0 && memcmp(state->map + 8, "AVI ", 4) == 0) {
+			index_avi_chunks(state, 0, state->map_size);
+		}
+
+		// Not an AVI, or one too damaged to walk, the frames are still found by their markers
+		if (state->frame_count == 0) {
+			index_jpeg_frames(state);
+		}
+
+		if (state->frame_count == 0) {
+			printf("No MJPEG frames found in %s\n", source->path);
+			goto err;
+		}
+
+		printf("Replay indexed %u frames\n", state->frame_count);
+
+		first_frame = state->map + state->frames[0].offset;
+		first_length = state->frames[0].length;
+	}
+
+	memset(&jpeg, 0, sizeof(jpeg));
+
+	if (!parse_jpeg(&jpeg, first_frame, first_length)) {
+		printf("Replay first frame is not a valid JPEG\n");
+		goto err;
+	}
+
+	source->width = jpeg.width;
+	source->height = jpeg.height;
+	source->frame_interval_ns = source->replay_fps ? 1000000000ULL / source->replay_fps : 0;
+	source->replay = state;
+
+	fflush(stdout);
+	return 0;
+
+err:
+	fflush(stdout);
+
+	if (state->map) {
+		munmap(state->map, state->map_size);
+	}
+
+	free(state->frames);
+	free(state->buffer);
+	close(state->fd);
+	free(state);
+	return -1;
+}
+
+static int replay_start(capture_source_t *source) {
+	struct replay_state *state = source->replay;
+
+	state->sequence = 0;
+	state->next_frame = 0;
+	state->start_ns = capture_now_ns();
+
+	return 0;
+}
+
+static int replay_dequeue(capture_source_t *source, capture_frame_t *frame) {
+	struct replay_state *state = source->replay;
+	struct timespec ts;
+	uint64_t target;
+
+	if (state->is_stream) {
+		if (stream_fill_frame(state) != 0) {
+			return -1;
+		}
+
+		frame->data = state->buffer;
+		frame->length = state->frame_length;
+		frame->index = 0;
+	} else {
+		// Files replay in a loop
+		if (state->next_frame >= state->frame_count) {
+			state->next_frame = 0;
+		}
+
+		frame->data = state->map + state->frames[state->next_frame].offset;
+		frame->length = state->frames[state->next_frame].length;
+		frame->index = state->next_frame;
+		state->next_frame++;
+	}
+
+	frame->sequence = state->sequence;
+	frame->monotonic = 1;
+
+	if (source->frame_interval_ns) {
+		target = state->start_ns + (state->sequence * source->frame_interval_ns);
+
+		ts.tv_sec = target / 1000000000ULL;
+		ts.tv_nsec = target % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+		frame->timestamp_ns = target;
+	} else {
+		frame->timestamp_ns = capture_now_ns();
+	}
+
+	state->sequence++;
+
+	return 0;
+}
+
+// Paced files are behind once the next frame is due. Unpaced replays and pipes have no
+// clock to be behind of.
+static int replay_ready(capture_source_t *source) {
+	struct replay_state *state = source->replay;
+
+	if (state->is_stream || source->frame_interval_ns == 0) {
+		return 0;
+	}
+
+	return capture_now_ns() >= state->start_ns + (state->sequence * source->frame_interval_ns);
+}
+
+static int replay_requeue(capture_source_t *source, capture_frame_t *frame) {
+	struct replay_state *state = source->replay;
+
+	if (state->is_stream) {
+		memmove(state->buffer, state->buffer + state->frame_length, state->buffer_used - state->frame_length);
+		state->buffer_used -= state->frame_length;
+		state->frame_length = 0;
+	}
+
+	return 0;
+}
+
+static void replay_stop(capture_source_t *source) {
+}
+
+// Dequeue sleeps until the frame is due, there is nothing to poll
+static int replay_event_fd(capture_source_t *source) {
+	return -1;
+}
+
+static int replay_restart(capture_source_t *source) {
+	return replay_start(source);
+}
+
+static void replay_close(capture_source_t *source) {
+	struct replay_state *state = source->replay;
+
+	if (state == NULL) {
+		return;
+	}
+
+	if (state->map) {
+		munmap(state->map, state->map_size);
+	}
+
+	free(state->frames);
+	free(state->buffer);
+	close(state->fd);
+	free(state);
+
+	source->replay = NULL;
+}
+
+// Files don't come back by themselves, retry at the given interval
+static int replay_wait(capture_source_t *source, int timeout_ms) {
+	usleep(timeout_ms * 1000);
+
+	return -1;
+}
+
+const capture_ops_t capture_replay_ops = {
+	.open = replay_open,
+	.start = replay_start,
+	.dequeue = replay_dequeue,
+	.ready = replay_ready,
+	.requeue = replay_requeue,
+	.stop = replay_stop,
+	.event_fd = replay_event_fd,
+	.restart = replay_restart,
+	.close = replay_close,
+	.wait = replay_wait
+};
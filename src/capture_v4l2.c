@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/videodev2.h>
+
+#include "capture.h"
+
+#define DEFAULT_FRAME_INTERVAL_NS 33333333ULL
+
+// A node that exists but failed to open is usually still being set up by udev or the driver
+#define DEVICE_SETTLE_MS 200
+
+static uint64_t get_frame_interval_ns(capture_source_t *source) {
+	struct v4l2_streamparm parm;
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = source->current_format_desc.type;
+
+	if (
+		ioctl(source->video_device.device_file, VIDIOC_G_PARM, &parm) == 0 &&
+		parm.parm.capture.timeperframe.denominator != 0 &&
+		parm.parm.capture.timeperframe.numerator != 0
+	) {
+		return (uint64_t)parm.parm.capture.timeperframe.numerator * 1000000000ULL / parm.parm.capture.timeperframe.denominator;
+	}
+
+	return DEFAULT_FRAME_INTERVAL_NS;
+}
+
+static void unmap_buffers(capture_source_t *source) {
+	for (int i = 0; i < CAPTURE_MAX_BUFFER_COUNT; i++) {
+		if (source->buffer_memory_map[i] != MAP_FAILED) {
+			munmap(source->buffer_memory_map[i], source->buffer_memory_map_size[i]);
+			source->buffer_memory_map[i] = MAP_FAILED;
+			source->buffer_memory_map_size[i] = 0;
+		}
+	}
+}
+
+static int v4l2_open(capture_source_t *source) {
+	video_device_t *video_device = &source->video_device;
+
+	printf("Opening video device %s\n", source->path);
+	fflush(stdout);
+
+	// Frames are waited for with epoll, DQBUF never blocks the capture thread
+	video_device->device_file = open(source->path, O_RDWR | O_NONBLOCK);
+
+	if (video_device->device_file == -1) {
+		printf("Failed opening video device %s: %s\n", source->path, strerror(errno));
+
+		if (errno == ENOENT) {
+			source->settle_pending = 1;
+		}
+
+		return -1;
+	}
+
+	source->settle_pending = 0;
+
+	struct v4l2_capability capability;
+	memset(&capability, 0, sizeof(capability));
+
+	if (ioctl(video_device->device_file, VIDIOC_QUERYCAP, &capability) == 0) {
+		snprintf(video_device->card, sizeof(video_device->card), "%s", (const char*) capability.card);
+		printf("Camera: %s\n", video_device->card);
+	} else {
+		video_device->card[0] = 0;
+	}
+
+	memset(&source->current_format_desc, 0, sizeof(source->current_format_desc));
+	source->current_format_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	int found_format_desc = 0;
+
+	while (1) {
+		int result = ioctl(video_device->device_file, VIDIOC_ENUM_FMT, &source->current_format_desc);
+		if (result == 0) {
+			if (source->current_format_desc.pixelformat == V4L2_PIX_FMT_MJPEG) {
+				found_format_desc = 1;
+				break;
+			}
+			printf("Found format desc type: %s\n", source->current_format_desc.description);
+		} else {
+			result = errno;
+
+			if (result != EINVAL) {
+				printf("Failed enumerating formats: %s", strerror(result));
+			}
+			break;
+		}
+
+		source->current_format_desc.index++;
+	}
+
+	if (!found_format_desc) {
+		printf("Cannot find MJPEG format.\n");
+		fflush(stdout);
+		goto err;
+	}
+
+	if (capture_mode_negotiate(video_device->device_file, source->path, video_device->card, &source->mode) != 0) {
+		goto err;
+	}
+
+	printf("Setting format\n");
+	fflush(stdout);
+
+	memset(&source->current_format, 0, sizeof(source->current_format));
+	source->current_format.type = source->current_format_desc.type;
+	source->current_format.fmt.pix.pixelformat = source->current_format_desc.pixelformat;
+	source->current_format.fmt.pix.width = source->mode.width;
+	source->current_format.fmt.pix.height = source->mode.height;
+	source->current_format.fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+
+	if (ioctl(video_device->device_file, VIDIOC_S_FMT, &source->current_format) != 0) {
+		printf("Failed setting device video format: %s\n", strerror(errno));
+	}
+
+	printf("Getting format\n");
+	fflush(stdout);
+
+	if (ioctl(video_device->device_file, VIDIOC_G_FMT, &source->current_format) != 0) {
+		printf("Failed getting device video format: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (source->current_format.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
+		printf("Fail: device does not output to MJPEG.\n");
+		goto err;
+	}
+
+	if (source->current_format.fmt.pix.width != source->mode.width || source->current_format.fmt.pix.height != source->mode.height) {
+		printf("Camera set %ux%u instead of %ux%u\n", source->current_format.fmt.pix.width, source->current_format.fmt.pix.height, source->mode.width, source->mode.height);
+		fflush(stdout);
+
+		// Enumerated again on the next open
+		if (source->mode.from_cache) {
+			capture_mode_forget(&source->mode);
+			goto err;
+		}
+	}
+
+	capture_mode_apply_interval(video_device->device_file, &source->mode);
+
+	source->width = source->current_format.fmt.pix.width;
+	source->height = source->current_format.fmt.pix.height;
+	source->frame_interval_ns = get_frame_interval_ns(source);
+
+	struct v4l2_requestbuffers req;
+	memset(&req, 0, sizeof(req));//setting the buffer count as 1
+	req.count  = source->buffer_count;
+	req.type   = source->current_format_desc.type;//use the mmap for mapping the buffer
+	req.memory = V4L2_MEMORY_MMAP;
+
+	printf("Requesting Buffers\n");
+	fflush(stdout);
+
+	if (ioctl(video_device->device_file, VIDIOC_REQBUFS, &req) != 0) {
+		printf("Failed to request buffers: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (req.count != source->buffer_count) {
+		printf("Driver allocated %u buffers of the %u requested\n", req.count, source->buffer_count);
+	}
+
+	if (req.count > CAPTURE_MAX_BUFFER_COUNT) {
+		req.count = CAPTURE_MAX_BUFFER_COUNT;
+	}
+
+	printf("Querying Buffers\n");
+	fflush(stdout);
+
+	int has_buffer_mapped = 0;
+
+	for (int i = 0; i < (int) req.count; i++) {
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = req.type;
+		buf.memory = req.memory;
+		buf.index = i;
+
+		if (ioctl(video_device->device_file, VIDIOC_QUERYBUF, &buf) == 0) {
+			source->buffer_memory_map[i] = mmap(NULL /* start anywhere */,
+				buf.length,
+				PROT_READ | PROT_WRITE /* required */,
+				MAP_SHARED /* recommended */,
+				video_device->device_file,
+				buf.m.offset
+			);
+
+			if (source->buffer_memory_map[i] == MAP_FAILED) {
+				break;
+			}
+
+			source->buffer_memory_map_size[i] = buf.length;
+
+			if (ioctl(video_device->device_file, VIDIOC_QBUF, &buf) == 0) {
+				has_buffer_mapped = 1;
+			} else {
+				printf("Failed to QBUF #%i: %s\n", i, strerror(errno));
+				break;
+			}
+		} else {
+			source->buffer_memory_map[i] = MAP_FAILED;
+			source->buffer_memory_map_size[i] = 0;
+			printf("Failed to query video buffer #%i: %s\n", i, strerror(errno));
+			break;
+		}
+	}
+
+	if (!has_buffer_mapped) {
+		printf("No buffers where mapped. will retry opening device.");
+		goto err;
+	}
+
+	control_catalog_build(&video_device->controls, video_device->device_file);
+
+	return 0;
+
+err:
+	unmap_buffers(source);
+	close(video_device->device_file);
+	video_device->device_file = -1;
+	return -1;
+}
+
+static int v4l2_start(capture_source_t *source) {
+	enum v4l2_buf_type buffer_type = source->current_format_desc.type;
+
+	printf("Enabling stream on %s\n", source->path);
+	fflush(stdout);
+
+	// UVC reserves the isochronous bandwidth of the frame rate at STREAMON, a rate the bus
+	// can't carry fails with ENOSPC and the next slower one is tried
+	while (ioctl(source->video_device.device_file, VIDIOC_STREAMON, &buffer_type) != 0) {
+		if (errno != ENOSPC || capture_mode_step_down(source->video_device.device_file, &source->mode) != 0) {
+			printf("Failed to enable stream: %s\n", strerror(errno));
+			fflush(stdout);
+			return -1;
+		}
+	}
+
+	source->frame_interval_ns = get_frame_interval_ns(source);
+	capture_mode_confirm(&source->mode);
+
+	return 0;
+}
+
+static int v4l2_dequeue(capture_source_t *source, capture_frame_t *frame) {
+	struct v4l2_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+
+	buf.type = source->current_format_desc.type;
+
+	if (ioctl(source->video_device.device_file, VIDIOC_DQBUF, &buf) != 0) {
+		if (errno == EAGAIN) {
+			return CAPTURE_AGAIN;
+		}
+
+		printf("VIDIOC_DQBUF Failed: %s\n", strerror(errno));
+		fflush(stdout);
+		return -1;
+	}
+
+	frame->data = source->buffer_memory_map[buf.index];
+	frame->length = buf.bytesused;
+	frame->index = buf.index;
+	frame->sequence = buf.sequence;
+	frame->timestamp_ns = ((uint64_t)buf.timestamp.tv_sec * 1000000000ULL) + ((uint64_t)buf.timestamp.tv_usec * 1000ULL);
+	frame->monotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+
+	return 0;
+}
+
+static int v4l2_ready(capture_source_t *source) {
+	struct pollfd pfd;
+
+	pfd.fd = source->video_device.device_file;
+	pfd.events = POLLIN;
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static int v4l2_requeue(capture_source_t *source, capture_frame_t *frame) {
+	struct v4l2_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+
+	buf.type = source->current_format_desc.type;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = frame->index;
+
+	if (ioctl(source->video_device.device_file, VIDIOC_QBUF, &buf) != 0) {
+		printf("VIDIOC_QBUF Failed: %s\n", strerror(errno));
+		fflush(stdout);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void v4l2_stop(capture_source_t *source) {
+	enum v4l2_buf_type buffer_type = source->current_format_desc.type;
+
+	if (ioctl(source->video_device.device_file, VIDIOC_STREAMOFF, &buffer_type) != 0) {
+		printf("STREAMOFF failed: %s\n", strerror(errno));
+		fflush(stdout);
+	}
+}
+
+static int v4l2_event_fd(capture_source_t *source) {
+	return source->video_device.device_file;
+}
+
+// STREAMOFF hands every buffer back, they are all queued again before STREAMON. The format,
+// the frame interval and the mappings stay.
+static int v4l2_restart(capture_source_t *source) {
+	v4l2_stop(source);
+
+	for (int i = 0; i < CAPTURE_MAX_BUFFER_COUNT; i++) {
+		capture_frame_t frame;
+
+		if (source->buffer_memory_map[i] == MAP_FAILED) {
+			continue;
+		}
+
+		frame.index = i;
+
+		if (v4l2_requeue(source, &frame) != 0) {
+			return -1;
+		}
+	}
+
+	return v4l2_start(source);
+}
+
+static void v4l2_close(capture_source_t *source) {
+	unmap_buffers(source);
+	control_catalog_clear(&source->video_device.controls);
+
+	if (source->video_device.device_file != -1) {
+		close(source->video_device.device_file);
+		source->video_device.device_file = -1;
+	}
+}
+
+// Watches the directory of the device node, a replugged camera is opened as soon as udev
+// creates the node again instead of at the next retry.
+static int v4l2_wait(capture_source_t *source, int timeout_ms) {
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char directory[PATH_MAX];
+	const char *name = strrchr(source->path, '/');
+	struct pollfd pfd;
+	int found = 0;
+
+	if (name == NULL) {
+		snprintf(directory, sizeof(directory), ".");
+		name = source->path;
+	} else {
+		snprintf(directory, sizeof(directory), "%.*s", (int)(name - source->path), source->path);
+		name++;
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (fd < 0 || inotify_add_watch(fd, directory[0] ? directory : "/", IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+		printf("Can't watch %s for %s: %s\n", directory, name, strerror(errno));
+		fflush(stdout);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		usleep(timeout_ms * 1000);
+		return -1;
+	}
+
+	// Checked after the watch is set, so a node created in between is not missed. A node
+	// that stays there but does not open gets the full timeout, changes to it still wake
+	// the wait through IN_ATTRIB.
+	if (source->settle_pending && access(source->path, F_OK) == 0) {
+		source->settle_pending = 0;
+
+		if (timeout_ms > DEVICE_SETTLE_MS) {
+			timeout_ms = DEVICE_SETTLE_MS;
+		}
+	}
+
+	uint64_t deadline = capture_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!found) {
+		uint64_t now = capture_now_ns();
+
+		if (now >= deadline || poll(&pfd, 1, (deadline - now + 999999) / 1000000) <= 0) {
+			break;
+		}
+
+		ssize_t length = read(fd, events, sizeof(events));
+
+		for (ssize_t offset = 0; offset < length; ) {
+			struct inotify_event *event = (struct inotify_event*)(events + offset);
+
+			if (event->len > 0 && strcmp(event->name, name) == 0) {
+				found = 1;
+			}
+
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	close(fd);
+
+	if (found) {
+		source->settle_pending = 1;
+		printf("Video device %s is back\n", source->path);
+		fflush(stdout);
+		return 0;
+	}
+
+	return access(source->path, F_OK) == 0 ? 0 : -1;
+}
+
+const capture_ops_t capture_v4l2_ops = {
+	.open = v4l2_open,
+	.start = v4l2_start,
+	.dequeue = v4l2_dequeue,
+	.ready = v4l2_ready,
+	.requeue = v4l2_requeue,
+	.stop = v4l2_stop,
+	.event_fd = v4l2_event_fd,
+	.restart = v4l2_restart,
+	.close = v4l2_close,
+	.wait = v4l2_wait
+};
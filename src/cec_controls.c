@@ -15,37 +15,77 @@
 #include <stdarg.h>
 #include <linux/cec-funcs.h>
 #include <pthread.h>
-#include <math.h>
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdatomic.h>
 
-#include "atem.h"
 #include "cec_controls.h"
+#include "presets.h"
+#include "cec_mapping.h"
+#include "cec_transport.h"
+#include "chroma_grade.h"
+#include "display.h"
+#include "atem.h"
 
 struct message_node {
 	uint8_t code;
 	uint8_t data1;
 	uint8_t data2;
 	uint8_t hasData2;
-	struct message_node *next;
+	// CLOCK_MONOTONIC, stamped by the adapter on receipt
+	uint64_t rx_ns;
 };
 
-static int cec_fd = 0;
+// Power of two. The bus carries a few dozen messages per second at most, the ring only
+// fills up when the control loop stalls. Messages that don't fit are dropped and counted.
+#define MESSAGE_QUEUE_SIZE 64
+
+// Retry interval while the adapter is missing
+#define CEC_RECONNECT_MS 2000
+
+static const cec_transport_t *transport = &cec_device_transport;
+static const char *adapter_path = CEC_DEFAULT_ADAPTER;
+static int cec_fd = -1;
 
 static uint8_t self_addr = 0;
 static pthread_t rx_thread = 0;
 static uint8_t rx_run = 0;
-
-static struct message_node *message_queue_start = NULL;
-static struct message_node *message_queue_end = NULL;
-
-static pthread_mutex_t message_queue_mutex;
+// Wakes the rx thread when it has to stop
+static int rx_stop_fd = -1;
+
+static uint8_t tv_found = 0;
+static uint16_t phys_addr = CEC_PHYS_ADDR_INVALID;
+
+// Single producer (rx_loop), single consumer (poll_cec_events) ring, no lock needed.
+// Head and tail only grow, they are masked on access.
+static struct message_node message_queue[MESSAGE_QUEUE_SIZE];
+static atomic_uint message_queue_head;
+static atomic_uint message_queue_tail;
+
+static atomic_uint messages_received;
+static atomic_uint messages_dropped;
+static unsigned int messages_coalesced;
+// Receipt time of the newest message handed to the control loop
+static uint64_t last_rx_ns = 0;
+
+// Hue and tint values, like the other camera controls, are 0 to 4096 with the high byte
+// in data2 and sent only when it changes
+#define GRADE_CENTER 2048
+static uint8_t hue_high_byte = GRADE_CENTER >> 8;
+static uint8_t tint_high_byte = GRADE_CENTER >> 8;
+static int grade_hue = 0;
+static int grade_tint = 0;
+
+// Signalled for every queued message, so the control loop can sleep until there is one
+static int queue_event_fd = -1;
 
 #define send_ioctl(r, p) int_ioctl(cec_fd, #r, r, p);
 #define read_ioctl(r, p) int_ioctl(cec_fd, #r, r, p);
 
 int int_ioctl(int fd, const char *name, unsigned long int request, void *param) {
-	int ret = ioctl(fd, request, param);
+	int ret = transport->ioctl(fd, request, param);
 	int err = errno;
 
 	if (ret != 0) {
@@ -123,349 +163,385 @@ void send_init_code() {
 }
 
 void add_message_to_queue(struct cec_msg *msg) {
-	struct message_node *node;
+	unsigned int head = atomic_load_explicit(&message_queue_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&message_queue_tail, memory_order_acquire);
+
+	atomic_fetch_add_explicit(&messages_received, 1, memory_order_relaxed);
+
+	if (head - tail >= MESSAGE_QUEUE_SIZE) {
+		atomic_fetch_add_explicit(&messages_dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	struct message_node *node = &message_queue[head & (MESSAGE_QUEUE_SIZE - 1)];
 
-	node = malloc(sizeof(struct message_node));
 	node->code = msg->msg[1];
 	node->data1 = msg->msg[2];
 	node->data2 = msg->msg[3];
 	node->hasData2 = msg->len >= 4;
-	node->next = NULL;
+	node->rx_ns = msg->rx_ts;
 
-	pthread_mutex_lock(&message_queue_mutex);
+	atomic_store_explicit(&message_queue_head, head + 1, memory_order_release);
 
-	if (message_queue_end == NULL) {
-		message_queue_start = node;
-	} else {
-		message_queue_end->next = node;
+	uint64_t one = 1;
+
+	if (write(queue_event_fd, &one, sizeof(one)) != sizeof(one)) {
+		printf("Failed to signal CEC message\n");
+		fflush(stdout);
 	}
+}
 
-	message_queue_end = node;
+void set_mode() {
+	unsigned int mode = CEC_MODE_INITIATOR | CEC_MODE_FOLLOWER | CEC_MODE_PREVENT_REPLY;
+	send_ioctl(CEC_S_MODE, &mode);
+}
+
+static int open_cec() {
+	cec_fd = transport->open(adapter_path);
 
-	pthread_mutex_unlock(&message_queue_mutex);
+	if (cec_fd < 0) {
+		return -1;
+	}
 
+	printf("CEC adapter connected\n");
 	fflush(stdout);
+
+	setup_cec();
+	set_mode();
+
+	return 0;
 }
 
-void* rx_loop(void *args) {
-	fd_set rd_fds;
-	fd_set ex_fds;
-	struct timeval tv;
-	int res;
+static void close_cec() {
+	if (cec_fd >= 0) {
+		transport->close(cec_fd);
+		cec_fd = -1;
+	}
 
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
+	tv_found = 0;
+	phys_addr = CEC_PHYS_ADDR_INVALID;
+}
 
-	while (rx_run) {
-		FD_ZERO(&rd_fds);
-		FD_ZERO(&ex_fds);
-		FD_SET(cec_fd, &rd_fds);
-		FD_SET(cec_fd, &ex_fds);
+static void connect_tv() {
+	if (detect_devices() != 0) {
+		printf("CEC destination device not found.\n");
+		fflush(stdout);
+		return;
+	}
 
-		res = select(cec_fd + 1, &rd_fds, NULL, &ex_fds, &tv);
+	send_init_code();
+	tv_found = 1;
+}
 
-		if (res < 0) {
-			printf("Select return error\n");
-			break;
-		}
+// The fd is blocking, as detect_devices needs the transmit status. Each wake up reads
+// one message or event only, poll reports the next one right away.
+static void receive_message() {
+	struct cec_msg msg = { };
+	int res = read_ioctl(CEC_RECEIVE, &msg);
+
+	if (res == ENODEV) {
+		printf("CEC Device Disconnected!\n");
+		fflush(stdout);
+		close_cec();
+		return;
+	}
+
+	if (res != 0) {
+		return;
+	}
 
-		if (FD_ISSET(cec_fd, &rd_fds)) {
-			struct cec_msg msg = { };
+	if (cec_msg_initiator(&msg) != CEC_LOG_ADDR_TV) {
+		return;
+	}
 
-			res = read_ioctl(CEC_RECEIVE, &msg);
+	add_message_to_queue(&msg);
+}
 
-			if (res == ENODEV) {
-				printf("CEC Device Disconnected!\n");
-				break;
-			}
+static void receive_event() {
+	struct cec_event ev = { };
+	int res = read_ioctl(CEC_DQEVENT, &ev);
 
-			if (res != 0) {
-				continue;
+	if (res != 0) {
+		return;
+	}
+
+	switch (ev.event) {
+		case CEC_EVENT_STATE_CHANGE:
+			printf("CEC state change: physical address %x.%x.%x.%x, logical addresses 0x%04x\n",
+				ev.state_change.phys_addr >> 12,
+				(ev.state_change.phys_addr >> 8) & 0xf,
+				(ev.state_change.phys_addr >> 4) & 0xf,
+				ev.state_change.phys_addr & 0xf,
+				ev.state_change.log_addr_mask
+			);
+
+			if (ev.state_change.phys_addr == CEC_PHYS_ADDR_INVALID) {
+				// HDMI unplugged, the TV is looked up again once there is an address
+				tv_found = 0;
+			} else if (ev.state_change.log_addr_mask != 0 && (!tv_found || ev.state_change.phys_addr != phys_addr)) {
+				connect_tv();
 			}
 
-			uint8_t from = cec_msg_initiator(&msg);
+			phys_addr = ev.state_change.phys_addr;
+			break;
 
-			if (from != CEC_LOG_ADDR_TV) {
-				continue;
+		case CEC_EVENT_LOST_MSGS:
+			printf("CEC lost %u messages\n", ev.lost_msgs.lost_msgs);
+			atomic_fetch_add_explicit(&messages_dropped, ev.lost_msgs.lost_msgs, memory_order_relaxed);
+			break;
+
+		default:
+			printf("Received CEC event %u\n", ev.event);
+			break;
+	}
+
+	fflush(stdout);
+}
+
+// Sleeps in poll until a message, an event, or the stop request. Without an adapter it
+// retries opening it every CEC_RECONNECT_MS, so a replugged adapter comes back by itself.
+void* rx_loop(void *args) {
+	struct pollfd fds[2];
+	int reported_missing = 0;
+
+	while (rx_run) {
+		if (cec_fd < 0 && open_cec() != 0) {
+			if (!reported_missing) {
+				printf("Failed to open CEC: %s. Will retry.\n", strerror(errno));
+				fflush(stdout);
+				reported_missing = 1;
 			}
 
-			add_message_to_queue(&msg);
+			fds[0].fd = rx_stop_fd;
+			fds[0].events = POLLIN;
+			poll(fds, 1, CEC_RECONNECT_MS);
+			continue;
 		}
 
-		if (FD_ISSET(cec_fd, &ex_fds)) {
-			struct cec_event ev;
+		reported_missing = 0;
 
-			res = read_ioctl(CEC_DQEVENT, &ev);
+		fds[0].fd = cec_fd;
+		fds[0].events = POLLIN | POLLPRI;
+		fds[1].fd = rx_stop_fd;
+		fds[1].events = POLLIN;
 
-			if (res != 0) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
 				continue;
 			}
 
-			printf("Received CEC event\n");
+			printf("CEC poll failed: %s\n", strerror(errno));
+			break;
 		}
-	}
 
-	return NULL;
-}
+		if (fds[1].revents) {
+			break;
+		}
 
-void set_mode() {
-	unsigned int mode = CEC_MODE_INITIATOR | CEC_MODE_FOLLOWER | CEC_MODE_PREVENT_REPLY;
-	send_ioctl(CEC_S_MODE, &mode);
-}
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			printf("CEC Device Disconnected!\n");
+			fflush(stdout);
+			close_cec();
+			continue;
+		}
 
-void init_cec_controls() {
-	cec_fd = open("/dev/cec0", O_RDWR);
+		if (fds[0].revents & POLLPRI) {
+			receive_event();
+		}
 
-	if (cec_fd <= 0) {
-		printf("Failed to open CEC. skipping CEC ctrls.\n");
-		fflush(stdout);
-		return;
+		if (cec_fd >= 0 && (fds[0].revents & POLLIN)) {
+			receive_message();
+		}
 	}
 
-	setup_cec();
-	set_mode();
+	close_cec();
 
-	if (detect_devices() != 0) {
-		printf("CEC destination device not found.\n");
-		fflush(stdout);
-		return;
-	}
-
-	send_init_code();
+	return NULL;
+}
 
-	fcntl(cec_fd, F_SETFL, fcntl(cec_fd, F_GETFL) | O_NONBLOCK);
+void cec_controls_set_adapter(const char *spec) {
+	if (strncmp(spec, CEC_REPLAY_PREFIX, strlen(CEC_REPLAY_PREFIX)) == 0) {
+		transport = &cec_replay_transport;
+		adapter_path = spec + strlen(CEC_REPLAY_PREFIX);
+	} else {
+		transport = &cec_device_transport;
+		adapter_path = spec;
+	}
+}
 
-	message_queue_start = NULL;
-	message_queue_end = NULL;
+void init_cec_controls() {
+	atomic_store(&message_queue_head, 0);
+	atomic_store(&message_queue_tail, 0);
+	atomic_store(&messages_received, 0);
+	atomic_store(&messages_dropped, 0);
+	messages_coalesced = 0;
+	last_rx_ns = 0;
 	rx_run = 1;
 
-	pthread_mutex_init(&message_queue_mutex, NULL);
-	pthread_create(&rx_thread, NULL, &rx_loop, NULL);
+	queue_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	rx_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
+	// The adapter is opened and the TV looked up by the rx thread, which also reconnects
+	pthread_create(&rx_thread, NULL, &rx_loop, NULL);
 }
 
 void stop_cec_controls() {
 	void *val;
+	uint64_t one = 1;
 
 	rx_run = 0;
 
 	if (rx_thread) {
+		if (write(rx_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+			printf("Failed to signal the CEC thread\n");
+		}
+
 		pthread_join(rx_thread, &val);
+		rx_thread = 0;
+	}
+
+	if (rx_stop_fd >= 0) {
+		close(rx_stop_fd);
+		rx_stop_fd = -1;
 	}
 
-	pthread_mutex_destroy(&message_queue_mutex);
+	if (queue_event_fd >= 0) {
+		printf("CEC messages: %u received, %u coalesced, %u dropped\n",
+			atomic_load(&messages_received),
+			messages_coalesced,
+			atomic_load(&messages_dropped)
+		);
+		fflush(stdout);
 
-	if (cec_fd) {
-		close(cec_fd);
+		close(queue_event_fd);
+		queue_event_fd = -1;
 	}
 }
 
-int apply_value(video_device_t *my_vd, const char *name, int min, int max, int val) {
-	 double input_range = (double)(max - min);
-	 double input_percent = (double)(val - min) / input_range;
-
-	 double output_range;
-	 double output;
-	 int output_int;
-
-	 struct v4l2_queryctrl qctrl;
-	 struct v4l2_control ctrl;
-
- 	 if ((min != 0 || max != 0) && (input_percent < 0.0 || input_percent > 1.0)) {
-		printf("CEC input value for \"%s\" out of range: min %i max %i val %i\n", name, min, max, val);
-	 }
-
-	 if (min > max) {
-		 input_percent = 1.0 - input_percent;
-	 }
-
-	 for (int i = V4L2_CID_BASE; i < V4L2_CID_LASTP1; i++) {
-		qctrl.id = i;
-		ctrl.id = 1;
-
-		if (ioctl(my_vd->device_file, VIDIOC_QUERYCTRL, &qctrl) == 0) {
-			if (
-				(strcmp((const char*)qctrl.name, name) == 0) &&
-				(
-					(qctrl.type == V4L2_CTRL_TYPE_INTEGER) ||
-					(qctrl.type == V4L2_CTRL_TYPE_U8) ||
-					(qctrl.type == V4L2_CTRL_TYPE_U16) ||
-					(qctrl.type == V4L2_CTRL_TYPE_U32)
-				)
-			) {
-				if (min == 0 && max == 0) {
-					// Just wrap and forward value
-					// I suspect that white balance temp will always match some value,
-					// given the color unit is the same (if that's not true, we will have to scale numbers
-					if (val <= qctrl.minimum) {
-						ctrl.value = qctrl.minimum;
-					} else if (val >= qctrl.maximum) {
-						ctrl.value = qctrl.maximum;
-					} else {
-						ctrl.value = (val / qctrl.step) * qctrl.step;
-					}
-				} else if (val == min) {
-					ctrl.value = qctrl.minimum;
-				} else if (val == max) {
-					ctrl.value = qctrl.maximum;
-				} else {
-					output_range = (double) (qctrl.maximum - qctrl.minimum);
-					output = (output_range * input_percent) + qctrl.minimum;
-					output_int = (int) round(output);
-
-					if (output_int >= qctrl.minimum && output_int <= qctrl.maximum) {
-						ctrl.value = (output_int / qctrl.step) * qctrl.step;
-					} else {
-						printf("CEC ERROR: Calculated value %i is out of bounds of control \"%s\"\n", output_int, name);
-					}
-				}
-
-				ioctl(my_vd->device_file, VIDIOC_S_CTRL, &ctrl);
-
-				return 1;
-			}
-		}
-	 }
-
-	 printf("CEC: No integer control for \"%s\" was found for connected camera. Skipping.\n", name);
-	 return 0;
+int cec_controls_event_fd() {
+	return queue_event_fd;
 }
 
-static uint8_t contrast_data2;
+uint64_t cec_controls_last_rx_ns() {
+	return last_rx_ns;
+}
 
-int process_contrast(video_device_t *my_vd, struct message_node *msg) {
-	if (msg->hasData2 != 0) {
-		contrast_data2 = msg->data2;
+// Number keys of the TV remote recall the preset in that slot
+int process_user_control(video_device_t *my_vd, struct message_node *msg) {
+	if (msg->data1 < CEC_OP_UI_CMD_NUMBER_0_OR_NUMBER_10 || msg->data1 > CEC_OP_UI_CMD_NUMBER_9) {
+		return 0;
 	}
 
-	int val = (contrast_data2 << 8) | msg->data1;
+	return preset_recall(my_vd, msg->data1 - CEC_OP_UI_CMD_NUMBER_0_OR_NUMBER_10) > 0;
+}
 
-	return apply_value(my_vd, "Contrast", 0, 4096, val);
+static int is_grade_code(uint8_t code) {
+	return code == CEC_DEV_HUE_CODE || code == CEC_DEV_TINT_CODE;
 }
 
-static uint8_t saturation_data2;
+// The camera has no hue or tint control. The display FCC does them at no cost per frame,
+// past its range or without it they grade the decoded chroma of every camera, the same
+// scope as the FCC.
+static int process_grade(struct message_node *msg) {
+	uint8_t *high_byte = msg->code == CEC_DEV_HUE_CODE ? &hue_high_byte : &tint_high_byte;
 
-int process_saturation(video_device_t *my_vd, struct message_node *msg) {
-        if (msg->hasData2 != 0) {
-                saturation_data2 = msg->data2;
-        }
+	if (msg->hasData2) {
+		*high_byte = msg->data2;
+	}
 
-        int val = (saturation_data2 << 8) | msg->data1;
+	int value = ((*high_byte << 8) | msg->data1) - GRADE_CENTER;
 
-	return apply_value(my_vd, "Saturation", 0, 4096, val);
-}
+	if (msg->code == CEC_DEV_HUE_CODE) {
+		grade_hue = value * DISPLAY_MAX_HUE / GRADE_CENTER;
+	} else {
+		grade_tint = value * DISPLAY_MAX_TINT / GRADE_CENTER;
+	}
 
-int process_wbt(video_device_t *my_vd, struct message_node *msg) {
-	int color_temp = ((msg->data1 - 50) * 50) + 2500;
-	return apply_value(my_vd, "White Balance Temperature", 0, 0, color_temp);
-}
+	set_drm_hue_tint(grade_hue, grade_tint);
 
-static uint8_t pivot_data2;
+	return 0;
+}
 
-int process_pivot(video_device_t *my_vd, struct message_node *msg) {
-        if (msg->hasData2 != 0) {
-                pivot_data2 = msg->data2;
-        }
+static int process_message(video_device_t *my_vd, struct message_node *node) {
+	if (node->code == CEC_MSG_USER_CONTROL_PRESSED) {
+		return process_user_control(my_vd, node);
+	}
 
-        int val = (pivot_data2 << 8) | msg->data1;
+	// A camera with a hue control can take the opcode through the cecMapping table instead
+	if (is_grade_code(node->code) && !cec_mapping_has(node->code)) {
+		return process_grade(node);
+	}
 
-	// I will map pivot to bright, it does not make sence, but I doubt that some webcam could have such control.
-	return apply_value(my_vd, "Bright", 0, 2048, val);
+	return cec_mapping_apply(my_vd, node->code, node->data1, node->data2, node->hasData2);
 }
 
-static uint8_t luma_data2;
+int poll_cec_events(video_device_t *my_vd) {
+	struct message_node batch[MESSAGE_QUEUE_SIZE];
+	uint8_t superseded[MESSAGE_QUEUE_SIZE];
+	int16_t newest[256];
+	int changed = 0;
+	uint64_t count;
+	int i;
 
-int process_luma(video_device_t *my_vd, struct message_node *msg) {
-        if (msg->hasData2 != 0) {
-                luma_data2 = msg->data2;
-        }
+	if (queue_event_fd < 0) {
+		return 0;
+	}
 
-        int val = (luma_data2 << 8) | msg->data1;
+	// Reset before draining, a message queued meanwhile signals again
+	if (read(queue_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		printf("Failed to read CEC event fd\n");
+	}
 
-        // Don't know if there could be a luma ctrl, but i guess Gamma is more common.
-        return apply_value(my_vd, "Gamma", 0, 2048, val);
-}
+	unsigned int tail = atomic_load_explicit(&message_queue_tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&message_queue_head, memory_order_acquire);
+	int length = head - tail;
 
-static uint8_t shutter_data2;
+	for (i = 0; i < length; i++) {
+		batch[i] = message_queue[(tail + i) & (MESSAGE_QUEUE_SIZE - 1)];
+	}
 
-int process_shutter_speed(video_device_t *my_vd, struct message_node *msg) {
-        if (msg->hasData2 != 0) {
-                shutter_data2 = msg->data2;
-        }
+	atomic_store_explicit(&message_queue_tail, head, memory_order_release);
 
-        int val = (shutter_data2 << 8) | msg->data1;
+	if (length > 0) {
+		last_rx_ns = batch[length - 1].rx_ns;
+	}
 
-        // This sounds like a commom feature to me, however my camera doesn't have such control.
-	// I think the best way to map will be setting exposure.
-	//
-	// Note: Shutter speed: Greater, darker. Smaller, lighten.
-	// Exposure is the inverse. greater is min, smaller is max
-        return apply_value(my_vd, "Gain", 41667, 500, val);
-}
+	// Newest first, so the message kept per opcode is the last one received
+	memset(newest, 0xff, sizeof(newest));
+	memset(superseded, 0, sizeof(superseded));
 
-int poll_cec_events(video_device_t *my_vd) {
-	struct message_node *node;
-	int changed = 0;
+	for (i = length - 1; i >= 0; i--) {
+		struct message_node *node = &batch[i];
 
-	do {
-		pthread_mutex_lock(&message_queue_mutex);
-		node = message_queue_start;
+		// Mapped opcodes carry absolute values, only the newest queued one has to be applied
+		if (!cec_mapping_has(node->code) && !is_grade_code(node->code)) {
+			continue;
+		}
 
-		if (node == NULL) {
-			pthread_mutex_unlock(&message_queue_mutex);
-			break;
+		if (newest[node->code] < 0) {
+			newest[node->code] = i;
+			continue;
 		}
 
-		message_queue_start = node->next;
+		// The high byte is sticky, keep the latest one sent before the kept message
+		struct message_node *kept = &batch[newest[node->code]];
 
-		if (message_queue_start == NULL) {
-			message_queue_end = NULL;
+		if (!kept->hasData2 && node->hasData2) {
+			kept->data2 = node->data2;
+			kept->hasData2 = 1;
 		}
 
-		pthread_mutex_unlock(&message_queue_mutex);
-
-		switch (node->code) {
-			case CEC_DEV_CONTRAST_CODE:
-				changed |= process_contrast(my_vd, node);
-				break;
-			case CEC_DEV_HUE_CODE:
-				// Maybe someday I found a camera that has hue control.
-				// As I don't know how this works in the camera side, don't know how implement.
-				//
-				// I also was wondering create a OpenGL shader to process the image,
-				// maybe we could simulate all color granding features
-				// (for a live event, I think it would be a nice feature).
-				// But then there's the problem.
-				// How to get a physical address of a OGL PBO mapped buffer? (this is a discrete gpu, the phy address will always resolve to a cedar write capable address)
-				// If anyone discover, please tell me. (I did some experiments with /proc/<pid>/pagemap, but I was unluckily. will try again, if it works may open the pandora box ahaha)
-				//
-				// Memcpy the codec output is tooo much slow. So need to decode direct to video buffer
-				//
-				break;
-			case CEC_DEV_LUMINOSITY_CODE:
-				changed |= process_luma(my_vd, node);
-				break;
-			case CEC_DEV_PIVOT_CODE:
-				changed |= process_pivot(my_vd, node);
-				break;
-			case CEC_DEV_SATURATION_CODE:
-				changed |= process_saturation(my_vd, node);
-				break;
-			case CEC_DEV_SHUTTER_SPEED_CODE:
-				changed |= process_shutter_speed(my_vd, node);
-				break;
-			case CEC_DEV_TINT_CODE:
-				// TODO Too.
-				break;
-			case CEC_DEV_WHITE_BALANCE_TEMP:
-				changed |= process_wbt(my_vd, node);
-				break;
-		}
+		superseded[i] = 1;
+		messages_coalesced++;
+	}
 
-		free(node);
+	for (i = 0; i < length; i++) {
+		if (!superseded[i]) {
+			changed |= process_message(my_vd, &batch[i]);
+		}
+	}
 
-		fflush(stdout);
-	} while (node != NULL);
+	fflush(stdout);
 
 	return changed;
 }
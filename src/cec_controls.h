@@ -3,7 +3,16 @@
 
 #define CEC_MODE_PREVENT_REPLY		0x100
 
+// /dev/cecN, or replay:<file> for the fake adapter of cec_transport.h. Call before init.
+void cec_controls_set_adapter(const char *spec);
+
 void init_cec_controls();
 void stop_cec_controls();
 int poll_cec_events(video_device_t *my_vd);
 
+// Readable when messages are queued, -1 when CEC is not running
+int cec_controls_event_fd();
+
+// Receipt time (CLOCK_MONOTONIC ns) of the newest message taken by poll_cec_events,
+// the start of the CEC to VIDIOC_S_CTRL path
+uint64_t cec_controls_last_rx_ns();
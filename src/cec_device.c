@@ -0,0 +1,23 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "cec_transport.h"
+
+static int device_open(const char *path) {
+	return open(path, O_RDWR | O_CLOEXEC);
+}
+
+static void device_close(int fd) {
+	close(fd);
+}
+
+static int device_ioctl(int fd, unsigned long request, void *param) {
+	return ioctl(fd, request, param);
+}
+
+const cec_transport_t cec_device_transport = {
+	.open = device_open,
+	.close = device_close,
+	.ioctl = device_ioctl
+};
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "atem.h"
+#include "cec_mapping.h"
+
+typedef struct {
+	uint8_t opcode;
+	uint8_t high_byte;
+	char control_name[32];
+	uint32_t control_id;
+	int32_t input_min;
+	int32_t input_max;
+
+	uint8_t has_output;
+	int32_t output_min;
+	int32_t output_max;
+
+	int point_count;
+	int16_t points[CEC_MAPPING_MAX_POINTS][2];
+} mapping_spec_t;
+
+typedef struct {
+	mapping_spec_t spec;
+
+	// NULL when the camera has no such integer control
+	control_entry_t *entry;
+	int32_t lut[CEC_MAPPING_LUT_SIZE];
+} mapping_t;
+
+// What the hardcoded handlers did before the table existed
+static const mapping_spec_t builtin_mappings[] = {
+	{ .opcode = CEC_DEV_CONTRAST_CODE, .high_byte = 1, .control_name = "Contrast", .input_min = 0, .input_max = 4096 },
+	{ .opcode = CEC_DEV_SATURATION_CODE, .high_byte = 1, .control_name = "Saturation", .input_min = 0, .input_max = 4096 },
+	// Pivot has no camera counterpart, brightness is the closest
+	{ .opcode = CEC_DEV_PIVOT_CODE, .high_byte = 1, .control_name = "Brightness", .input_min = 0, .input_max = 2048 },
+	// Gamma is more common than a luma control
+	{ .opcode = CEC_DEV_LUMINOSITY_CODE, .high_byte = 1, .control_name = "Gamma", .input_min = 0, .input_max = 2048 },
+	// Greater shutter speed is darker, the inverse of gain
+	{ .opcode = CEC_DEV_SHUTTER_SPEED_CODE, .high_byte = 1, .control_name = "Gain", .input_min = 41667, .input_max = 500 },
+	// 50 K per step, 2500 K at 50
+	{
+		.opcode = CEC_DEV_WHITE_BALANCE_TEMP, .control_name = "White Balance Temperature",
+		.input_min = 0, .input_max = 255, .has_output = 1, .output_min = 0, .output_max = 12750
+	},
+};
+
+static mapping_t mappings[CEC_MAPPING_MAX];
+static int mapping_count = 0;
+static int8_t mapping_index[256];
+static uint8_t mapped_opcodes[256];
+static uint8_t high_bytes[256];
+
+static struct json_object *config = NULL;
+static int configured = 0;
+static int bound = 0;
+static uint32_t bound_generation = 0;
+
+static int64_t div_round(int64_t numerator, int64_t denominator) {
+	if (denominator < 0) {
+		numerator = -numerator;
+		denominator = -denominator;
+	}
+
+	return numerator >= 0 ? (numerator + denominator / 2) / denominator : -((-numerator + denominator / 2) / denominator);
+}
+
+static int read_pair(struct json_object *json, int32_t *first, int32_t *second) {
+	if (!json_object_is_type(json, json_type_array) || json_object_array_length(json) != 2) {
+		return -1;
+	}
+
+	*first = json_object_get_int(json_object_array_get_idx(json, 0));
+	*second = json_object_get_int(json_object_array_get_idx(json, 1));
+
+	return 0;
+}
+
+static int parse_spec(struct json_object *json, mapping_spec_t *spec) {
+	struct json_object *value;
+	int32_t x, y;
+
+	memset(spec, 0, sizeof(mapping_spec_t));
+
+	if (!json_object_object_get_ex(json, "opcode", &value)) {
+		return -1;
+	}
+
+	int opcode = json_object_get_int(value);
+
+	if (opcode <= 0 || opcode > 255) {
+		return -1;
+	}
+
+	spec->opcode = opcode;
+
+	if (json_object_object_get_ex(json, "ctrlId", &value)) {
+		spec->control_id = json_object_get_int64(value);
+	} else if (json_object_object_get_ex(json, "ctrlName", &value)) {
+		snprintf(spec->control_name, sizeof(spec->control_name), "%s", json_object_get_string(value));
+	} else {
+		return -1;
+	}
+
+	if (
+		!json_object_object_get_ex(json, "input", &value) ||
+		read_pair(value, &spec->input_min, &spec->input_max) != 0 ||
+		spec->input_min == spec->input_max
+	) {
+		return -1;
+	}
+
+	if (json_object_object_get_ex(json, "highByte", &value)) {
+		spec->high_byte = json_object_get_boolean(value);
+	}
+
+	if (json_object_object_get_ex(json, "output", &value)) {
+		if (read_pair(value, &spec->output_min, &spec->output_max) != 0) {
+			return -1;
+		}
+
+		spec->has_output = 1;
+	}
+
+	if (json_object_object_get_ex(json, "curve", &value)) {
+		int count = json_object_array_length(value);
+
+		if (count < 2 || count > CEC_MAPPING_MAX_POINTS) {
+			return -1;
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (read_pair(json_object_array_get_idx(value, i), &x, &y) != 0 || x < 0 || x > 1000 || y < -1000 || y > 2000) {
+				return -1;
+			}
+
+			// Points must go left to right, spanning the whole input
+			if ((i > 0 && x <= spec->points[i - 1][0]) || (i == 0 && x != 0) || (i == count - 1 && x != 1000)) {
+				return -1;
+			}
+
+			spec->points[i][0] = x;
+			spec->points[i][1] = y;
+		}
+
+		spec->point_count = count;
+	}
+
+	return 0;
+}
+
+static void put_spec(const mapping_spec_t *spec) {
+	int index = mapping_index[spec->opcode];
+
+	if (index < 0) {
+		if (mapping_count >= CEC_MAPPING_MAX) {
+			printf("CEC mapping table full, ignoring opcode 0x%02x\n", spec->opcode);
+			return;
+		}
+
+		index = mapping_count++;
+		mapping_index[spec->opcode] = index;
+	}
+
+	mappings[index].spec = *spec;
+}
+
+static void put_spec_list(struct json_object *json, const char *source) {
+	mapping_spec_t spec;
+
+	if (json == NULL) {
+		return;
+	}
+
+	int count = json_object_array_length(json);
+
+	for (int i = 0; i < count; i++) {
+		if (parse_spec(json_object_array_get_idx(json, i), &spec) != 0) {
+			printf("CEC mapping #%i of \"%s\" is invalid, skipping\n", i, source);
+			continue;
+		}
+
+		put_spec(&spec);
+	}
+}
+
+static void build_lut(mapping_t *mapping) {
+	static const int16_t linear[2][2] = { { 0, 0 }, { 1000, 1000 } };
+	const mapping_spec_t *spec = &mapping->spec;
+	const control_entry_t *entry = mapping->entry;
+	const int16_t (*points)[2] = spec->point_count ? spec->points : linear;
+	int point_count = spec->point_count ? spec->point_count : 2;
+
+	int32_t output_min = spec->has_output ? spec->output_min : entry->minimum;
+	int32_t output_max = spec->has_output ? spec->output_max : entry->maximum;
+	int32_t step = entry->step > 0 ? entry->step : 1;
+	int64_t scale = CEC_MAPPING_LUT_SIZE - 1;
+	int segment = 0;
+
+	for (int i = 0; i < CEC_MAPPING_LUT_SIZE; i++) {
+		// Positions are in per mille times scale, to stay in integers
+		int64_t x = (int64_t) i * 1000;
+
+		while (segment < point_count - 2 && x > points[segment + 1][0] * scale) {
+			segment++;
+		}
+
+		int64_t x0 = points[segment][0] * scale;
+		int64_t x1 = points[segment + 1][0] * scale;
+		int64_t y0 = points[segment][1];
+		int64_t y1 = points[segment + 1][1];
+
+		int64_t y = y0 * scale + div_round((y1 - y0) * (x - x0), (x1 - x0) / scale);
+		int64_t value = output_min + div_round((int64_t) (output_max - output_min) * y, 1000 * scale);
+
+		value = entry->minimum + ((value - entry->minimum) / step) * step;
+
+		if (value < entry->minimum) {
+			value = entry->minimum;
+		} else if (value > entry->maximum) {
+			value = entry->maximum;
+		}
+
+		mapping->lut[i] = value;
+	}
+}
+
+static void bind(video_device_t *my_vd) {
+	mapping_count = 0;
+	memset(mapping_index, 0xff, sizeof(mapping_index));
+
+	for (size_t i = 0; i < sizeof(builtin_mappings) / sizeof(builtin_mappings[0]); i++) {
+		put_spec(&builtin_mappings[i]);
+	}
+
+	if (config != NULL) {
+		put_spec_list(json_object_object_get(config, "default"), "default");
+
+		if (my_vd->card[0] != 0) {
+			put_spec_list(json_object_object_get(config, my_vd->card), my_vd->card);
+		}
+	}
+
+	for (int i = 0; i < mapping_count; i++) {
+		mapping_t *mapping = &mappings[i];
+
+		mapping->entry = mapping->spec.control_id != 0 ?
+			control_catalog_find_id(&my_vd->controls, mapping->spec.control_id) :
+			control_catalog_find(&my_vd->controls, mapping->spec.control_name);
+
+		if (
+			mapping->entry != NULL &&
+			mapping->entry->type != V4L2_CTRL_TYPE_INTEGER &&
+			mapping->entry->type != V4L2_CTRL_TYPE_U8 &&
+			mapping->entry->type != V4L2_CTRL_TYPE_U16 &&
+			mapping->entry->type != V4L2_CTRL_TYPE_U32
+		) {
+			mapping->entry = NULL;
+		}
+
+		if (mapping->entry != NULL) {
+			build_lut(mapping);
+		}
+	}
+
+	bound = 1;
+	bound_generation = my_vd->controls.generation;
+}
+
+static void mark_opcodes(struct json_object *list) {
+	mapping_spec_t spec;
+	int count = list != NULL ? json_object_array_length(list) : 0;
+
+	for (int i = 0; i < count; i++) {
+		if (parse_spec(json_object_array_get_idx(list, i), &spec) == 0) {
+			mapped_opcodes[spec.opcode] = 1;
+		}
+	}
+}
+
+void cec_mapping_configure(struct json_object *json) {
+	if (config != NULL) {
+		json_object_put(config);
+		config = NULL;
+	}
+
+	memset(mapped_opcodes, 0, sizeof(mapped_opcodes));
+
+	for (size_t i = 0; i < sizeof(builtin_mappings) / sizeof(builtin_mappings[0]); i++) {
+		mapped_opcodes[builtin_mappings[i].opcode] = 1;
+	}
+
+	if (json != NULL && json_object_is_type(json, json_type_object)) {
+		config = json_object_get(json);
+
+		// Any camera's entries, the card is only known once a device is bound
+		json_object_object_foreach(config, card, list) {
+			(void) card;
+			mark_opcodes(list);
+		}
+	}
+
+	configured = 1;
+	bound = 0;
+}
+
+int cec_mapping_has(uint8_t opcode) {
+	if (!configured) {
+		cec_mapping_configure(NULL);
+	}
+
+	return mapped_opcodes[opcode];
+}
+
+int cec_mapping_apply(video_device_t *my_vd, uint8_t opcode, uint8_t data1, uint8_t data2, uint8_t has_data2) {
+	if (!bound || bound_generation != my_vd->controls.generation) {
+		bind(my_vd);
+	}
+
+	if (mapping_index[opcode] < 0) {
+		return 0;
+	}
+
+	mapping_t *mapping = &mappings[mapping_index[opcode]];
+	const mapping_spec_t *spec = &mapping->spec;
+
+	if (has_data2) {
+		high_bytes[opcode] = data2;
+	}
+
+	int32_t value = spec->high_byte ? (high_bytes[opcode] << 8) | data1 : data1;
+
+	if (mapping->entry == NULL) {
+		if (spec->control_id != 0) {
+			printf("CEC: No integer control 0x%08x was found for connected camera. Skipping.\n", spec->control_id);
+		} else {
+			printf("CEC: No integer control for \"%s\" was found for connected camera. Skipping.\n", spec->control_name);
+		}
+
+		return 0;
+	}
+
+	int64_t position = div_round((int64_t) (value - spec->input_min) * (CEC_MAPPING_LUT_SIZE - 1), spec->input_max - spec->input_min);
+
+	if (position < 0 || position >= CEC_MAPPING_LUT_SIZE) {
+		printf("CEC input value for \"%s\" out of range: min %i max %i val %i\n", mapping->entry->name, spec->input_min, spec->input_max, value);
+		position = position < 0 ? 0 : CEC_MAPPING_LUT_SIZE - 1;
+	}
+
+	control_catalog_submit(&my_vd->controls, my_vd->device_file, mapping->entry, mapping->lut[position]);
+
+	return 1;
+}
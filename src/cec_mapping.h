@@ -0,0 +1,44 @@
+#ifndef _CEC_MAPPING_H_
+#define _CEC_MAPPING_H_
+
+#include <inttypes.h>
+#include <json.h>
+
+#include "device.h"
+
+#define CEC_MAPPING_MAX 16
+#define CEC_MAPPING_MAX_POINTS 8
+#define CEC_MAPPING_LUT_SIZE 1024
+
+/*
+ * CEC camera control opcodes are mapped to V4L2 controls by a table. The built in
+ * table can be overridden by the "cecMapping" object of the control file:
+ *
+ *   "cecMapping": {
+ *     "default": [ mapping, ... ],
+ *     "<camera card name>": [ mapping, ... ]
+ *   }
+ *
+ *   mapping: {
+ *     "opcode": 32,
+ *     "ctrlName": "Contrast",          or "ctrlId": 9963777
+ *     "input": [0, 4096],              CEC value range, may be reversed
+ *     "highByte": true,                value is data2 << 8 | data1, data2 is sticky
+ *     "output": [0, 255],              optional, defaults to the control range
+ *     "curve": [[0, 0], [1000, 1000]]  optional, input to output in per mille
+ *   }
+ *
+ * Entries replace the ones with the same opcode, camera specific ones last. Each
+ * mapping is turned into a lookup table once the camera's control ranges are known.
+ */
+
+// NULL restores the built in table. Takes a reference to json.
+void cec_mapping_configure(struct json_object *json);
+
+// Whether the opcode carries a mapped control value
+int cec_mapping_has(uint8_t opcode);
+
+// Returns 1 if the value was submitted to a control
+int cec_mapping_apply(video_device_t *my_vd, uint8_t opcode, uint8_t data1, uint8_t data2, uint8_t has_data2);
+
+#endif
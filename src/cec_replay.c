@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/cec.h>
+
+#include "cec_transport.h"
+
+// Plays back a recorded message sequence, see cec_transport.h for the file format.
+// The fd is a timer armed for the next message, so poll wakes the rx thread at the
+// recorded rate. Messages are timed from the start of the replay, a slow reader does
+// not stretch the sequence.
+
+#define REPLAY_INITIAL_SIZE 256
+#define REPLAY_LINE_SIZE 256
+
+struct replay_message {
+	uint64_t delay_ns;
+	uint32_t len;
+	uint8_t msg[CEC_MAX_MSG_SIZE];
+};
+
+static struct replay_message *messages = NULL;
+static uint32_t message_count = 0;
+static uint32_t message_capacity = 0;
+static uint32_t next_message = 0;
+static uint64_t next_due_ns = 0;
+
+static struct cec_log_addrs log_addrs;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int parse_line(char *line, struct replay_message *message) {
+	char *end;
+	unsigned long value;
+
+	while (*line == ' ' || *line == '\t') {
+		line++;
+	}
+
+	if (*line == '#' || *line == '\n' || *line == '\r' || *line == 0) {
+		return 0;
+	}
+
+	value = strtoul(line, &end, 10);
+
+	if (end == line) {
+		return -1;
+	}
+
+	message->delay_ns = (uint64_t) value * 1000000ULL;
+	message->len = 0;
+	line = end;
+
+	while (message->len < CEC_MAX_MSG_SIZE) {
+		value = strtoul(line, &end, 16);
+
+		if (end == line) {
+			break;
+		}
+
+		message->msg[message->len++] = value;
+		line = end;
+	}
+
+	// A header and an opcode at least, polls carry no data
+	return message->len >= 2 ? 1 : -1;
+}
+
+static int load_messages(const char *path) {
+	char line[REPLAY_LINE_SIZE];
+	int line_number = 0;
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL) {
+		return -1;
+	}
+
+	message_count = 0;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line_number++;
+
+		if (message_count == message_capacity) {
+			message_capacity = message_capacity ? message_capacity * 2 : REPLAY_INITIAL_SIZE;
+			messages = realloc(messages, message_capacity * sizeof(struct replay_message));
+		}
+
+		int res = parse_line(line, &messages[message_count]);
+
+		if (res < 0) {
+			printf("CEC replay: ignoring line %i of %s\n", line_number, path);
+		} else if (res > 0) {
+			message_count++;
+		}
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static void arm_next(int fd) {
+	struct itimerspec due = {};
+
+	// A zero value disarms the timer once the sequence is over
+	if (next_message < message_count) {
+		next_due_ns += messages[next_message].delay_ns;
+
+		// Zero would disarm, back to back messages are due right away
+		uint64_t at = next_due_ns ? next_due_ns : 1;
+
+		due.it_value.tv_sec = at / 1000000000ULL;
+		due.it_value.tv_nsec = at % 1000000000ULL;
+	}
+
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &due, NULL);
+}
+
+static int replay_open(const char *path) {
+	if (load_messages(path) != 0) {
+		return -1;
+	}
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	printf("CEC replay: %u messages from %s\n", message_count, path);
+	fflush(stdout);
+
+	memset(&log_addrs, 0, sizeof(log_addrs));
+	next_message = 0;
+	next_due_ns = now_ns();
+	arm_next(fd);
+
+	return fd;
+}
+
+static void replay_close(int fd) {
+	close(fd);
+
+	free(messages);
+	messages = NULL;
+	message_count = 0;
+	message_capacity = 0;
+}
+
+static int replay_receive(int fd, struct cec_msg *msg) {
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		return -1;
+	}
+
+	if (next_message >= message_count || now_ns() < next_due_ns) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct replay_message *message = &messages[next_message++];
+
+	memset(msg, 0, sizeof(struct cec_msg));
+	memcpy(msg->msg, message->msg, message->len);
+	msg->len = message->len;
+	msg->rx_ts = now_ns();
+	msg->rx_status = CEC_RX_STATUS_OK;
+
+	if (next_message == message_count) {
+		printf("CEC replay finished\n");
+		fflush(stdout);
+	}
+
+	arm_next(fd);
+
+	return 0;
+}
+
+static int replay_ioctl(int fd, unsigned long request, void *param) {
+	switch (request) {
+		case CEC_ADAP_G_CAPS: {
+			struct cec_caps *caps = param;
+
+			memset(caps, 0, sizeof(struct cec_caps));
+			snprintf(caps->driver, sizeof(caps->driver), "camview");
+			snprintf(caps->name, sizeof(caps->name), "replay");
+			caps->available_log_addrs = 1;
+			caps->capabilities = CEC_CAP_LOG_ADDRS | CEC_CAP_TRANSMIT;
+			caps->version = CEC_OP_CEC_VERSION_2_0;
+			return 0;
+		}
+
+		case CEC_ADAP_S_LOG_ADDRS: {
+			struct cec_log_addrs *addrs = param;
+
+			// Claims the first address of the requested type right away
+			if (addrs->num_log_addrs > 0) {
+				addrs->log_addr[0] = CEC_LOG_ADDR_RECORD_1;
+				addrs->log_addr_mask = 1 << CEC_LOG_ADDR_RECORD_1;
+			} else {
+				addrs->log_addr_mask = 0;
+			}
+
+			log_addrs = *addrs;
+			return 0;
+		}
+
+		case CEC_ADAP_G_LOG_ADDRS:
+			*(struct cec_log_addrs*) param = log_addrs;
+			return 0;
+
+		case CEC_S_MODE:
+			return 0;
+
+		case CEC_TRANSMIT:
+			((struct cec_msg*) param)->tx_status = CEC_TX_STATUS_OK;
+			return 0;
+
+		case CEC_RECEIVE:
+			return replay_receive(fd, param);
+
+		case CEC_DQEVENT:
+			errno = EAGAIN;
+			return -1;
+	}
+
+	errno = ENOTTY;
+	return -1;
+}
+
+const cec_transport_t cec_replay_transport = {
+	.open = replay_open,
+	.close = replay_close,
+	.ioctl = replay_ioctl
+};
@@ -0,0 +1,28 @@
+#ifndef _CEC_TRANSPORT_H_
+#define _CEC_TRANSPORT_H_
+
+#define CEC_DEFAULT_ADAPTER "/dev/cec0"
+#define CEC_REPLAY_PREFIX "replay:"
+
+// How the CEC code talks to an adapter. ioctl takes the kernel CEC API requests and
+// returns 0, or -1 with errno set, like ioctl(2).
+typedef struct {
+    // The fd polls POLLIN for a message and POLLPRI for an event. -1 with errno set on failure.
+    int (*open)(const char *path);
+    void (*close)(int fd);
+    int (*ioctl)(int fd, unsigned long request, void *param);
+} cec_transport_t;
+
+// The kernel CEC API, path is a /dev/cecN node
+extern const cec_transport_t cec_device_transport;
+
+// A fake adapter that plays back recorded bus traffic from a text file, one message
+// per line, the delay in ms since the previous message then the bytes in hex:
+//
+//   # Contrast 0x0820, high byte first
+//   40 0f 20 20 08
+//
+// Transmits always succeed, as if a TV acknowledged them. There are no events.
+extern const cec_transport_t cec_replay_transport;
+
+#endif
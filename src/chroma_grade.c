@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "chroma_grade.h"
+#include "display.h"
+
+// Hue rotates the (U, V) vector, tint moves it along the magenta / green axis:
+//
+//   U' = ((U - 128) * cos - (V - 128) * sin) + 128 + tint_u
+//   V' = ((U - 128) * sin + (V - 128) * cos) + 128 + tint_v
+//
+// In Q12 fixed point with rounding, so the table and the vector path agree to the bit.
+// NEON has no gather, a 2D table lookup per sample would be scalar loads, so the vector
+// path evaluates the rotation from the coefficients instead.
+
+#define CHROMA_GRADE_LUT_SIZE (256 * 256)
+
+// Samples per plane graded at a time in the cached staging buffers, both fit in L1
+#define CHROMA_GRADE_BLOCK 4096
+
+// BT.601 direction of magenta in the (U, V) plane
+#define TINT_DIRECTION_U 0.62
+#define TINT_DIRECTION_V 0.78
+
+// hue << 16 | tint, each as 16 bits. Written by the control loop, read by the decoders.
+static atomic_uint requested_settings[DISPLAY_MAX_SOURCES];
+
+static uint32_t pack_settings(int hue, int tint) {
+	return ((uint32_t)(uint16_t)hue << 16) | (uint16_t)tint;
+}
+
+static int clamp(int value, int min, int max) {
+	return value < min ? min : value > max ? max : value;
+}
+
+void chroma_grade_set(int source, int hue, int tint) {
+	if (source < 0 || source >= DISPLAY_MAX_SOURCES) {
+		return;
+	}
+
+	hue = clamp(hue, -CHROMA_GRADE_MAX_HUE, CHROMA_GRADE_MAX_HUE);
+	tint = clamp(tint, -CHROMA_GRADE_MAX_TINT, CHROMA_GRADE_MAX_TINT);
+
+	atomic_store_explicit(&requested_settings[source], pack_settings(hue, tint), memory_order_relaxed);
+}
+
+void chroma_grade_set_all(int hue, int tint) {
+	for (int i = 0; i < DISPLAY_MAX_SOURCES; i++) {
+		chroma_grade_set(i, hue, tint);
+	}
+}
+
+void chroma_grade_get(int source, int *hue, int *tint) {
+	uint32_t settings = 0;
+
+	if (source >= 0 && source < DISPLAY_MAX_SOURCES) {
+		settings = atomic_load_explicit(&requested_settings[source], memory_order_relaxed);
+	}
+
+	*hue = (int16_t)(settings >> 16);
+	*tint = (int16_t)(settings & 0xffff);
+}
+
+static inline void grade_pair(const chroma_grade_t *grade, uint8_t *u, uint8_t *v) {
+	int cu = *u - 128;
+	int cv = *v - 128;
+
+	*u = clamp(((cu * grade->cos_q12 - cv * grade->sin_q12 + 2048) >> 12) + 128 + grade->offset_u, 0, 255);
+	*v = clamp(((cu * grade->sin_q12 + cv * grade->cos_q12 + 2048) >> 12) + 128 + grade->offset_v, 0, 255);
+}
+
+void chroma_grade_build(chroma_grade_t *grade, int hue, int tint) {
+	double angle = hue * M_PI / 180.0;
+
+	grade->settings = pack_settings(hue, tint);
+	grade->cos_q12 = lround(cos(angle) * 4096);
+	grade->sin_q12 = lround(sin(angle) * 4096);
+	grade->offset_u = lround(tint * TINT_DIRECTION_U);
+	grade->offset_v = lround(tint * TINT_DIRECTION_V);
+	grade->lut_valid = 0;
+}
+
+static void build_lut(chroma_grade_t *grade) {
+	if (grade->lut == NULL) {
+		grade->lut = malloc(CHROMA_GRADE_LUT_SIZE * sizeof(uint16_t));
+	}
+
+	for (int i = 0; i < CHROMA_GRADE_LUT_SIZE; i++) {
+		uint8_t u = i >> 8;
+		uint8_t v = i & 0xff;
+
+		grade_pair(grade, &u, &v);
+		grade->lut[i] = (v << 8) | u;
+	}
+
+	grade->lut_valid = 1;
+}
+
+void chroma_grade_release(chroma_grade_t *grade) {
+	free(grade->lut);
+	memset(grade, 0, sizeof(chroma_grade_t));
+}
+
+void chroma_grade_planes_lut(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size) {
+	if (!grade->lut_valid) {
+		build_lut(grade);
+	}
+
+	for (uint32_t i = 0; i < size; i++) {
+		uint16_t graded = grade->lut[(u[i] << 8) | v[i]];
+
+		u[i] = graded & 0xff;
+		v[i] = graded >> 8;
+	}
+}
+
+#ifdef __ARM_NEON
+void chroma_grade_planes(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size) {
+	const uint8x8_t center = vdup_n_u8(128);
+	const int16x8_t offset_u = vdupq_n_s16(128 + grade->offset_u);
+	const int16x8_t offset_v = vdupq_n_s16(128 + grade->offset_v);
+	const int16_t c = grade->cos_q12;
+	const int16_t s = grade->sin_q12;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		// The wrapped 16 bit difference is the signed one
+		int16x8_t cu = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + i), center));
+		int16x8_t cv = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + i), center));
+
+		int32x4_t u_low = vmlsl_n_s16(vmull_n_s16(vget_low_s16(cu), c), vget_low_s16(cv), s);
+		int32x4_t u_high = vmlsl_n_s16(vmull_n_s16(vget_high_s16(cu), c), vget_high_s16(cv), s);
+		int32x4_t v_low = vmlal_n_s16(vmull_n_s16(vget_low_s16(cu), s), vget_low_s16(cv), c);
+		int32x4_t v_high = vmlal_n_s16(vmull_n_s16(vget_high_s16(cu), s), vget_high_s16(cv), c);
+
+		int16x8_t graded_u = vaddq_s16(vcombine_s16(vqrshrn_n_s32(u_low, 12), vqrshrn_n_s32(u_high, 12)), offset_u);
+		int16x8_t graded_v = vaddq_s16(vcombine_s16(vqrshrn_n_s32(v_low, 12), vqrshrn_n_s32(v_high, 12)), offset_v);
+
+		vst1_u8(u + i, vqmovun_s16(graded_u));
+		vst1_u8(v + i, vqmovun_s16(graded_v));
+	}
+
+	for (; i < size; i++) {
+		grade_pair(grade, u + i, v + i);
+	}
+}
+#else
+void chroma_grade_planes(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size) {
+	chroma_grade_planes_lut(grade, u, v, size);
+}
+#endif
+
+// The display buffers are write combined, reads there are uncached and the interleaved
+// loads and stores of the grade would stall on each. Blocks are copied to cached memory,
+// graded there and copied back, so the display memory only sees sequential bulk transfers.
+void chroma_grade_planes_staged(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size) {
+	uint8_t staging_u[CHROMA_GRADE_BLOCK] __attribute__((aligned(64)));
+	uint8_t staging_v[CHROMA_GRADE_BLOCK] __attribute__((aligned(64)));
+
+	for (uint32_t offset = 0; offset < size; offset += CHROMA_GRADE_BLOCK) {
+		uint32_t count = size - offset < CHROMA_GRADE_BLOCK ? size - offset : CHROMA_GRADE_BLOCK;
+
+		memcpy(staging_u, u + offset, count);
+		memcpy(staging_v, v + offset, count);
+
+		chroma_grade_planes(grade, staging_u, staging_v, count);
+
+		memcpy(u + offset, staging_u, count);
+		memcpy(v + offset, staging_v, count);
+	}
+}
+
+void chroma_grade_apply(chroma_grade_t *grade, int source, uint8_t *u, uint8_t *v, uint32_t size) {
+	if (source < 0 || source >= DISPLAY_MAX_SOURCES || size == 0) {
+		return;
+	}
+
+	uint32_t settings = atomic_load_explicit(&requested_settings[source], memory_order_relaxed);
+
+	if (settings == 0) {
+		return;
+	}
+
+	if (settings != grade->settings) {
+		chroma_grade_build(grade, (int16_t)(settings >> 16), (int16_t)(settings & 0xffff));
+	}
+
+	chroma_grade_planes_staged(grade, u, v, size);
+}
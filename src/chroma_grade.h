@@ -0,0 +1,49 @@
+#ifndef _CHROMA_GRADE_H_
+#define _CHROMA_GRADE_H_
+
+#include <inttypes.h>
+
+// Hue and tint have no camera control or display engine counterpart, they are applied
+// in software to the decoded chroma planes before the buffer is handed to the display.
+// Only U and V are touched, that is a quarter (4:2:0) or half (4:2:2) of the luma samples.
+
+#define CHROMA_GRADE_MAX_HUE 180
+// Chroma levels toward magenta, negative toward green
+#define CHROMA_GRADE_MAX_TINT 64
+
+typedef struct {
+    // Settings the tables were built for, 0 is the identity and skips the frame
+    uint32_t settings;
+
+    // Q12 rotation and the tint offset, the vector path works from these
+    int16_t cos_q12;
+    int16_t sin_q12;
+    int16_t offset_u;
+    int16_t offset_v;
+
+    // 256 x 256, indexed by U << 8 | V, holds V' << 8 | U'. Same results as the vector path,
+    // built on first use after a change, so NEON builds never fill it.
+    uint16_t *lut;
+    uint8_t lut_valid;
+} chroma_grade_t;
+
+// Requested grade of a display source, from any thread. Hue in degrees.
+void chroma_grade_set(int source, int hue, int tint);
+void chroma_grade_get(int source, int *hue, int *tint);
+// Same grade for every source, as the display FCC grades the whole output
+void chroma_grade_set_all(int hue, int tint);
+
+// Grades the planes in place with the source's requested settings, called by the decoder
+// of the source. Tables are rebuilt only when the settings changed.
+void chroma_grade_apply(chroma_grade_t *grade, int source, uint8_t *u, uint8_t *v, uint32_t size);
+void chroma_grade_release(chroma_grade_t *grade);
+
+// Used by chroma_grade_apply, exposed for the benchmark
+void chroma_grade_build(chroma_grade_t *grade, int hue, int tint);
+// NEON when built with it, the table otherwise
+void chroma_grade_planes(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size);
+void chroma_grade_planes_lut(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size);
+// chroma_grade_planes through cached blocks, for planes in write combined display buffers
+void chroma_grade_planes_staged(chroma_grade_t *grade, uint8_t *u, uint8_t *v, uint32_t size);
+
+#endif
@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <linux/videodev2.h>
 #include <sys/inotify.h>
 #include <poll.h>
@@ -9,12 +12,32 @@
 #include <drm/sun4i_drm.h>
 
 #include "device.h"
-#include "display.h"
-
-#define CTRL_FILE "/var/www/camview/ctrl.json"
+#include "display_params.h"
+#include "presets.h"
+#include "cec_mapping.h"
+
+#ifndef CTRL_DIR
+#define CTRL_DIR "/var/www/camview"
+#endif
+#define CTRL_FILE_NAME "ctrl.json"
+#define CTRL_TMP_FILE_NAME "ctrl.json.tmp"
+#define CTRL_FILE CTRL_DIR "/" CTRL_FILE_NAME
+#define CTRL_TMP_FILE CTRL_DIR "/" CTRL_TMP_FILE_NAME
 
 static int inotify_fd;
 
+// In memory copy of the control file. Built once per device, then only the entries
+// that changed are updated and the file is written only when the model is dirty.
+static struct json_object *model = NULL;
+static struct json_object *model_controls[CONTROL_CATALOG_MAX];
+static display_params_t model_display;
+// Only read by camview, kept as written so it survives our writes
+static struct json_object *model_cec_mapping = NULL;
+static int model_dirty = 0;
+
+#define CTRL_FILE_MAX_SIZE 500000
+#define CTRL_FILE_CHUNK_SIZE 4096
+
 const char* control_type_name(int type) {
 	switch (type) {
 		case V4L2_CTRL_TYPE_INTEGER:
@@ -89,40 +112,45 @@ struct json_object* get_device_ctrls_json_array(video_device_t *my_vd) {
 	struct json_object *json;
 	struct json_object *ctrl_json;
 
-	struct v4l2_queryctrl qctrl;
 	struct v4l2_control ctrl;
 
 	json = json_object_new_array();
 
-	for (int i = V4L2_CID_BASE; i < V4L2_CID_LASTP1; i++) {
-		qctrl.id = i;
-		ctrl.id = i;
+	for (int i = 0; i < my_vd->controls.count; i++) {
+		control_entry_t *entry = &my_vd->controls.entries[i];
+		const char *type = control_type_name(entry->type);
 
-		if (ioctl(my_vd->device_file, VIDIOC_QUERYCTRL, &qctrl) == 0) {
-			const char *type = control_type_name(qctrl.type);
+		model_controls[i] = NULL;
 
-			if (type != NULL) {
-				ctrl_json = json_object_new_object();
-				json_object_object_add(ctrl_json, "ctrlName", json_object_new_string(qctrl.name));
-				json_object_object_add(ctrl_json, "ctrlMax", json_object_new_int(qctrl.maximum));
-				json_object_object_add(ctrl_json, "ctrlMin", json_object_new_int(qctrl.minimum));
-				json_object_object_add(ctrl_json, "ctrlStep", json_object_new_int(qctrl.step));
-				json_object_object_add(ctrl_json, "ctrlDefault", json_object_new_int(qctrl.default_value));
-				json_object_object_add(ctrl_json, "ctrlType", json_object_new_string(type));
+		if (type != NULL) {
+			ctrl_json = json_object_new_object();
+			json_object_object_add(ctrl_json, "ctrlName", json_object_new_string(entry->name));
+			json_object_object_add(ctrl_json, "ctrlMax", json_object_new_int(entry->maximum));
+			json_object_object_add(ctrl_json, "ctrlMin", json_object_new_int(entry->minimum));
+			json_object_object_add(ctrl_json, "ctrlStep", json_object_new_int(entry->step));
+			json_object_object_add(ctrl_json, "ctrlDefault", json_object_new_int(entry->default_value));
+			json_object_object_add(ctrl_json, "ctrlType", json_object_new_string(type));
 
-				if (ioctl(my_vd->device_file, VIDIOC_G_CTRL, &ctrl) == 0) {
-					json_object_object_add(ctrl_json, "ctrlValue", json_object_new_int(ctrl.value));
-				}
+			// Auto controls move values on their own, so read the device here
+			ctrl.id = entry->id;
 
-				if (
-					qctrl.type == V4L2_CTRL_TYPE_MENU ||
-					qctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU
-				) {
-					json_object_object_add(ctrl_json, "ctrlMenu", get_menu_ctrls_json(my_vd, i, qctrl.type));
-				}
+			if (ioctl(my_vd->device_file, VIDIOC_G_CTRL, &ctrl) == 0) {
+				entry->value = ctrl.value;
+				entry->value_valid = 1;
+				json_object_object_add(ctrl_json, "ctrlValue", json_object_new_int(ctrl.value));
+			}
+
+			entry->changed = 0;
+			model_controls[i] = ctrl_json;
 
-				json_object_array_add(json, ctrl_json);
+			if (
+				entry->type == V4L2_CTRL_TYPE_MENU ||
+				entry->type == V4L2_CTRL_TYPE_INTEGER_MENU
+			) {
+				json_object_object_add(ctrl_json, "ctrlMenu", get_menu_ctrls_json(my_vd, entry->id, entry->type));
 			}
+
+			json_object_array_add(json, ctrl_json);
 		}
 	}
 
@@ -131,296 +159,316 @@ struct json_object* get_device_ctrls_json_array(video_device_t *my_vd) {
 
 struct json_object* get_display_ctrls_json_array() {
 	struct json_object *json;
-	struct json_object *fcc;
-	struct json_object *bws;
-	struct json_object *lti;
-	struct drm_sun4i_fcc_params fcc_dsp;
-	struct drm_sun8i_bws_params bws_dsp;
-	struct drm_sun8i_lti_params lti_dsp;
-
-	fcc = json_object_new_object();
-	bws = json_object_new_object();
-	lti = json_object_new_object();
-
-	get_drm_fcc(&fcc_dsp);
-	get_drm_bws(&bws_dsp);
-	get_drm_lti(&lti_dsp);
-
-	json_object_object_add(fcc, "enable", json_object_new_int(fcc_dsp.enable));
-	json_object_object_add(fcc, "hr_hue_min", json_object_new_int(fcc_dsp.hr_hue_min));
-	json_object_object_add(fcc, "hr_hue_max", json_object_new_int(fcc_dsp.hr_hue_max));
-	json_object_object_add(fcc, "hg_hue_min", json_object_new_int(fcc_dsp.hg_hue_min));
-	json_object_object_add(fcc, "hg_hue_max", json_object_new_int(fcc_dsp.hg_hue_max));
-	json_object_object_add(fcc, "hb_hue_min", json_object_new_int(fcc_dsp.hb_hue_min));
-	json_object_object_add(fcc, "hb_hue_max", json_object_new_int(fcc_dsp.hb_hue_max));
-	json_object_object_add(fcc, "hc_hue_min", json_object_new_int(fcc_dsp.hc_hue_min));
-	json_object_object_add(fcc, "hc_hue_max", json_object_new_int(fcc_dsp.hc_hue_max));
-	json_object_object_add(fcc, "hm_hue_min", json_object_new_int(fcc_dsp.hm_hue_min));
-	json_object_object_add(fcc, "hm_hue_max", json_object_new_int(fcc_dsp.hm_hue_max));
-	json_object_object_add(fcc, "hy_hue_min", json_object_new_int(fcc_dsp.hy_hue_min));
-	json_object_object_add(fcc, "hy_hue_max", json_object_new_int(fcc_dsp.hy_hue_max));
-	json_object_object_add(fcc, "hr_hue_gain", json_object_new_int(fcc_dsp.hr_hue_gain));
-	json_object_object_add(fcc, "hr_sat_gain", json_object_new_int(fcc_dsp.hr_sat_gain));
-	json_object_object_add(fcc, "hg_hue_gain", json_object_new_int(fcc_dsp.hg_hue_gain));
-	json_object_object_add(fcc, "hg_sat_gain", json_object_new_int(fcc_dsp.hg_sat_gain));
-	json_object_object_add(fcc, "hb_hue_gain", json_object_new_int(fcc_dsp.hb_hue_gain));
-	json_object_object_add(fcc, "hb_sat_gain", json_object_new_int(fcc_dsp.hb_sat_gain));
-	json_object_object_add(fcc, "hc_hue_gain", json_object_new_int(fcc_dsp.hc_hue_gain));
-	json_object_object_add(fcc, "hc_sat_gain", json_object_new_int(fcc_dsp.hc_sat_gain));
-	json_object_object_add(fcc, "hm_hue_gain", json_object_new_int(fcc_dsp.hm_hue_gain));
-	json_object_object_add(fcc, "hm_sat_gain", json_object_new_int(fcc_dsp.hm_sat_gain));
-	json_object_object_add(fcc, "hy_hue_gain", json_object_new_int(fcc_dsp.hy_hue_gain));
-	json_object_object_add(fcc, "hy_sat_gain", json_object_new_int(fcc_dsp.hy_sat_gain));
-
-	json_object_object_add(bws, "enable", json_object_new_int(bws_dsp.enable));
-	json_object_object_add(bws, "min", json_object_new_int(bws_dsp.min));
-	json_object_object_add(bws, "black", json_object_new_int(bws_dsp.black));
-	json_object_object_add(bws, "white", json_object_new_int(bws_dsp.white));
-	json_object_object_add(bws, "max", json_object_new_int(bws_dsp.max));
-	json_object_object_add(bws, "slope0", json_object_new_int(bws_dsp.slope0));
-	json_object_object_add(bws, "slope1", json_object_new_int(bws_dsp.slope1));
-	json_object_object_add(bws, "slope2", json_object_new_int(bws_dsp.slope2));
-	json_object_object_add(bws, "slope3", json_object_new_int(bws_dsp.slope3));
-
-	json_object_object_add(lti, "enable", json_object_new_int(lti_dsp.enable));
-	json_object_object_add(lti, "c0", json_object_new_int(lti_dsp.c0));
-	json_object_object_add(lti, "c1", json_object_new_int(lti_dsp.c1));
-	json_object_object_add(lti, "c2", json_object_new_int(lti_dsp.c2));
-	json_object_object_add(lti, "c3", json_object_new_int(lti_dsp.c3));
-	json_object_object_add(lti, "c4", json_object_new_int(lti_dsp.c4));
-	json_object_object_add(lti, "fir_gain", json_object_new_int(lti_dsp.fir_gain));
-	json_object_object_add(lti, "cor_th", json_object_new_int(lti_dsp.cor_th));
-	json_object_object_add(lti, "diff_offset", json_object_new_int(lti_dsp.diff_offset));
-	json_object_object_add(lti, "diff_slope", json_object_new_int(lti_dsp.diff_slope));
-	json_object_object_add(lti, "edge_gain", json_object_new_int(lti_dsp.edge_gain));
-	json_object_object_add(lti, "core_x", json_object_new_int(lti_dsp.core_x));
-	json_object_object_add(lti, "clip_y", json_object_new_int(lti_dsp.clip_y));
-	json_object_object_add(lti, "peak_limit", json_object_new_int(lti_dsp.peak_limit));
-	json_object_object_add(lti, "win_expansion", json_object_new_int(lti_dsp.win_expansion));
-	json_object_object_add(lti, "edge_level_th", json_object_new_int(lti_dsp.edge_level_th));
+	struct json_object *group = NULL;
+	display_params_t params;
+
+	display_params_get(&params);
 
 	json = json_object_new_object();
-	json_object_object_add(json, "fcc", fcc);
-	json_object_object_add(json, "bws", bws);
-	json_object_object_add(json, "lti", lti);
+
+	// Fields of a group are listed together
+	for (int i = 0; i < display_param_count; i++) {
+		const display_param_t *field = &display_param_fields[i];
+
+		if (i == 0 || strcmp(field->group, display_param_fields[i - 1].group) != 0) {
+			group = json_object_new_object();
+			json_object_object_add(json, field->group, group);
+		}
+
+		json_object_object_add(group, field->key, json_object_new_int(display_param_value(&params, i)));
+	}
 
 	return json;
 }
 
-void write_file(video_device_t *my_vd) {
-	struct json_object *json;
-
-	printf("Writing controls file...\n");
+static void build_model(video_device_t *my_vd) {
+	printf("Building controls model...\n");
 	fflush(stdout);
 
-	json = json_object_new_object();
-
-	json_object_object_add(json, "device", get_device_ctrls_json_array(my_vd));
-	json_object_object_add(json, "display", get_display_ctrls_json_array(my_vd));
+	model = json_object_new_object();
 
-	FILE *out = fopen(CTRL_FILE, "wb");
+	json_object_object_add(model, "device", get_device_ctrls_json_array(my_vd));
+	json_object_object_add(model, "display", get_display_ctrls_json_array());
 
-	if (out != NULL) {
-		fputs(json_object_get_string(json), out);
-		fclose(out);
+	if (model_cec_mapping != NULL) {
+		json_object_object_add(model, "cecMapping", json_object_get(model_cec_mapping));
 	}
 
-	json_object_put(json);
-	printf("Writing controls file done!\n");
-	fflush(stdout);
+	display_params_get(&model_display);
+
+	model_dirty = 1;
 }
 
-int set_control(video_device_t *my_vd, const char *name, int32_t value) {
-	struct v4l2_queryctrl qctrl;
-	struct v4l2_control ctrl;
+// Mirrors the values changed since the last sync into the model, without touching the device
+static void sync_model(video_device_t *my_vd) {
+	display_params_t display;
 
-	int32_t prevValue;
-	int changed = 0;
+	if (model == NULL) {
+		return;
+	}
 
-	for (int i = V4L2_CID_BASE; i < V4L2_CID_LASTP1; i++) {
-		qctrl.id = i;
-		ctrl.id = i;
+	for (int i = 0; i < my_vd->controls.count; i++) {
+		control_entry_t *entry = &my_vd->controls.entries[i];
 
-		if (ioctl(my_vd->device_file, VIDIOC_QUERYCTRL, &qctrl) == 0) {
-			if (
-				strcmp(qctrl.name, name) == 0 &&
-				ioctl(my_vd->device_file, VIDIOC_G_CTRL, &ctrl) == 0
-			) {
-				prevValue = ctrl.value;
+		if (!entry->changed) {
+			continue;
+		}
 
-				if (prevValue != value) {
-					printf("[CONTROL] Will update %s to %i\n", qctrl.name, value);
+		entry->changed = 0;
 
-					ctrl.value = value;
-					int result = ioctl(my_vd->device_file, VIDIOC_S_CTRL, &ctrl);
+		if (model_controls[i] == NULL) {
+			continue;
+		}
 
-					if (result != 0) {
-						printf("Set control value returned %i\n", result);
-					}
+		json_object *value = json_object_object_get(model_controls[i], "ctrlValue");
 
-					changed = 1;
-				}
-			}
+		if (value == NULL) {
+			json_object_object_add(model_controls[i], "ctrlValue", json_object_new_int(entry->value));
+		} else if (json_object_get_int(value) != entry->value) {
+			json_object_set_int(value, entry->value);
+		} else {
+			continue;
 		}
+
+		model_dirty = 1;
 	}
 
-	return changed;
+	display_params_get(&display);
+
+	if (memcmp(&display, &model_display, sizeof(display))) {
+		// Replaces the previous display object
+		json_object_object_add(model, "display", get_display_ctrls_json_array());
+
+		model_display = display;
+		model_dirty = 1;
+	}
+}
+
+// Written next to the control file and renamed over it, readers never see a partial file
+void write_file(video_device_t *my_vd) {
+	if (model == NULL) {
+		build_model(my_vd);
+	} else {
+		sync_model(my_vd);
+	}
+
+	if (!model_dirty) {
+		return;
+	}
+
+	printf("Writing controls file...\n");
+	fflush(stdout);
+
+	FILE *out = fopen(CTRL_TMP_FILE, "wb");
+
+	if (out == NULL) {
+		printf("Failed to write controls file: %s\n", strerror(errno));
+		return;
+	}
+
+	int failed = fputs(json_object_get_string(model), out) < 0;
+	failed |= fflush(out) != 0 || fsync(fileno(out)) != 0;
+	failed |= fclose(out) != 0;
+
+	if (failed || rename(CTRL_TMP_FILE, CTRL_FILE) != 0) {
+		printf("Failed to write controls file: %s\n", strerror(errno));
+		unlink(CTRL_TMP_FILE);
+		return;
+	}
+
+	model_dirty = 0;
+
+	printf("Writing controls file done!\n");
+	fflush(stdout);
 }
 
 int read_device_controls(video_device_t *my_vd, struct json_object *json) {
 	size_t ctrls_length = json_object_array_length(json);
 	size_t i = 0;
 
+	static control_batch_t batch;
+
 	json_object *ctrl;
-	char *name;
-	int32_t value;
-	int changed = 0;
+	json_object *value;
+	control_entry_t *entry;
+
+	control_batch_init(&batch);
 
 	for (i = 0; i < ctrls_length; i++) {
 		ctrl = json_object_array_get_idx(json, i);
-		name = (char*) json_object_get_string(json_object_object_get(ctrl, "ctrlName"));
-		value = json_object_get_int(json_object_object_get(ctrl, "ctrlValue"));
-		if (set_control(my_vd, (const char*)name, value)) {
-			changed = 1;
+		value = json_object_object_get(ctrl, "ctrlValue");
+		entry = control_catalog_find(&my_vd->controls, json_object_get_string(json_object_object_get(ctrl, "ctrlName")));
+
+		// Controls without a value could not be read when the file was written
+		if (entry == NULL || value == NULL) {
+			continue;
+		}
+
+		if (control_batch_add(&batch, entry, json_object_get_int(value))) {
+			printf("[CONTROL] Will update %s to %i\n", entry->name, json_object_get_int(value));
 		}
 	}
 
-	return changed;
+	if (batch.count == 0) {
+		return 0;
+	}
+
+	int changed = control_batch_apply(&batch, my_vd->device_file);
+
+	for (int j = 0; j < batch.rejected_count; j++) {
+		printf("[CONTROL] Device rejected %s\n", batch.rejected[j]->name);
+	}
+
+	// The file holds values the device did not take, it has to be rewritten
+	if (batch.rejected_count > 0) {
+		model_dirty = 1;
+	}
+
+	return changed > 0;
 }
 
+// Params missing from the file keep their current value
 int read_display_controls(struct json_object *json) {
-	struct json_object *fcc = json_object_object_get(json, "fcc");
-	struct json_object *bws = json_object_object_get(json, "bws");
-	struct json_object *lti = json_object_object_get(json, "lti");
-
-	struct drm_sun4i_fcc_params fcc_dsp;
-	struct drm_sun8i_bws_params bws_dsp;
-	struct drm_sun8i_lti_params lti_dsp;
-
-	fcc_dsp.enable = json_object_get_int(json_object_object_get(fcc, "enable"));
-	fcc_dsp.hr_hue_min = json_object_get_int(json_object_object_get(fcc, "hr_hue_min"));
-	fcc_dsp.hr_hue_max = json_object_get_int(json_object_object_get(fcc, "hr_hue_max"));
-	fcc_dsp.hg_hue_min = json_object_get_int(json_object_object_get(fcc, "hg_hue_min"));
-	fcc_dsp.hg_hue_max = json_object_get_int(json_object_object_get(fcc, "hg_hue_max"));
-	fcc_dsp.hb_hue_min = json_object_get_int(json_object_object_get(fcc, "hb_hue_min"));
-	fcc_dsp.hb_hue_max = json_object_get_int(json_object_object_get(fcc, "hb_hue_max"));
-	fcc_dsp.hc_hue_min = json_object_get_int(json_object_object_get(fcc, "hc_hue_min"));
-	fcc_dsp.hc_hue_max = json_object_get_int(json_object_object_get(fcc, "hc_hue_max"));
-	fcc_dsp.hm_hue_min = json_object_get_int(json_object_object_get(fcc, "hm_hue_min"));
-	fcc_dsp.hm_hue_max = json_object_get_int(json_object_object_get(fcc, "hm_hue_max"));
-	fcc_dsp.hy_hue_min = json_object_get_int(json_object_object_get(fcc, "hy_hue_min"));
-	fcc_dsp.hy_hue_max = json_object_get_int(json_object_object_get(fcc, "hy_hue_max"));
-	fcc_dsp.hr_hue_gain = json_object_get_int(json_object_object_get(fcc, "hr_hue_gain"));
-	fcc_dsp.hr_sat_gain = json_object_get_int(json_object_object_get(fcc, "hr_sat_gain"));
-	fcc_dsp.hg_hue_gain = json_object_get_int(json_object_object_get(fcc, "hg_hue_gain"));
-	fcc_dsp.hg_sat_gain = json_object_get_int(json_object_object_get(fcc, "hg_sat_gain"));
-	fcc_dsp.hb_hue_gain = json_object_get_int(json_object_object_get(fcc, "hb_hue_gain"));
-	fcc_dsp.hb_sat_gain = json_object_get_int(json_object_object_get(fcc, "hb_sat_gain"));
-	fcc_dsp.hc_hue_gain = json_object_get_int(json_object_object_get(fcc, "hc_hue_gain"));
-	fcc_dsp.hc_sat_gain = json_object_get_int(json_object_object_get(fcc, "hc_sat_gain"));
-	fcc_dsp.hm_hue_gain = json_object_get_int(json_object_object_get(fcc, "hm_hue_gain"));
-	fcc_dsp.hm_sat_gain = json_object_get_int(json_object_object_get(fcc, "hm_sat_gain"));
-	fcc_dsp.hy_hue_gain = json_object_get_int(json_object_object_get(fcc, "hy_hue_gain"));
-	fcc_dsp.hy_sat_gain = json_object_get_int(json_object_object_get(fcc, "hy_sat_gain"));
-
-	bws_dsp.enable = json_object_get_int(json_object_object_get(bws, "enable"));
-	bws_dsp.min = json_object_get_int(json_object_object_get(bws, "min"));
-	bws_dsp.black = json_object_get_int(json_object_object_get(bws, "black"));
-	bws_dsp.white = json_object_get_int(json_object_object_get(bws, "white"));
-	bws_dsp.max = json_object_get_int(json_object_object_get(bws, "max"));
-	bws_dsp.slope0 = json_object_get_int(json_object_object_get(bws, "slope0"));
-	bws_dsp.slope1 = json_object_get_int(json_object_object_get(bws, "slope1"));
-	bws_dsp.slope2 = json_object_get_int(json_object_object_get(bws, "slope2"));
-	bws_dsp.slope3 = json_object_get_int(json_object_object_get(bws, "slope3"));
-
-	lti_dsp.enable = json_object_get_int(json_object_object_get(lti, "enable"));
-	lti_dsp.c0 = json_object_get_int(json_object_object_get(lti, "c0"));
-	lti_dsp.c1 = json_object_get_int(json_object_object_get(lti, "c1"));
-	lti_dsp.c2 = json_object_get_int(json_object_object_get(lti, "c2"));
-	lti_dsp.c3 = json_object_get_int(json_object_object_get(lti, "c3"));
-	lti_dsp.c4 = json_object_get_int(json_object_object_get(lti, "c4"));
-	lti_dsp.fir_gain = json_object_get_int(json_object_object_get(lti, "fir_gain"));
-	lti_dsp.cor_th = json_object_get_int(json_object_object_get(lti, "cor_th"));
-	lti_dsp.diff_offset = json_object_get_int(json_object_object_get(lti, "diff_offset"));
-	lti_dsp.diff_slope = json_object_get_int(json_object_object_get(lti, "diff_slope"));
-	lti_dsp.edge_gain = json_object_get_int(json_object_object_get(lti, "edge_gain"));
-	lti_dsp.core_x = json_object_get_int(json_object_object_get(lti, "core_x"));
-	lti_dsp.clip_y = json_object_get_int(json_object_object_get(lti, "clip_y"));
-	lti_dsp.peak_limit = json_object_get_int(json_object_object_get(lti, "peak_limit"));
-	lti_dsp.win_expansion = json_object_get_int(json_object_object_get(lti, "win_expansion"));
-	lti_dsp.edge_level_th = json_object_get_int(json_object_object_get(lti, "edge_level_th"));
-
-	int changed = set_drm_fcc(&fcc_dsp);
-	changed |= set_drm_bws(&bws_dsp);
-	changed |= set_drm_lti(&lti_dsp);
+	struct json_object *group;
+	struct json_object *value;
+	display_params_t params;
 
-	return changed;
-}
+	display_params_get(&params);
 
-int read_controls(video_device_t *my_vd) {
-	printf("Reading controls file...\n");
-	fflush(stdout);
+	for (int i = 0; i < display_param_count; i++) {
+		const display_param_t *field = &display_param_fields[i];
 
-	FILE *in = fopen(CTRL_FILE, "r");
+		if (
+			json_object_object_get_ex(json, field->group, &group) &&
+			json_object_object_get_ex(group, field->key, &value)
+		) {
+			display_param_set_value(&params, i, json_object_get_int(value));
+		}
+	}
 
-	if (in == NULL) {
-		return 0;
+	return display_params_set(&params);
+}
+
+static void set_model_cec_mapping(json_object *cec_mapping) {
+	if (model_cec_mapping != NULL) {
+		json_object_put(model_cec_mapping);
 	}
 
-	fseek(in, 0L, SEEK_END);
-	uint64_t size = ftell(in) + 1;
+	model_cec_mapping = cec_mapping != NULL ? json_object_get(cec_mapping) : NULL;
 
-	if (size > 500000) {
-		printf("Controls file too large. Skipping.\n");
-		fclose(in);
-		return 0;
+	if (model == NULL) {
+		return;
 	}
 
-	if (size < 2) {
-		printf("Controls file too small. Skipping.\n");
-		fclose(in);
-		return 0;
+	if (model_cec_mapping != NULL) {
+		json_object_object_add(model, "cecMapping", json_object_get(model_cec_mapping));
+	} else {
+		json_object_object_del(model, "cecMapping");
 	}
+}
 
-	fseek(in, 0L, SEEK_SET);
+// Feeds the file to the tokener in chunks, any formatting is accepted and nothing is buffered whole
+static json_object* parse_file(const char *path) {
+	char chunk[CTRL_FILE_CHUNK_SIZE];
+	enum json_tokener_error error = json_tokener_continue;
+	json_object *json = NULL;
+	size_t total = 0;
+	ssize_t len;
 
-	char *buffer = malloc(size);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
 
-	if (fgets(buffer, size, in) != buffer) {
-		fclose(in);
-		return 0;
+	if (fd < 0) {
+		return NULL;
 	}
 
-	fclose(in);
+	json_tokener *tokener = json_tokener_new();
+
+	while ((len = read(fd, chunk, sizeof(chunk))) > 0) {
+		total += len;
+
+		if (total > CTRL_FILE_MAX_SIZE) {
+			printf("Controls file too large. Skipping.\n");
+			break;
+		}
 
-	buffer[size - 1] = 0;
+		json = json_tokener_parse_ex(tokener, chunk, len);
+		error = json_tokener_get_error(tokener);
+
+		if (error != json_tokener_continue) {
+			break;
+		}
+	}
 
-	json_object *json = json_tokener_parse(buffer);
+	if (error != json_tokener_success) {
+		if (total > 0 && total <= CTRL_FILE_MAX_SIZE) {
+			printf("Controls file parse failed: %s\n", json_tokener_error_desc(error));
+		}
+
+		json_object_put(json);
+		json = NULL;
+	}
+
+	json_tokener_free(tokener);
+	close(fd);
+
+	return json;
+}
+
+// needs_write is set when the file holds values that have to be written back, even if
+// nothing changed
+int read_controls(video_device_t *my_vd, int *needs_write) {
+	printf("Reading controls file...\n");
+	fflush(stdout);
+
+	json_object *json = parse_file(CTRL_FILE);
 
 	if (json == NULL) {
-		printf("Controls file parse failed\n");
 		fflush(stdout);
-		fclose(in);
-		free(buffer);
 		return 0;
 	}
 
+	// Changes made before the file was read still have to be written
+	sync_model(my_vd);
+	int was_dirty = model_dirty;
+
 	int changed = read_device_controls(my_vd, json_object_object_get(json, "device"));
 
 	changed |= read_display_controls(json_object_object_get(json, "display"));
 
+	// What came from the file is already in the file
+	int rejected = model_dirty;
+	sync_model(my_vd);
+	model_dirty = was_dirty || rejected;
+	*needs_write = rejected;
+
+	json_object *cec_mapping = NULL;
+	json_object_object_get_ex(json, "cecMapping", &cec_mapping);
+	cec_mapping_configure(cec_mapping);
+	set_model_cec_mapping(cec_mapping);
+
+	// One shot, the recalled values replace the key when the file is written back. Written
+	// back even when the recall changed nothing, a key left in the file would recall the
+	// preset again over the next edit.
+	json_object *recall;
+
+	if (json_object_object_get_ex(json, "recallPreset", &recall)) {
+		changed |= preset_recall(my_vd, preset_find(json_object_get_string(recall))) > 0;
+		model_dirty = 1;
+		*needs_write = 1;
+	}
+
 	fflush(stdout);
 
 	json_object_put(json);
-	free(buffer);
 
 	return changed;
-
 }
 
-void load_file_controls(video_device_t *my_vd, int *changes_loaded) {
+void load_file_controls(video_device_t *my_vd, int *changes_loaded, int *needs_write) {
+	*needs_write = 0;
+
     if (access(CTRL_FILE, F_OK) == 0) {
-		*changes_loaded = read_controls(my_vd);
+		*changes_loaded = read_controls(my_vd, needs_write);
 	} else {
 		*changes_loaded = 0;
 	}
@@ -430,9 +478,27 @@ void write_file_controls(video_device_t *my_vd) {
 	write_file(my_vd);
 }
 
-void start_inotify_control_file() {
-	inotify_fd = inotify_init1(IN_NONBLOCK);
-	inotify_add_watch(inotify_fd, CTRL_FILE, IN_CLOSE_WRITE);
+void release_file_controls() {
+	if (model != NULL) {
+		json_object_put(model);
+		model = NULL;
+	}
+
+	if (model_cec_mapping != NULL) {
+		json_object_put(model_cec_mapping);
+		model_cec_mapping = NULL;
+	}
+
+	memset(model_controls, 0, sizeof(model_controls));
+	model_dirty = 0;
+}
+
+// The directory is watched, renaming a new file over the control file would drop a file watch
+int start_inotify_control_file() {
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	inotify_add_watch(inotify_fd, CTRL_DIR, IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO);
+
+	return inotify_fd;
 }
 
 int inotify_poll() {
@@ -440,6 +506,9 @@ int inotify_poll() {
                __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
 	struct pollfd pfd;
+	struct inotify_event *event;
+	uint32_t own_rename_cookie = 0;
+	int len;
 
 	pfd.fd = inotify_fd;
 	pfd.events = POLLIN;
@@ -449,12 +518,32 @@ int inotify_poll() {
 	if (result > 0 && pfd.revents & POLLIN) {
 		int has_events = 0;
 
-		while (read(inotify_fd, buf, sizeof(buf)) > 0) {
-			has_events = 1;
-		}
+		while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+			for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+				event = (struct inotify_event*) ptr;
+
+				if (event->len == 0) {
+					continue;
+				}
 
-		if (has_events) {
-			inotify_add_watch(inotify_fd, CTRL_FILE, IN_CLOSE_WRITE);
+				// Our own writes are a rename from the temp file, both events share a cookie
+				if ((event->mask & IN_MOVED_FROM) && strcmp(event->name, CTRL_TMP_FILE_NAME) == 0) {
+					own_rename_cookie = event->cookie;
+					continue;
+				}
+
+				if (strcmp(event->name, CTRL_FILE_NAME) != 0) {
+					continue;
+				}
+
+				if ((event->mask & IN_MOVED_TO) && own_rename_cookie != 0 && event->cookie == own_rename_cookie) {
+					continue;
+				}
+
+				if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+					has_events = 1;
+				}
+			}
 		}
 
 		return has_events;
@@ -4,10 +4,15 @@
 #include <sys/types.h>
 #include "device.h"
 
-void load_file_controls(video_device_t *my_vd, int *changes_loaded);
+// needs_write is set when the file has to be written back though nothing may have changed,
+// like values the device rejected
+void load_file_controls(video_device_t *my_vd, int *changes_loaded, int *needs_write);
+// Only writes when a control changed since the last write
 void write_file_controls(video_device_t *my_vd);
+void release_file_controls();
 
-void start_inotify_control_file();
+// Returns the inotify fd, readable when the control file may have changed
+int start_inotify_control_file();
 void stop_inotify_control_file();
 
 int inotify_poll();
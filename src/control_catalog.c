@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "control_catalog.h"
+
+static uint32_t build_count = 0;
+
+static uint64_t min_set_interval_ns = 1000000000ULL / CONTROL_CATALOG_DEFAULT_MAX_RATE;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name) {
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void index_entry(control_catalog_t *catalog, int entry_index) {
+	uint32_t slot = hash_name(catalog->entries[entry_index].name) & (CONTROL_CATALOG_HASH_SIZE - 1);
+
+	while (catalog->index[slot]) {
+		slot = (slot + 1) & (CONTROL_CATALOG_HASH_SIZE - 1);
+	}
+
+	catalog->index[slot] = entry_index + 1;
+}
+
+void control_catalog_clear(control_catalog_t *catalog) {
+	memset(catalog, 0, sizeof(control_catalog_t));
+}
+
+int control_catalog_build(control_catalog_t *catalog, int device_file) {
+	struct v4l2_queryctrl qctrl;
+	struct v4l2_control ctrl;
+
+	control_catalog_clear(catalog);
+
+	memset(&qctrl, 0, sizeof(qctrl));
+	qctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+
+	while (ioctl(device_file, VIDIOC_QUERYCTRL, &qctrl) == 0) {
+		if (
+			qctrl.type != V4L2_CTRL_TYPE_CTRL_CLASS &&
+			!(qctrl.flags & V4L2_CTRL_FLAG_DISABLED)
+		) {
+			if (catalog->count >= CONTROL_CATALOG_MAX) {
+				printf("Control catalog full, ignoring controls from \"%s\"\n", qctrl.name);
+				break;
+			}
+
+			control_entry_t *entry = &catalog->entries[catalog->count];
+
+			entry->id = qctrl.id;
+			entry->type = qctrl.type;
+			entry->flags = qctrl.flags;
+			entry->minimum = qctrl.minimum;
+			entry->maximum = qctrl.maximum;
+			entry->step = qctrl.step;
+			entry->default_value = qctrl.default_value;
+			snprintf(entry->name, sizeof(entry->name), "%s", (const char*)qctrl.name);
+
+			ctrl.id = qctrl.id;
+
+			if (
+				!(qctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) &&
+				ioctl(device_file, VIDIOC_G_CTRL, &ctrl) == 0
+			) {
+				entry->value = ctrl.value;
+				entry->value_valid = 1;
+			}
+
+			index_entry(catalog, catalog->count);
+			catalog->count++;
+		}
+
+		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+
+	catalog->valid = 1;
+	catalog->generation = ++build_count;
+
+	printf("Control catalog has %i controls\n", catalog->count);
+	fflush(stdout);
+
+	return catalog->count;
+}
+
+control_entry_t* control_catalog_find(control_catalog_t *catalog, const char *name) {
+	if (!catalog->valid || name == NULL) {
+		return NULL;
+	}
+
+	uint32_t slot = hash_name(name) & (CONTROL_CATALOG_HASH_SIZE - 1);
+
+	while (catalog->index[slot]) {
+		control_entry_t *entry = &catalog->entries[catalog->index[slot] - 1];
+
+		if (strcmp(entry->name, name) == 0) {
+			return entry;
+		}
+
+		slot = (slot + 1) & (CONTROL_CATALOG_HASH_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+// Controls are enumerated in ascending id order
+control_entry_t* control_catalog_find_id(control_catalog_t *catalog, uint32_t id) {
+	int low = 0;
+	int high = catalog->count - 1;
+
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		control_entry_t *entry = &catalog->entries[middle];
+
+		if (entry->id == id) {
+			return entry;
+		}
+
+		if (entry->id < id) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return NULL;
+}
+
+int control_catalog_set(int device_file, control_entry_t *entry, int32_t value) {
+	struct v4l2_control ctrl;
+
+	if (entry->value_valid && entry->value == value) {
+		return 0;
+	}
+
+	ctrl.id = entry->id;
+	ctrl.value = value;
+
+	if (ioctl(device_file, VIDIOC_S_CTRL, &ctrl) != 0) {
+		printf("Set control \"%s\" failed: %s\n", entry->name, strerror(errno));
+		return 0;
+	}
+
+	entry->value = ctrl.value;
+	entry->value_valid = 1;
+	entry->changed = 1;
+
+	return 1;
+}
+
+void control_catalog_set_max_rate(int max_rate) {
+	min_set_interval_ns = max_rate > 0 ? 1000000000ULL / max_rate : 0;
+}
+
+int control_catalog_submit(control_catalog_t *catalog, int device_file, control_entry_t *entry, int32_t value) {
+	uint64_t now = now_ns();
+
+	catalog->submitted++;
+
+	if (entry->pending) {
+		catalog->coalesced++;
+
+		// Back to the value the device has, nothing left to set
+		if (entry->value_valid && entry->value == value) {
+			entry->pending = 0;
+			catalog->pending_count--;
+			return 0;
+		}
+
+		entry->pending_value = value;
+		return 1;
+	}
+
+	if (entry->value_valid && entry->value == value) {
+		return 0;
+	}
+
+	// Leading edge, the first update after a quiet period is not delayed
+	if (now - entry->last_set_ns >= min_set_interval_ns) {
+		entry->last_set_ns = now;
+
+		if (control_catalog_set(device_file, entry, value)) {
+			catalog->applied++;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	entry->pending = 1;
+	entry->pending_value = value;
+	catalog->pending_count++;
+
+	return 1;
+}
+
+int control_catalog_flush(control_catalog_t *catalog, int device_file) {
+	uint64_t now;
+	int changed = 0;
+
+	if (catalog->pending_count == 0) {
+		return 0;
+	}
+
+	now = now_ns();
+
+	for (int i = 0; i < catalog->count; i++) {
+		control_entry_t *entry = &catalog->entries[i];
+
+		if (!entry->pending || now - entry->last_set_ns < min_set_interval_ns) {
+			continue;
+		}
+
+		entry->pending = 0;
+		entry->last_set_ns = now;
+		catalog->pending_count--;
+
+		if (control_catalog_set(device_file, entry, entry->pending_value)) {
+			catalog->applied++;
+			changed++;
+		}
+	}
+
+	return changed;
+}
+
+void control_catalog_cancel(control_catalog_t *catalog, control_entry_t *entry) {
+	if (entry->pending) {
+		entry->pending = 0;
+		catalog->pending_count--;
+		catalog->coalesced++;
+	}
+}
+
+uint64_t control_catalog_next_flush_ns(control_catalog_t *catalog) {
+	uint64_t next = 0;
+
+	if (catalog->pending_count == 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < catalog->count; i++) {
+		control_entry_t *entry = &catalog->entries[i];
+
+		if (entry->pending && (next == 0 || entry->last_set_ns + min_set_interval_ns < next)) {
+			next = entry->last_set_ns + min_set_interval_ns;
+		}
+	}
+
+	return next;
+}
+
+void control_batch_init(control_batch_t *batch) {
+	batch->count = 0;
+	batch->rejected_count = 0;
+}
+
+int control_batch_add(control_batch_t *batch, control_entry_t *entry, int32_t value) {
+	int i;
+
+	if (
+		entry->type == V4L2_CTRL_TYPE_BUTTON ||
+		(entry->flags & V4L2_CTRL_FLAG_READ_ONLY)
+	) {
+		return 0;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->entries[i] == entry) {
+			batch->values[i] = value;
+			return 1;
+		}
+	}
+
+	if (entry->value_valid && entry->value == value) {
+		return 0;
+	}
+
+	if (batch->count >= CONTROL_CATALOG_MAX) {
+		return 0;
+	}
+
+	batch->entries[batch->count] = entry;
+	batch->values[batch->count] = value;
+	batch->count++;
+
+	return 1;
+}
+
+static void reject(control_batch_t *batch, control_entry_t *entry) {
+	batch->rejected[batch->rejected_count++] = entry;
+}
+
+static int apply_one_by_one(control_batch_t *batch, int device_file, control_entry_t **entries, struct v4l2_ext_control *controls, int count) {
+	int changed = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (control_catalog_set(device_file, entries[i], controls[i].value)) {
+			changed++;
+		} else if (!(entries[i]->value_valid && entries[i]->value == controls[i].value)) {
+			reject(batch, entries[i]);
+		}
+	}
+
+	return changed;
+}
+
+static int apply_class(control_batch_t *batch, int device_file, uint32_t ctrl_class) {
+	struct v4l2_ext_control controls[CONTROL_CATALOG_MAX];
+	control_entry_t *entries[CONTROL_CATALOG_MAX];
+	struct v4l2_ext_controls ext;
+	int count = 0;
+	int i;
+
+	memset(controls, 0, sizeof(struct v4l2_ext_control) * batch->count);
+
+	for (i = 0; i < batch->count; i++) {
+		if (V4L2_CTRL_ID2CLASS(batch->entries[i]->id) == ctrl_class) {
+			entries[count] = batch->entries[i];
+			controls[count].id = batch->entries[i]->id;
+			controls[count].value = batch->values[i];
+			count++;
+		}
+	}
+
+	while (count > 0) {
+		memset(&ext, 0, sizeof(ext));
+		ext.ctrl_class = ctrl_class;
+		ext.count = count;
+		ext.controls = controls;
+
+		if (ioctl(device_file, VIDIOC_TRY_EXT_CTRLS, &ext) == 0) {
+			break;
+		}
+
+		// The driver could not tell which control failed
+		if (ext.error_idx >= (uint32_t)count) {
+			return apply_one_by_one(batch, device_file, entries, controls, count);
+		}
+
+		reject(batch, entries[ext.error_idx]);
+
+		count--;
+		memmove(&entries[ext.error_idx], &entries[ext.error_idx + 1], sizeof(control_entry_t*) * (count - ext.error_idx));
+		memmove(&controls[ext.error_idx], &controls[ext.error_idx + 1], sizeof(struct v4l2_ext_control) * (count - ext.error_idx));
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	memset(&ext, 0, sizeof(ext));
+	ext.ctrl_class = ctrl_class;
+	ext.count = count;
+	ext.controls = controls;
+
+	if (ioctl(device_file, VIDIOC_S_EXT_CTRLS, &ext) != 0) {
+		printf("Set controls batch failed: %s, applying one by one\n", strerror(errno));
+		return apply_one_by_one(batch, device_file, entries, controls, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		entries[i]->value = controls[i].value;
+		entries[i]->value_valid = 1;
+		entries[i]->changed = 1;
+	}
+
+	return count;
+}
+
+int control_batch_apply(control_batch_t *batch, int device_file) {
+	uint32_t classes[CONTROL_CATALOG_MAX];
+	int class_count = 0;
+	int changed = 0;
+	int i, j;
+
+	for (i = 0; i < batch->count; i++) {
+		uint32_t ctrl_class = V4L2_CTRL_ID2CLASS(batch->entries[i]->id);
+
+		for (j = 0; j < class_count && classes[j] != ctrl_class; j++);
+
+		if (j == class_count) {
+			classes[class_count++] = ctrl_class;
+		}
+	}
+
+	for (i = 0; i < class_count; i++) {
+		changed += apply_class(batch, device_file, classes[i]);
+	}
+
+	// Retry the rejected controls now that the rest of the batch is applied
+	int rejected_count = batch->rejected_count;
+	batch->rejected_count = 0;
+
+	for (i = 0; i < rejected_count; i++) {
+		control_entry_t *entry = batch->rejected[i];
+
+		for (j = 0; j < batch->count && batch->entries[j] != entry; j++);
+
+		if (control_catalog_set(device_file, entry, batch->values[j])) {
+			changed++;
+		} else if (!(entry->value_valid && entry->value == batch->values[j])) {
+			reject(batch, entry);
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,101 @@
+#ifndef _CONTROL_CATALOG_H_
+#define _CONTROL_CATALOG_H_
+
+#include <inttypes.h>
+
+#define CONTROL_CATALOG_MAX 128
+// Power of two, at least twice CONTROL_CATALOG_MAX to keep probing short
+#define CONTROL_CATALOG_HASH_SIZE 256
+
+typedef struct {
+    uint32_t id;
+    uint32_t type;
+    uint32_t flags;
+    int32_t minimum;
+    int32_t maximum;
+    int32_t step;
+    int32_t default_value;
+
+    // Last value read from or written to the device
+    int32_t value;
+    uint8_t value_valid;
+    // Set when value is changed through the catalog, cleared by whoever mirrors it
+    uint8_t changed;
+
+    // Rate limiting, see control_catalog_submit
+    uint8_t pending;
+    int32_t pending_value;
+    uint64_t last_set_ns;
+
+    char name[32];
+} control_entry_t;
+
+typedef struct {
+    uint8_t valid;
+    // Changes with every build, entry pointers from an older build are stale
+    uint32_t generation;
+    int count;
+    control_entry_t entries[CONTROL_CATALOG_MAX];
+
+    // Entry index + 1 by name hash, 0 is empty
+    uint8_t index[CONTROL_CATALOG_HASH_SIZE];
+
+    int pending_count;
+
+    // Updates submitted, replaced by a newer one before reaching the device, and set
+    uint32_t submitted;
+    uint32_t coalesced;
+    uint32_t applied;
+} control_catalog_t;
+
+// Enumerates every control of the device once, including class and driver private ones.
+int control_catalog_build(control_catalog_t *catalog, int device_file);
+void control_catalog_clear(control_catalog_t *catalog);
+
+control_entry_t* control_catalog_find(control_catalog_t *catalog, const char *name);
+control_entry_t* control_catalog_find_id(control_catalog_t *catalog, uint32_t id);
+
+// One VIDIOC_S_CTRL, skipped when the cached value already matches. Returns 1 if the value changed.
+int control_catalog_set(int device_file, control_entry_t *entry, int32_t value);
+
+#define CONTROL_CATALOG_DEFAULT_MAX_RATE 25
+
+// Updates per second a single control is set at most through control_catalog_submit, 0 is unlimited
+void control_catalog_set_max_rate(int max_rate);
+
+// For updates arriving in bursts (CEC jog wheels, UI sliders). A control that was not set
+// within the rate interval is set at once, otherwise only the latest value is kept until
+// control_catalog_flush. Returns 1 if the value was set or queued.
+int control_catalog_submit(control_catalog_t *catalog, int device_file, control_entry_t *entry, int32_t value);
+
+// Sets the queued values whose interval elapsed. Returns the number of controls changed.
+int control_catalog_flush(control_catalog_t *catalog, int device_file);
+
+// Drops the value queued for the control, when a newer one is set through other means
+void control_catalog_cancel(control_catalog_t *catalog, control_entry_t *entry);
+
+// CLOCK_MONOTONIC time the next queued value is due, 0 when nothing is queued
+uint64_t control_catalog_next_flush_ns(control_catalog_t *catalog);
+
+// Changes applied together, one VIDIOC_S_EXT_CTRLS per control class
+typedef struct {
+    int count;
+    control_entry_t *entries[CONTROL_CATALOG_MAX];
+    int32_t values[CONTROL_CATALOG_MAX];
+
+    int rejected_count;
+    control_entry_t *rejected[CONTROL_CATALOG_MAX];
+} control_batch_t;
+
+void control_batch_init(control_batch_t *batch);
+
+// Queues a change unless the cached value already matches. Returns 1 if queued.
+int control_batch_add(control_batch_t *batch, control_entry_t *entry, int32_t value);
+
+// Validates each class with VIDIOC_TRY_EXT_CTRLS, drops the controls the driver rejects
+// and sets the rest at once. Rejected controls are retried alone after the batch, as they
+// may depend on it (an auto mode being turned off), and the ones still failing are left in
+// batch->rejected. Returns the number of controls changed.
+int control_batch_apply(control_batch_t *batch, int device_file);
+
+#endif
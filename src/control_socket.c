@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <linux/videodev2.h>
+
+#include "control_socket.h"
+#include "display_params.h"
+#include "presets.h"
+
+#define CONTROL_SOCKET_MAX_CLIENTS 8
+#define CONTROL_SOCKET_LINE_MAX 128
+#define CONTROL_SOCKET_MAX_EVENTS (CONTROL_SOCKET_MAX_CLIENTS + 1)
+
+typedef struct {
+	int fd;
+	int subscribed;
+
+	// Partial command, until its newline arrives. An overflowed one is dropped up to it.
+	int length;
+	int overflowed;
+	char line[CONTROL_SOCKET_LINE_MAX];
+} socket_client_t;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static socket_client_t clients[CONTROL_SOCKET_MAX_CLIENTS];
+
+// Values last seen by control_socket_publish
+static int32_t published_controls[CONTROL_CATALOG_MAX];
+static uint8_t published_controls_valid[CONTROL_CATALOG_MAX];
+static display_params_t published_display;
+
+static void close_client(socket_client_t *client) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+
+	client->fd = -1;
+	client->subscribed = 0;
+	client->length = 0;
+	client->overflowed = 0;
+}
+
+// Clients are never waited for, one that can't keep up is dropped
+static void send_line(socket_client_t *client, const char *format, ...) {
+	char line[CONTROL_SOCKET_LINE_MAX];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+
+	if (length < 0 || length > (int) sizeof(line) - 2) {
+		length = sizeof(line) - 2;
+	}
+
+	line[length++] = '\n';
+
+	if (send(client->fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length) {
+		printf("Control socket client dropped\n");
+		close_client(client);
+	}
+}
+
+static void snapshot_values(video_device_t *my_vd) {
+	for (int i = 0; i < my_vd->controls.count; i++) {
+		published_controls[i] = my_vd->controls.entries[i].value;
+		published_controls_valid[i] = my_vd->controls.entries[i].value_valid;
+	}
+
+	display_params_get(&published_display);
+}
+
+static void accept_clients() {
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		socket_client_t *client = NULL;
+
+		for (int i = 0; i < CONTROL_SOCKET_MAX_CLIENTS; i++) {
+			if (clients[i].fd < 0) {
+				client = &clients[i];
+				break;
+			}
+		}
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+
+		if (client == NULL || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			printf("Control socket refused a client\n");
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->subscribed = 0;
+		client->length = 0;
+		client->overflowed = 0;
+	}
+}
+
+static int set_device_control(video_device_t *my_vd, socket_client_t *client, control_entry_t *entry, int32_t value) {
+	if (entry->flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_DISABLED)) {
+		send_line(client, "error %s is read only", entry->name);
+		return 0;
+	}
+
+	int changed = control_catalog_submit(&my_vd->controls, my_vd->device_file, entry, value);
+
+	if (entry->pending) {
+		send_line(client, "queued %s=%i", entry->name, entry->pending_value);
+		return changed;
+	}
+
+	if (!changed && !(entry->value_valid && entry->value == value)) {
+		send_line(client, "error %s rejected %i", entry->name, value);
+		return 0;
+	}
+
+	send_line(client, "value %s=%i", entry->name, entry->value);
+
+	return changed;
+}
+
+static int handle_preset_command(video_device_t *my_vd, socket_client_t *client, char *args) {
+	char *end;
+	int slot;
+
+	if (strcmp(args, "list") == 0) {
+		for (slot = 0; slot < PRESET_MAX_SLOTS; slot++) {
+			if (preset_name(slot) != NULL) {
+				send_line(client, "preset %i %s", slot, preset_name(slot));
+			}
+		}
+
+		send_line(client, "ok");
+		return 0;
+	}
+
+	if (strncmp(args, "recall ", 7) == 0) {
+		slot = preset_find(args + 7);
+		int changed = preset_recall(my_vd, slot);
+
+		if (changed < 0) {
+			send_line(client, "error no such preset");
+			return 0;
+		}
+
+		send_line(client, "recalled %i changed=%i us=%llu", slot, changed, (unsigned long long) preset_last_recall_ns() / 1000);
+		return changed > 0;
+	}
+
+	if (strncmp(args, "save ", 5) == 0) {
+		slot = strtol(args + 5, &end, 10);
+
+		if (end == args + 5 || (*end != ' ' && *end != 0)) {
+			send_line(client, "error invalid slot");
+			return 0;
+		}
+
+		const char *name = *end == ' ' ? end + 1 : "";
+
+		if (preset_save(my_vd, slot, name) != 0) {
+			send_line(client, "error preset not saved");
+		} else {
+			send_line(client, "saved %i %s", slot, preset_name(slot));
+		}
+
+		return 0;
+	}
+
+	send_line(client, "error unknown command");
+	return 0;
+}
+
+static int handle_command(video_device_t *my_vd, socket_client_t *client, char *line) {
+	display_params_t params;
+	control_entry_t *entry;
+	char *name;
+	char *end;
+	int index;
+	int set = 0;
+	long value = 0;
+
+	if (strcmp(line, "subscribe") == 0) {
+		client->subscribed = 1;
+		send_line(client, "ok");
+		return 0;
+	}
+
+	if (strcmp(line, "stats") == 0) {
+		send_line(client, "stats submitted=%u applied=%u coalesced=%u",
+			my_vd->controls.submitted,
+			my_vd->controls.applied,
+			my_vd->controls.coalesced
+		);
+		return 0;
+	}
+
+	if (strncmp(line, "preset ", 7) == 0) {
+		return handle_preset_command(my_vd, client, line + 7);
+	}
+
+	if (strncmp(line, "get ", 4) == 0) {
+		name = line + 4;
+	} else if (strncmp(line, "set ", 4) == 0) {
+		name = line + 4;
+		char *separator = strchr(name, '=');
+
+		if (separator == NULL) {
+			send_line(client, "error missing value");
+			return 0;
+		}
+
+		*separator = 0;
+		errno = 0;
+		value = strtol(separator + 1, &end, 10);
+
+		if (errno != 0 || end == separator + 1 || *end != 0 || value < INT32_MIN || value > INT32_MAX) {
+			send_line(client, "error invalid value");
+			return 0;
+		}
+
+		set = 1;
+	} else {
+		send_line(client, "error unknown command");
+		return 0;
+	}
+
+	entry = control_catalog_find(&my_vd->controls, name);
+
+	if (entry != NULL) {
+		if (set) {
+			return set_device_control(my_vd, client, entry, value);
+		}
+
+		if (!entry->value_valid) {
+			send_line(client, "error %s has no value", entry->name);
+		} else {
+			send_line(client, "value %s=%i", entry->name, entry->value);
+		}
+
+		return 0;
+	}
+
+	index = display_param_find(name);
+
+	if (index < 0) {
+		send_line(client, "error unknown control");
+		return 0;
+	}
+
+	display_params_get(&params);
+
+	int changed = 0;
+
+	if (set) {
+		display_param_set_value(&params, index, value);
+		changed = display_params_set(&params);
+	}
+
+	send_line(client, "value %s=%i", display_param_fields[index].name, display_param_value(&params, index));
+
+	return changed;
+}
+
+static int read_client(video_device_t *my_vd, socket_client_t *client) {
+	char buffer[512];
+	ssize_t length;
+	int changed = 0;
+
+	while ((length = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+		for (ssize_t i = 0; i < length && client->fd >= 0; i++) {
+			char c = buffer[i];
+
+			if (c == '\r') {
+				continue;
+			}
+
+			if (c != '\n') {
+				if (client->length < CONTROL_SOCKET_LINE_MAX - 1) {
+					client->line[client->length++] = c;
+				} else {
+					client->overflowed = 1;
+				}
+				continue;
+			}
+
+			client->line[client->length] = 0;
+			client->length = 0;
+
+			// A cut command could still parse as a different one, it is not run
+			if (client->overflowed) {
+				client->overflowed = 0;
+				send_line(client, "error line too long");
+				continue;
+			}
+
+			changed |= handle_command(my_vd, client, client->line);
+		}
+
+		if (client->fd < 0) {
+			return changed;
+		}
+	}
+
+	if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		close_client(client);
+	}
+
+	return changed;
+}
+
+int control_socket_start(video_device_t *my_vd) {
+	struct sockaddr_un address;
+	struct epoll_event event;
+
+	for (int i = 0; i < CONTROL_SOCKET_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, CONTROL_SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (listen_fd < 0) {
+		printf("Failed to create control socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// Left behind when the previous run was killed
+	unlink(CONTROL_SOCKET_PATH);
+
+	if (
+		bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+		listen(listen_fd, CONTROL_SOCKET_MAX_CLIENTS) != 0
+	) {
+		printf("Failed to listen on %s: %s\n", CONTROL_SOCKET_PATH, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	// Same trust as the control file, which the web UI writes
+	chmod(CONTROL_SOCKET_PATH, 0666);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+
+	if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+		printf("Failed to watch control socket: %s\n", strerror(errno));
+		control_socket_stop();
+		return -1;
+	}
+
+	snapshot_values(my_vd);
+
+	return epoll_fd;
+}
+
+void control_socket_stop() {
+	for (int i = 0; i < CONTROL_SOCKET_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			close_client(&clients[i]);
+		}
+	}
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(CONTROL_SOCKET_PATH);
+		listen_fd = -1;
+	}
+
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+int control_socket_poll(video_device_t *my_vd) {
+	struct epoll_event events[CONTROL_SOCKET_MAX_EVENTS];
+	int changed = 0;
+
+	if (epoll_fd < 0) {
+		return 0;
+	}
+
+	int n = epoll_wait(epoll_fd, events, CONTROL_SOCKET_MAX_EVENTS, 0);
+
+	for (int i = 0; i < n; i++) {
+		socket_client_t *client = events[i].data.ptr;
+
+		if (client == NULL) {
+			accept_clients();
+		} else if (client->fd >= 0) {
+			changed |= read_client(my_vd, client);
+		}
+	}
+
+	return changed;
+}
+
+void control_socket_publish(video_device_t *my_vd) {
+	display_params_t display;
+	int subscribers = 0;
+
+	for (int i = 0; i < CONTROL_SOCKET_MAX_CLIENTS; i++) {
+		subscribers += clients[i].fd >= 0 && clients[i].subscribed;
+	}
+
+	if (subscribers == 0) {
+		snapshot_values(my_vd);
+		return;
+	}
+
+	for (int i = 0; i < my_vd->controls.count; i++) {
+		control_entry_t *entry = &my_vd->controls.entries[i];
+
+		if (!entry->value_valid || (published_controls_valid[i] && published_controls[i] == entry->value)) {
+			continue;
+		}
+
+		published_controls[i] = entry->value;
+		published_controls_valid[i] = 1;
+
+		for (int j = 0; j < CONTROL_SOCKET_MAX_CLIENTS; j++) {
+			if (clients[j].fd >= 0 && clients[j].subscribed) {
+				send_line(&clients[j], "changed %s=%i", entry->name, entry->value);
+			}
+		}
+	}
+
+	display_params_get(&display);
+
+	if (memcmp(&display, &published_display, sizeof(display)) == 0) {
+		return;
+	}
+
+	for (int i = 0; i < display_param_count; i++) {
+		int32_t value = display_param_value(&display, i);
+
+		if (value == display_param_value(&published_display, i)) {
+			continue;
+		}
+
+		for (int j = 0; j < CONTROL_SOCKET_MAX_CLIENTS; j++) {
+			if (clients[j].fd >= 0 && clients[j].subscribed) {
+				send_line(&clients[j], "changed %s=%i", display_param_fields[i].name, value);
+			}
+		}
+	}
+
+	published_display = display;
+}
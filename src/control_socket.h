@@ -0,0 +1,36 @@
+#ifndef _CONTROL_SOCKET_H_
+#define _CONTROL_SOCKET_H_
+
+#include "device.h"
+
+#ifndef CONTROL_SOCKET_PATH
+#define CONTROL_SOCKET_PATH "/run/camview.sock"
+#endif
+
+/*
+ * Local control API, one command per line:
+ *
+ *   get <name>            -> value <name>=<value>
+ *   set <name>=<value>    -> value <name>=<value>, or queued <name>=<value> when rate limited
+ *   subscribe             -> ok, then changed <name>=<value> whenever a value changes
+ *   stats                 -> stats submitted=<n> applied=<n> coalesced=<n>
+ *   preset save <slot> <name>       -> saved <slot> <name>
+ *   preset recall <slot|name>       -> recalled <slot> changed=<n> us=<latency>
+ *   preset list                     -> preset <slot> <name> per saved slot, then ok
+ *
+ * Names are V4L2 control names as listed in the control file ("Brightness") or display
+ * params as "<group>.<key>" ("fcc.hr_hue_min"). Failures answer error <reason>.
+ * The control file is still written for persistence.
+ */
+
+// Returns an fd readable when a client connected or sent a command, -1 on failure
+int control_socket_start(video_device_t *my_vd);
+void control_socket_stop();
+
+// Serves every pending connection and command. Returns 1 if a value was changed.
+int control_socket_poll(video_device_t *my_vd);
+
+// Notifies subscribers of every value changed since the last call, whatever changed it
+void control_socket_publish(video_device_t *my_vd);
+
+#endif
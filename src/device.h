@@ -4,8 +4,16 @@
 #include <sys/types.h>
 #include <inttypes.h>
 
+#include "control_catalog.h"
+
 typedef struct {
     int device_file;
+
+    // Driver reported camera model, selects the CEC mapping
+    char card[32];
+
+    // Built when the device is opened, cleared when it is closed
+    control_catalog_t controls;
 } video_device_t;
 
 #endif
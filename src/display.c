@@ -13,10 +13,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
 #include <pthread.h>
 #include <drm/sun4i_drm.h>
 
 #include "display.h"
+#include "chroma_grade.h"
+#include "frame_timing.h"
 
 #define PAGE_SIZE sysconf(_SC_PAGESIZE)
 
@@ -26,58 +31,172 @@
 #define U_VALUE 128
 #define V_VALUE 128
 
-typedef uint8_t buffer_t[3];
+#define MAX_PLANE_CANDIDATES 16
+
+// The shared framebuffer used when there are not enough planes for the layout
+#define WALL_SOURCE DISPLAY_MAX_SOURCES
+#define DISPLAY_SLOT_COUNT (DISPLAY_MAX_SOURCES + 1)
+
+#define PIP_SIZE_DIVISOR 4
+#define PIP_MARGIN 32
+
+// DE2 FCC: hue angles are 12 bit for a full turn, gains are 9 bit signed, 256 is 100%
+#define FCC_HUE_TURN 4096
+#define FCC_GAIN_MIN -256
+#define FCC_GAIN_MAX 255
+// Largest hue shift the gain can hold, about 22 degrees
+#define FCC_MAX_HUE (FCC_GAIN_MAX * 360 / FCC_HUE_TURN)
+#define FCC_RANGE_COUNT 6
+// Saturation gain of the magenta range at full tint
+#define FCC_TINT_SAT_GAIN 128
+
+typedef uint8_t buffer_t[DISPLAY_BUFFER_COUNT];
+
+struct display_buffer {
+	uint32_t fb_id;
+	int dma_fd;
+	void *map;
+	struct drm_sun4i_gem_create gem;
+
+	// Of the frame in the buffer, for the frame timing
+	uint64_t capture_ns;
+	uint64_t queued_ns;
+};
+
+struct display_rect {
+	int32_t x;
+	int32_t y;
+	uint32_t w;
+	uint32_t h;
+};
+
+struct display_source {
+	uint8_t initialized;
+
+	// Composition: the plane and area of the HDMI output this source is shown on
+	drmModePlane *plane;
+	struct display_rect dst;
+	uint32_t zpos;
+
+	// Composition fallback: the source is decoded downscaled into a tile of the wall buffer
+	uint8_t tiled;
+	uint32_t tile_luma_offset;
+	uint32_t tile_chroma_offset;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t chroma_pitch_divisor;
+	uint32_t chroma_height_divisor;
+
+	uint32_t src_width;
+	uint32_t src_height;
+
+	uint32_t pixel_format;
+	uint32_t buffer_size;
+	uint32_t data_offsets[2];
+
+	// Buffer numbers start at 1, 0 means no buffer.
+	struct display_buffer buffers[DISPLAY_BUFFER_COUNT + 1];
+
+	buffer_t current_display_buffer;
+	buffer_t current_available_buffer;
+	uint8_t on_screen_buffer;
+
+	// Bumped when the buffer set is swapped, buffer numbers taken before refer to the old set
+	uint32_t generation;
+
+	// Set replaced by reconfigure_display, kept until a frame of the new set is on screen
+	struct display_buffer retired_buffers[DISPLAY_BUFFER_COUNT + 1];
+	uint32_t retired_buffer_size;
+	uint8_t retired_pending;
+	uint64_t reconfigure_start_ns;
+	uint64_t reconfigure_built_ns;
+
+	pthread_cond_t available_buffer_cond;
+};
 
-static uint32_t src_width;
-static uint32_t src_height;
-
-static uint32_t data_offsets[2];
-
-static uint32_t buf_id;
 static int drm_fd;
-static int buf_fd;
-
-static uint32_t buf_id2;
-static int drm_fd2;
-static int buf_fd2;
-
-static uint32_t buf_id3;
-static int drm_fd3;
-static int buf_fd3;
 
-static void *buffer_map;
-static void *buffer_map2;
-static void *buffer_map3;
-
-static uint32_t buffer_size;
-
-static struct drm_sun4i_gem_create data;
-static struct drm_sun4i_gem_create data2;
-static struct drm_sun4i_gem_create data3;
+static struct display_source sources[DISPLAY_SLOT_COUNT];
+static int active_source = 0;
 
 static drmModePlane **new_planes;
 static int count_crtcs;
 static drmModeCrtc **crtcs;
 
-static uint32_t drm_mode_pixel_format;
+static drmModePlane *hdmi_planes[DISPLAY_MAX_SOURCES];
+static int hdmi_plane_count = 0;
+
+static int display_layout = DISPLAY_LAYOUT_SINGLE;
+static int layout_source_count = 1;
+static int tiled_composition = 0;
 
-static pthread_mutex_t current_values_lock;
-static pthread_cond_t available_buffer_cond;
-static pthread_cond_t display_buffer_cond;
+static uint8_t wall_back_buffer = 0;
+static uint32_t wall_members = 0;
+static uint32_t wall_contributions = 0;
 
-static buffer_t current_display_buffer;
-static buffer_t current_available_buffer;
+static uint32_t drm_mode_pixel_format;
+
+static pthread_mutex_t current_values_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t present_lock = PTHREAD_MUTEX_INITIALIZER;
+// Capture threads init and terminate their sources concurrently. Held over the plane setup,
+// the wall membership and the display thread start and stop, taken before the other locks.
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t display_buffer_cond = PTHREAD_COND_INITIALIZER;
 
 static uint8_t run_video_update;
 static pthread_t display_thread;
 
 static int display_initialized = 0;
+
+// Plane updates of a flip are committed together, unless the driver has no atomic support
+static int atomic_updates = 0;
+
+#define PLANE_PROP_COUNT 10
+#define MAX_ATOMIC_PLANES 8
+
+static const char *plane_prop_names[PLANE_PROP_COUNT] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H"
+};
+
+struct atomic_plane {
+	uint32_t plane_id;
+	uint8_t valid;
+	uint32_t prop_ids[PLANE_PROP_COUNT];
+};
+
+static struct atomic_plane atomic_planes[MAX_ATOMIC_PLANES];
+static int atomic_plane_count = 0;
+// Set with current_values_lock held when the params below changed since they were programmed
 static int pending_controls_apply = 0;
+// Held over a whole apply, so programs land in the order the params were taken
+static pthread_mutex_t apply_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Guarded by current_values_lock
 struct drm_sun4i_fcc_params fcc;
 struct drm_sun8i_bws_params bws;
 struct drm_sun8i_lti_params lti;
 
+// CEC hue and tint, added to the gains of fcc when the FCC is programmed. Guarded by
+// current_values_lock.
+static int32_t fcc_grade_hue_gain = 0;
+static int32_t fcc_grade_sat_gains[FCC_RANGE_COUNT];
+static int fcc_grade_active = 0;
+static int fcc_supported = 1;
+// Requested grade, handed to the software grade when the FCC can't do it
+static int grade_hue = 0;
+static int grade_tint = 0;
+
+static void apply_pending_controls();
+static void free_buffer_set(struct display_buffer *buffers, uint32_t buffer_size);
+static int find_plane_property(uint32_t plane_id, const char *name, const char *enum_match, uint32_t *prop_id, __u64 *value);
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void forward(buffer_t arr) {
 	arr[0] = arr[1];
 	arr[1] = arr[2];
@@ -94,93 +213,349 @@ void put(buffer_t arr, uint8_t data) {
 	}
 }
 
-void* display_thread_loop(void *data) {
+static int valid_source(int source) {
+	if (source < 0 || source >= DISPLAY_MAX_SOURCES) {
+		printf("Invalid display source %i\n", source);
+		fflush(stdout);
+		return 0;
+	}
+
+	return 1;
+}
+
+static struct display_source* source_buffers(int source) {
+	if (sources[source].tiled) {
+		return &sources[WALL_SOURCE];
+	}
+
+	return &sources[source];
+}
+
+static int source_visible(int index) {
+	if (tiled_composition) {
+		return index == WALL_SOURCE;
+	}
+
+	if (display_layout == DISPLAY_LAYOUT_SINGLE) {
+		return index == active_source;
+	}
+
+	return sources[index].plane != NULL;
+}
+
+// Looks up the property ids of a plane once, NULL when it can't be part of an atomic commit
+static struct atomic_plane* atomic_plane_props(uint32_t plane_id) {
+	struct atomic_plane *plane;
+	__u64 value;
+
+	for (int i = 0; i < atomic_plane_count; i++) {
+		if (atomic_planes[i].plane_id == plane_id) {
+			return atomic_planes[i].valid ? &atomic_planes[i] : NULL;
+		}
+	}
+
+	if (atomic_plane_count == MAX_ATOMIC_PLANES) {
+		return NULL;
+	}
+
+	plane = &atomic_planes[atomic_plane_count++];
+	plane->plane_id = plane_id;
+	plane->valid = 1;
+
+	for (int i = 0; i < PLANE_PROP_COUNT; i++) {
+		if (!find_plane_property(plane_id, plane_prop_names[i], NULL, &plane->prop_ids[i], &value)) {
+			printf("Plane %i has no %s property, it is updated on its own\n", plane_id, plane_prop_names[i]);
+			fflush(stdout);
+			plane->valid = 0;
+			return NULL;
+		}
+	}
+
+	return plane;
+}
+
+// Adds the plane to the atomic request, or updates it right away when there is none
+static int update_plane(drmModeAtomicReqPtr req, uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, int32_t x, int32_t y, uint32_t w, uint32_t h, uint32_t src_w, uint32_t src_h) {
+	struct atomic_plane *plane = req ? atomic_plane_props(plane_id) : NULL;
+
+	if (plane == NULL) {
+		return drmModeSetPlane(drm_fd, plane_id, crtc_id, fb_id, 0, x, y, w, h, 0, 0, src_w, src_h);
+	}
+
+	uint64_t values[PLANE_PROP_COUNT] = { fb_id, crtc_id, 0, 0, src_w, src_h, (uint64_t)(int64_t)x, (uint64_t)(int64_t)y, w, h };
+
+	for (int i = 0; i < PLANE_PROP_COUNT; i++) {
+		if (drmModeAtomicAddProperty(req, plane_id, plane->prop_ids[i], values[i]) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void present_source(drmModeAtomicReqPtr req, int index, struct display_source *src, uint8_t display_buffer) {
+	int result;
+	uint32_t fb_id = src->buffers[display_buffer].fb_id;
+	int composed = display_layout != DISPLAY_LAYOUT_SINGLE && !tiled_composition;
+
+	if (composed && src->plane) {
+		result = update_plane(req, src->plane->plane_id, crtcs[0]->crtc_id, fb_id, crtcs[0]->x + src->dst.x, crtcs[0]->y + src->dst.y, src->dst.w, src->dst.h, src->src_width, src->src_height);
+
+		if (result) {
+			printf("Setting HDMI plane %i for source %i failed %i\n", src->plane->plane_id, index, result);
+			fflush(stdout);
+			exit(1);
+		}
+	} else if (crtcs[0] && new_planes[0]) {
+		result = update_plane(req, new_planes[0]->plane_id, crtcs[0]->crtc_id, fb_id, crtcs[0]->x, crtcs[0]->y, crtcs[0]->width, crtcs[0]->height, src->src_width, src->src_height);
+
+		if (result) {
+			printf("Setting HDMI plane failed %i\n", result);
+			fflush(stdout);
+			exit(1);
+		}
+	}
+
+	// The composite output has a single plane, it mirrors the active source only.
+	if (composed && index != active_source) {
+		return;
+	}
+
+	if (count_crtcs > 1 && crtcs[1] && new_planes[1]) {
+		result = update_plane(req, new_planes[1]->plane_id, crtcs[1]->crtc_id, fb_id, crtcs[1]->x, crtcs[1]->y, crtcs[1]->width, crtcs[1]->height, src->src_width, src->src_height);
+
+		if (result) {
+			printf("Setting composite plane failed %i\n", result);
+			fflush(stdout);
+			exit(1);
+		}
+	}
+}
+
+// Every plane of the flip goes in one blocking commit, so a flip waits for a single vblank
+// however many sources are on screen. Returns 0 when it was committed.
+static int commit_planes(drmModeAtomicReqPtr req) {
 	int result;
-	uint8_t display_buffer = 0;
-	uint8_t prev_display_buffer = 0;
-	uint8_t should_draw = 0;
 
-	int buf_ids[4] = { 0, buf_id, buf_id2, buf_id3 };
+	if (drmModeAtomicGetCursor(req) == 0) {
+		return 0;
+	}
+
+	result = drmModeAtomicCommit(drm_fd, req, 0, NULL);
+
+	if (result) {
+		printf("Atomic commit failed %i, updating the planes one by one\n", result);
+		fflush(stdout);
+		atomic_updates = 0;
+	}
+
+	return result;
+}
+
+// Called with present_lock held once a frame of the new set replaced the old one on screen.
+// The planes were committed by then, so the old framebuffers are no longer scanned out.
+static void retire_buffers(int index, struct display_source *src) {
+	uint64_t now = now_ns();
+
+	free_buffer_set(src->retired_buffers, src->retired_buffer_size);
+	src->retired_pending = 0;
+
+	printf("Source %i reconfigured to %ux%u in %llu ms, buffers built in %llu ms\n",
+		index,
+		src->width,
+		src->height,
+		(unsigned long long) (now - src->reconfigure_start_ns) / 1000000,
+		(unsigned long long) (src->reconfigure_built_ns - src->reconfigure_start_ns) / 1000000
+	);
+	fflush(stdout);
+}
+
+void* display_thread_loop(void *data) {
+	uint8_t pending[DISPLAY_SLOT_COUNT];
+	uint32_t pending_generation[DISPLAY_SLOT_COUNT];
+	uint8_t prev_display_buffer[DISPLAY_SLOT_COUNT];
+	uint8_t presented[DISPLAY_SLOT_COUNT];
+	uint8_t should_draw;
+	uint64_t presented_at;
+	drmModeAtomicReqPtr req;
+	struct display_source *src;
+	int i;
 
 	while (run_video_update) {
 		pthread_mutex_lock(&current_values_lock);
 
-		if (!current_display_buffer[0]) {
+		should_draw = 0;
+
+		for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+			if (sources[i].initialized && sources[i].current_display_buffer[0]) {
+				should_draw = 1;
+			}
+		}
+
+		if (!should_draw) {
 			pthread_cond_wait(&display_buffer_cond, &current_values_lock);
 		}
 
-		if (current_display_buffer[0]) {
-			should_draw = 1;
-			prev_display_buffer = display_buffer;
-			display_buffer = current_display_buffer[0];
-			forward(current_display_buffer);
+		for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+			src = &sources[i];
+			pending[i] = 0;
 
-		} else {
-			should_draw = 0;
+			if (src->initialized && src->current_display_buffer[0]) {
+				pending[i] = src->current_display_buffer[0];
+				pending_generation[i] = src->generation;
+				forward(src->current_display_buffer);
+			}
 		}
 
 		pthread_mutex_unlock(&current_values_lock);
 
-		if (should_draw) {
-			if (crtcs[0] && new_planes[0]) {
-				result = drmModeSetPlane(drm_fd, new_planes[0]->plane_id, crtcs[0]->crtc_id, buf_ids[display_buffer], 0, crtcs[0]->x, crtcs[0]->y, crtcs[0]->width, crtcs[0]->height, 0, 0, src_width, src_height);
+		pthread_mutex_lock(&present_lock);
 
-				if (result) {
-					printf("Setting HDMI plane failed %i\n", result);
-					fflush(stdout);
-					exit(1);
-				}
+		req = atomic_updates ? drmModeAtomicAlloc() : NULL;
+
+		for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+			src = &sources[i];
+			prev_display_buffer[i] = 0;
+			presented[i] = 0;
+
+			if (!pending[i]) {
+				continue;
+			}
+
+			// The buffer set was swapped since, the number belongs to the old one
+			if (pending_generation[i] != src->generation) {
+				pending[i] = 0;
+				continue;
 			}
 
-			if (crtcs[1] && new_planes[1]) {
-				result = drmModeSetPlane(drm_fd, new_planes[1]->plane_id, crtcs[1]->crtc_id, buf_ids[display_buffer], 0, crtcs[1]->x, crtcs[1]->y, crtcs[1]->width, crtcs[1]->height, 0, 0, src_width, src_height);
+			// Frames from sources not on screen are recycled right away,
+			// the decoder keeps running so switching source is immediate.
+			if (source_visible(i) && src->initialized) {
+				present_source(req, i, src, pending[i]);
+				presented[i] = 1;
+				display_initialized = 1;
+			}
+		}
 
-				if (result) {
-					printf("Setting composite plane failed %i\n", result);
-					fflush(stdout);
-					exit(1);
+		if (req) {
+			if (commit_planes(req) != 0) {
+				for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+					if (presented[i]) {
+						present_source(NULL, i, &sources[i], pending[i]);
+					}
 				}
 			}
 
-			display_initialized = 1;
+			drmModeAtomicFree(req);
+		}
+
+		// The commit or the last plane update returns after the vblank it was latched on
+		presented_at = now_ns();
+
+		for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+			src = &sources[i];
+
+			if (!pending[i]) {
+				continue;
+			}
+
+			if (presented[i] && i != WALL_SOURCE) {
+				frame_timing_presented(i, src->buffers[pending[i]].capture_ns, src->buffers[pending[i]].queued_ns, presented_at);
+			}
+
+			prev_display_buffer[i] = src->on_screen_buffer;
+			src->on_screen_buffer = pending[i];
+
+			if (src->retired_pending) {
+				retire_buffers(i, src);
+			}
+		}
+
+		pthread_mutex_unlock(&present_lock);
+
+		if (display_initialized) {
+			apply_pending_controls();
+		}
+
+		pthread_mutex_lock(&current_values_lock);
 
-			if (pending_controls_apply) {
-				drmIoctl(drm_fd, DRM_IOCTL_SUN4I_SET_FCC_PARAMS, &fcc);
-				drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_BWS_PARAMS, &bws);
-				drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_LTI_PARAMS, &lti);
-				pending_controls_apply = 0;
+		for (i = 0; i < DISPLAY_SLOT_COUNT; i++) {
+			if (prev_display_buffer[i] && pending_generation[i] == sources[i].generation) {
+				put(sources[i].current_available_buffer, prev_display_buffer[i]);
+				pthread_cond_broadcast(&sources[i].available_buffer_cond);
 			}
 		}
 
-		if (prev_display_buffer) {
-			pthread_mutex_lock(&current_values_lock);
+		pthread_mutex_unlock(&current_values_lock);
+	}
+
+	return NULL;
+}
+
+// Must be called with current_values_lock held
+static void flip_wall_if_complete() {
+	struct display_source *wall = &sources[WALL_SOURCE];
+
+	if (!wall_back_buffer || (wall_contributions & wall_members) != wall_members) {
+		return;
+	}
+
+	put(wall->current_display_buffer, wall_back_buffer);
+	wall_back_buffer = 0;
+	wall_contributions = 0;
+
+	pthread_cond_broadcast(&wall->available_buffer_cond);
+	pthread_cond_signal(&display_buffer_cond);
+}
 
-			put(current_available_buffer, prev_display_buffer);
+// Tiled sources all write into the same back buffer. It is only flipped once every source
+// has written its tile, so the buffers never carry stale tiles around.
+static uint8_t get_wall_buffer_number(int source) {
+	struct display_source *wall = &sources[WALL_SOURCE];
 
-			pthread_cond_signal(&available_buffer_cond);
+	while (wall->initialized && (wall_contributions & (1 << source))) {
+		pthread_cond_wait(&wall->available_buffer_cond, &current_values_lock);
+	}
 
-			pthread_mutex_unlock(&current_values_lock);
+	if (!wall->initialized) {
+		return 0;
+	}
 
-			prev_display_buffer = 0;
+	if (!wall_back_buffer) {
+		if (!wall->current_available_buffer[0] && wall->current_display_buffer[0]) {
+			pthread_cond_wait(&wall->available_buffer_cond, &current_values_lock);
 		}
 
+		wall_back_buffer = wall->current_available_buffer[0];
+		forward(wall->current_available_buffer);
 	}
+
+	return wall_back_buffer;
 }
 
-int get_buffer_number() {
+int get_buffer_number(int source) {
 	uint8_t write_buffer = 0;
+	struct display_source *src;
+
+	if (!valid_source(source)) {
+		return 0;
+	}
+
+	src = &sources[source];
 
 	pthread_mutex_lock(&current_values_lock);
 
-	if (current_available_buffer[0]) {
-		write_buffer = current_available_buffer[0];
-		forward(current_available_buffer);
-	} else if (current_display_buffer[0]) {
+	if (src->tiled) {
+		write_buffer = get_wall_buffer_number(source);
+	} else if (src->current_available_buffer[0]) {
+		write_buffer = src->current_available_buffer[0];
+		forward(src->current_available_buffer);
+	} else if (src->current_display_buffer[0]) {
 		printf("Waiting next frame. Is draw thread too slow?\n");
-		pthread_cond_wait(&available_buffer_cond, &current_values_lock);
+		pthread_cond_wait(&src->available_buffer_cond, &current_values_lock);
 
-		write_buffer = current_available_buffer[0];
-		forward(current_available_buffer);
+		write_buffer = src->current_available_buffer[0];
+		forward(src->current_available_buffer);
 	} else {
 		printf("Failed to dequeue available buffer\n");
 		write_buffer = 0;
@@ -192,16 +567,76 @@ int get_buffer_number() {
 
 }
 
-void put_buffer(uint8_t buffer_number) {
+void put_buffer(int source, uint8_t buffer_number, uint64_t capture_ns) {
+	if (!valid_source(source)) {
+		return;
+	}
+
 	pthread_mutex_lock(&current_values_lock);
 
-	put(current_display_buffer, buffer_number);
+	if (sources[source].tiled) {
+		wall_contributions |= (1 << source);
+		flip_wall_if_complete();
+	} else {
+		sources[source].buffers[buffer_number].capture_ns = capture_ns;
+		sources[source].buffers[buffer_number].queued_ns = now_ns();
+		put(sources[source].current_display_buffer, buffer_number);
+		pthread_cond_signal(&display_buffer_cond);
+	}
 
-	pthread_cond_signal(&display_buffer_cond);
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+void set_source_streaming(int source, int streaming) {
+	struct display_source *src;
+
+	if (!valid_source(source)) {
+		return;
+	}
+
+	src = &sources[source];
+
+	pthread_mutex_lock(&current_values_lock);
+
+	// A stopped source would hold the wall back forever, its last tile stays in the buffers
+	if (src->initialized && src->tiled) {
+		if (streaming) {
+			wall_members |= (1 << source);
+		} else {
+			wall_members &= ~(1 << source);
+			wall_contributions &= ~(1 << source);
+			flip_wall_if_complete();
+		}
+	}
 
 	pthread_mutex_unlock(&current_values_lock);
 }
 
+void set_active_source(int source) {
+	if (!valid_source(source)) {
+		return;
+	}
+
+	pthread_mutex_lock(&present_lock);
+	active_source = source;
+	pthread_mutex_unlock(&present_lock);
+
+	printf("Display active source set to %i\n", source);
+	fflush(stdout);
+}
+
+int get_active_source() {
+	return active_source;
+}
+
+int get_display_refresh_rate() {
+	if (crtcs == NULL || count_crtcs <= 0 || crtcs[0] == NULL || !crtcs[0]->mode_valid) {
+		return 0;
+	}
+
+	return crtcs[0]->mode.vrefresh;
+}
+
 void start_drm() {
 	int err = 0;
 	int i = 0;
@@ -238,6 +673,8 @@ void start_drm() {
 	}
 
 	drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	atomic_updates = drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+	printf("Atomic plane updates %s\n", atomic_updates ? "enabled" : "not supported");
 
 	drmModeRes *resources = drmModeGetResources(drm_fd);
 
@@ -377,7 +814,9 @@ void start_drm() {
 }
 
 void find_new_plane() {
-	int i, j, crtc_idx, has_format;
+	int i, j, k, has_format;
+	int candidate_count = 0;
+	drmModePlane *candidates[MAX_PLANE_CANDIDATES];
 
         drmModePlaneRes *plane_res = NULL;
 	drmModePlane *plane = NULL;
@@ -389,7 +828,6 @@ void find_new_plane() {
 
 	for (i = 0; i < plane_res->count_planes; i++) {
 		has_format = 0;
-		crtc_idx = -1;
 
 		plane = drmModeGetPlane(drm_fd, plane_res->planes[i]);
 
@@ -413,6 +851,11 @@ void find_new_plane() {
 					}
 				}
 
+				if ((plane->possible_crtcs & 1) && candidate_count < MAX_PLANE_CANDIDATES) {
+					candidates[candidate_count] = plane;
+					candidate_count++;
+				}
+
 				continue;
 			}
 
@@ -438,18 +881,39 @@ void find_new_plane() {
 		fflush(stdout);
 		exit(1);
 	}
-}
 
-void setPlanesColorFormat() {
-	int err = 0;
-	int i, j, k;
-	__u32 prop_ids[2][2] = { { 0, 0 }, { 0, 0 } };
-	__u64 prop_values[2][2] = { { 0, 0 }, { 0, 0 } };
+	// Every HDMI capable plane not used by other CRTCs can carry a source of the monitor wall.
+	// The main plane goes first, so it is always the one at the bottom.
+	hdmi_plane_count = 0;
 
-	printf("\n\nLooking for color mode and range props\n");
+	if (new_planes[0]) {
+		hdmi_planes[hdmi_plane_count++] = new_planes[0];
+	}
+
+	for (i = 0; i < candidate_count && hdmi_plane_count < DISPLAY_MAX_SOURCES; i++) {
+		int used = 0;
+
+		for (k = 0; k < count_crtcs; k++) {
+			if (new_planes[k] == candidates[i]) {
+				used = 1;
+			}
+		}
+
+		if (!used) {
+			hdmi_planes[hdmi_plane_count++] = candidates[i];
+		}
+	}
+
+	printf("Found %i planes for HDMI composition\n", hdmi_plane_count);
 	fflush(stdout);
+}
 
-	// Get Color Mode and Color Range prop ids
+// Looks up a plane property by name. When enum_match is given, value receives
+// the value of the first enum entry whose name contains it.
+static int find_plane_property(uint32_t plane_id, const char *name, const char *enum_match, uint32_t *prop_id, __u64 *value) {
+	int err = 0;
+	int found = 0;
+	int j, k;
 
 	struct drm_mode_obj_get_properties obj_get_props_data;
 
@@ -462,203 +926,392 @@ void setPlanesColorFormat() {
 	struct drm_mode_property_enum *enum_blob_ptr = (struct drm_mode_property_enum*)
 		calloc(10, sizeof(struct drm_mode_property_enum));
 
-	// Should we support more than 2 crtcs?
-	for (i = 0; i < 2; i++) {
-		if (new_planes[i]) {
-			printf("Getting properties of plane %i\n", new_planes[i]->plane_id);
-
-			obj_get_props_data.obj_id = new_planes[i]->plane_id;
-			obj_get_props_data.obj_type = DRM_MODE_OBJECT_PLANE;
-			obj_get_props_data.count_props = 500;
-			obj_get_props_data.props_ptr = (__u64) ((__u32)props_ptr);
-			obj_get_props_data.prop_values_ptr = (__u64) ((__u32)prop_values_ptr);
-
-			err = drmIoctl(drm_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &obj_get_props_data);
+	obj_get_props_data.obj_id = plane_id;
+	obj_get_props_data.obj_type = DRM_MODE_OBJECT_PLANE;
+	obj_get_props_data.count_props = 500;
+	obj_get_props_data.props_ptr = (__u64) ((__u32)props_ptr);
+	obj_get_props_data.prop_values_ptr = (__u64) ((__u32)prop_values_ptr);
 
-			if (err) {
-				printf("Error getting properties of plane %i. Err: %i\n", new_planes[i]->plane_id, err);
-				continue;
-			}
-
-			for (j = 0; j < obj_get_props_data.count_props; j++) {
-				if (props_ptr[j]) {
-					property.enum_blob_ptr = (__u64) ((__u32)enum_blob_ptr);
-					property.count_enum_blobs = 10;
-					property.count_values = 0;
-					property.flags = 0;
-					property.prop_id = props_ptr[j];
+	err = drmIoctl(drm_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &obj_get_props_data);
 
-					memset(&property.name, 0, sizeof(property.name));
+	if (err) {
+		printf("Error getting properties of plane %i. Err: %i\n", plane_id, err);
+		goto out;
+	}
 
-					err = drmIoctl(drm_fd, DRM_IOCTL_MODE_GETPROPERTY, &property);
+	for (j = 0; j < obj_get_props_data.count_props && !found; j++) {
+		if (!props_ptr[j]) {
+			continue;
+		}
 
-					if (err) {
-						printf("Error getting property %u. Err: %i\n", props_ptr[j], err);
-						continue;
-					}
+		property.enum_blob_ptr = (__u64) ((__u32)enum_blob_ptr);
+		property.count_enum_blobs = 10;
+		property.count_values = 0;
+		property.flags = 0;
+		property.prop_id = props_ptr[j];
 
-					printf("Found property %u: %s\n", props_ptr[j], property.name);
+		memset(&property.name, 0, sizeof(property.name));
 
-					if (strcmp(property.name, "COLOR_ENCODING") == 0) {
-						printf("Found plane %i COLOR_ENCODING prop. id: %u\n", new_planes[i]->plane_id, property.prop_id);
+		err = drmIoctl(drm_fd, DRM_IOCTL_MODE_GETPROPERTY, &property);
 
-						for (k = 0; k < 5; k++) {
-							prop_enum = &enum_blob_ptr[k];
+		if (err) {
+			printf("Error getting property %u. Err: %i\n", props_ptr[j], err);
+			continue;
+		}
 
-							if (prop_enum && strstr(prop_enum->name, "601")) {
-								printf("Prop enum name %s value %llu\n", prop_enum->name, prop_enum->value);
-								prop_ids[i][0] = property.prop_id;
-								prop_values[i][0] = prop_enum->value;
-								break;
-							}
-						}
-					}
+		if (strcmp(property.name, name) != 0) {
+			continue;
+		}
 
-					if (strcmp(property.name, "COLOR_RANGE") == 0) {
-						printf("Found plane %i COLOR_RANGE prop. id: %u\n", new_planes[i]->plane_id, property.prop_id);
+		printf("Found plane %i %s prop. id: %u\n", plane_id, name, property.prop_id);
 
-						for (k = 0; k < 5; k++) {
-							prop_enum = &enum_blob_ptr[k];
+		if (enum_match == NULL) {
+			*prop_id = property.prop_id;
+			found = 1;
+			break;
+		}
 
-							if (prop_enum && strstr(prop_enum->name, "full")) {
-								printf("Prop enum name %s value %llu\n", prop_enum->name, prop_enum->value);
-								prop_ids[i][1] = property.prop_id;
-								prop_values[i][1] = prop_enum->value;
-								break;
-							}
-						}
-					}
+		for (k = 0; k < 5; k++) {
+			prop_enum = &enum_blob_ptr[k];
 
-					if (prop_ids[i][0] && prop_ids[i][1]) {
-						break;
-					}
-				}
+			if (prop_enum && strstr(prop_enum->name, enum_match)) {
+				printf("Prop enum name %s value %llu\n", prop_enum->name, prop_enum->value);
+				*prop_id = property.prop_id;
+				*value = prop_enum->value;
+				found = 1;
+				break;
 			}
 		}
 	}
 
-	fflush(stdout);
-
+out:
 	free(props_ptr);
 	free(prop_values_ptr);
 	free(enum_blob_ptr);
 
+	return found;
+}
+
+static void set_plane_property(uint32_t plane_id, uint32_t prop_id, __u64 value) {
+	int err;
 	struct drm_mode_obj_set_property set_prop;
 
-	for (i = 0; i < 2; i++) {
-		for (j = 0; j < 2; j++) {
-			if (prop_ids[i][j]) {
-				set_prop.obj_id = new_planes[i]->plane_id;
-				set_prop.obj_type = DRM_MODE_OBJECT_PLANE;
-				set_prop.prop_id = prop_ids[i][j];
-				set_prop.value = prop_values[i][j];
+	set_prop.obj_id = plane_id;
+	set_prop.obj_type = DRM_MODE_OBJECT_PLANE;
+	set_prop.prop_id = prop_id;
+	set_prop.value = value;
 
-				err = drmIoctl(drm_fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &set_prop);
+	err = drmIoctl(drm_fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &set_prop);
 
-				if (err) {
-					printf("Failed setting prop %u. Err: %i\n", prop_ids[i][j], err);
-				} else {
-					printf("Prop %u set to value %llu\n", prop_ids[i][j], prop_values[i][j]);
-				}
-			}
+	if (err) {
+		printf("Failed setting prop %u. Err: %i\n", prop_id, err);
+	} else {
+		printf("Prop %u set to value %llu\n", prop_id, value);
+	}
+}
+
+static void set_plane_color_format(uint32_t plane_id) {
+	uint32_t prop_id;
+	__u64 value;
+
+	printf("Getting properties of plane %i\n", plane_id);
+
+	if (find_plane_property(plane_id, "COLOR_ENCODING", "601", &prop_id, &value)) {
+		set_plane_property(plane_id, prop_id, value);
+	}
+
+	if (find_plane_property(plane_id, "COLOR_RANGE", "full", &prop_id, &value)) {
+		set_plane_property(plane_id, prop_id, value);
+	}
+}
+
+void setPlanesColorFormat() {
+	int i;
+
+	printf("\n\nLooking for color mode and range props\n");
+	fflush(stdout);
+
+	// Should we support more than 2 crtcs?
+	for (i = 0; i < 2 && i < count_crtcs; i++) {
+		if (new_planes[i]) {
+			set_plane_color_format(new_planes[i]->plane_id);
 		}
 	}
 
+	// Index 0 is new_planes[0], already done above
+	for (i = 1; i < hdmi_plane_count; i++) {
+		set_plane_color_format(hdmi_planes[i]->plane_id);
+	}
+
 	printf("Done color mode settings\n\n");
 	fflush(stdout);
 }
 
-void get_drm_fcc(struct drm_sun4i_fcc_params *fcc_out) {
-	memcpy(fcc_out, &fcc, sizeof(fcc));
+struct fcc_range {
+	size_t hue_min;
+	size_t hue_max;
+	size_t hue_gain;
+	size_t sat_gain;
+	// Centre of the range in degrees
+	int center;
+};
+
+#define FCC_RANGE(name, center) { \
+	offsetof(struct drm_sun4i_fcc_params, name##_hue_min), \
+	offsetof(struct drm_sun4i_fcc_params, name##_hue_max), \
+	offsetof(struct drm_sun4i_fcc_params, name##_hue_gain), \
+	offsetof(struct drm_sun4i_fcc_params, name##_sat_gain), \
+	center \
 }
 
-void get_drm_bws(struct drm_sun8i_bws_params *bws_out) {
-	memcpy(bws_out, &bws, sizeof(bws));
-}
+static const struct fcc_range fcc_ranges[FCC_RANGE_COUNT] = {
+	FCC_RANGE(hr, 0),
+	FCC_RANGE(hg, 120),
+	FCC_RANGE(hb, 240),
+	FCC_RANGE(hc, 180),
+	FCC_RANGE(hm, 300),
+	FCC_RANGE(hy, 60),
+};
 
-void get_drm_lti(struct drm_sun8i_lti_params *lti_out) {
-	memcpy(lti_out, &lti, sizeof(lti));
-}
+#define FCC_FIELD_AT(params, offset) ((int32_t*)((uint8_t*)(params) + (offset)))
 
-int set_drm_fcc(struct drm_sun4i_fcc_params *fcc_in) {
-	if (memcmp(fcc_in, &fcc, sizeof(fcc)) == 0) {
-		return 0;
-	}
+// Hue and tint are turned into gains once, grading is then a table lookup and a flip
+static int16_t hue_gain_table[2 * DISPLAY_MAX_HUE + 1];
+static int16_t tint_sat_gain_table[2 * DISPLAY_MAX_TINT + 1][FCC_RANGE_COUNT];
+static pthread_once_t grade_tables_once = PTHREAD_ONCE_INIT;
 
-	memcpy(&fcc, fcc_in, sizeof(fcc));
+static int32_t clamp_gain(int32_t gain) {
+	return gain < FCC_GAIN_MIN ? FCC_GAIN_MIN : gain > FCC_GAIN_MAX ? FCC_GAIN_MAX : gain;
+}
 
-	if (display_initialized) {
-		drmIoctl(drm_fd, DRM_IOCTL_SUN4I_SET_FCC_PARAMS, &fcc);
-	} else {
-		pending_controls_apply = 1;
+static void build_grade_tables() {
+	for (int hue = -DISPLAY_MAX_HUE; hue <= DISPLAY_MAX_HUE; hue++) {
+		// Past FCC_MAX_HUE the gain saturates, those hues are graded in software
+		hue_gain_table[hue + DISPLAY_MAX_HUE] = clamp_gain(lround(hue * FCC_HUE_TURN / 360.0));
 	}
 
-	return 1;
+	// Tint leans the ranges toward magenta (300 degrees) or green, by how close they are
+	for (int tint = -DISPLAY_MAX_TINT; tint <= DISPLAY_MAX_TINT; tint++) {
+		for (int i = 0; i < FCC_RANGE_COUNT; i++) {
+			double weight = cos((fcc_ranges[i].center - 300) * M_PI / 180.0);
+			tint_sat_gain_table[tint + DISPLAY_MAX_TINT][i] = clamp_gain(lround(weight * tint * FCC_TINT_SAT_GAIN / DISPLAY_MAX_TINT));
+		}
+	}
 }
 
-int set_drm_bws(struct drm_sun8i_bws_params *bws_in) {
-	if (memcmp(bws_in, &bws, sizeof(bws)) == 0) {
-		return 0;
-	}
+// fcc with the CEC grade on top, called with current_values_lock held
+static void effective_fcc(struct drm_sun4i_fcc_params *effective) {
+	int ranges_set = 0;
+	int i;
 
-	memcpy(&bws, bws_in, sizeof(bws));
+	memcpy(effective, &fcc, sizeof(*effective));
 
-	if (display_initialized) {
-		drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_BWS_PARAMS, &bws);
+	if (!fcc_grade_active) {
+		return;
+	}
+
+	effective->enable = 1;
+
+	for (i = 0; i < FCC_RANGE_COUNT; i++) {
+		ranges_set |= *FCC_FIELD_AT(effective, fcc_ranges[i].hue_min) | *FCC_FIELD_AT(effective, fcc_ranges[i].hue_max);
+	}
+
+	for (i = 0; i < FCC_RANGE_COUNT; i++) {
+		const struct fcc_range *range = &fcc_ranges[i];
+
+		// Without ranges from the control file, 60 degrees around each centre, red wraps
+		if (!ranges_set) {
+			*FCC_FIELD_AT(effective, range->hue_min) = ((range->center + 330) % 360) * FCC_HUE_TURN / 360;
+			*FCC_FIELD_AT(effective, range->hue_max) = ((range->center + 30) % 360) * FCC_HUE_TURN / 360;
+		}
+
+		int32_t *hue_gain = FCC_FIELD_AT(effective, range->hue_gain);
+		int32_t *sat_gain = FCC_FIELD_AT(effective, range->sat_gain);
+
+		*hue_gain = clamp_gain(*hue_gain + fcc_grade_hue_gain);
+		*sat_gain = clamp_gain(*sat_gain + fcc_grade_sat_gains[i]);
+	}
+}
+
+// Programs the params changed since the last apply. They are copied and the flag cleared
+// under the lock, a change made during the ioctls sets it again for the next apply.
+static void apply_pending_controls() {
+	struct drm_sun4i_fcc_params fcc_now;
+	struct drm_sun8i_bws_params bws_now;
+	struct drm_sun8i_lti_params lti_now;
+
+	pthread_mutex_lock(&apply_lock);
+	pthread_mutex_lock(&current_values_lock);
+
+	if (!pending_controls_apply) {
+		pthread_mutex_unlock(&current_values_lock);
+		pthread_mutex_unlock(&apply_lock);
+		return;
+	}
+
+	pending_controls_apply = 0;
+	effective_fcc(&fcc_now);
+	memcpy(&bws_now, &bws, sizeof(bws_now));
+	memcpy(&lti_now, &lti, sizeof(lti_now));
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	if (drmIoctl(drm_fd, DRM_IOCTL_SUN4I_SET_FCC_PARAMS, &fcc_now) != 0 && fcc_supported) {
+		printf("Setting FCC params failed, hue and tint fall back to software\n");
+		fflush(stdout);
+
+		// The grade given to the FCC is handed over, not left until the next change
+		pthread_mutex_lock(&current_values_lock);
+		fcc_supported = 0;
+		fcc_grade_active = 0;
+		chroma_grade_set_all(grade_hue, grade_tint);
+		pthread_mutex_unlock(&current_values_lock);
+	}
+
+	drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_BWS_PARAMS, &bws_now);
+	drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_LTI_PARAMS, &lti_now);
+
+	pthread_mutex_unlock(&apply_lock);
+}
+
+int set_drm_hue_tint(int hue, int tint) {
+	int use_fcc;
+
+	pthread_once(&grade_tables_once, build_grade_tables);
+
+	hue = hue < -DISPLAY_MAX_HUE ? -DISPLAY_MAX_HUE : hue > DISPLAY_MAX_HUE ? DISPLAY_MAX_HUE : hue;
+	tint = tint < -DISPLAY_MAX_TINT ? -DISPLAY_MAX_TINT : tint > DISPLAY_MAX_TINT ? DISPLAY_MAX_TINT : tint;
+
+	// Under the lock, so it can't cross the fallback of a failed FCC apply
+	pthread_mutex_lock(&current_values_lock);
+
+	grade_hue = hue;
+	grade_tint = tint;
+	use_fcc = fcc_supported && hue >= -FCC_MAX_HUE && hue <= FCC_MAX_HUE;
+
+	if (use_fcc) {
+		fcc_grade_hue_gain = hue_gain_table[hue + DISPLAY_MAX_HUE];
+		memcpy(fcc_grade_sat_gains, tint_sat_gain_table[tint + DISPLAY_MAX_TINT], sizeof(fcc_grade_sat_gains));
+		fcc_grade_active = hue != 0 || tint != 0;
+		chroma_grade_set_all(0, 0);
 	} else {
-		pending_controls_apply = 1;
+		fcc_grade_active = 0;
+		chroma_grade_set_all(hue, tint);
 	}
 
-	return 1;
+	// The display thread programs it after the next flip, so it lands with a frame
+	pending_controls_apply = 1;
+
+	pthread_mutex_unlock(&current_values_lock);
+
+	return use_fcc;
 }
 
-int set_drm_lti(struct drm_sun8i_lti_params *lti_in) {
-	if (memcmp(lti_in, &lti, sizeof(lti)) == 0) {
+void get_drm_fcc(struct drm_sun4i_fcc_params *fcc_out) {
+	pthread_mutex_lock(&current_values_lock);
+	memcpy(fcc_out, &fcc, sizeof(fcc));
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+void get_drm_bws(struct drm_sun8i_bws_params *bws_out) {
+	pthread_mutex_lock(&current_values_lock);
+	memcpy(bws_out, &bws, sizeof(bws));
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+void get_drm_lti(struct drm_sun8i_lti_params *lti_out) {
+	pthread_mutex_lock(&current_values_lock);
+	memcpy(lti_out, &lti, sizeof(lti));
+	pthread_mutex_unlock(&current_values_lock);
+}
+
+// Copies params into current, returns 0 when they were the same. Before the first flip
+// they are programmed by the display thread.
+static int set_drm_params(void *current, const void *params, size_t size) {
+	pthread_mutex_lock(&current_values_lock);
+
+	if (memcmp(params, current, size) == 0) {
+		pthread_mutex_unlock(&current_values_lock);
 		return 0;
 	}
 
-	memcpy(&lti, lti_in, sizeof(lti));
+	memcpy(current, params, size);
+	pending_controls_apply = 1;
+
+	pthread_mutex_unlock(&current_values_lock);
 
 	if (display_initialized) {
-		drmIoctl(drm_fd, DRM_IOCTL_SUN8I_SET_LTI_PARAMS, &lti);
-	} else {
-		pending_controls_apply = 1;
+		apply_pending_controls();
 	}
 
 	return 1;
 }
 
-void init_display(int width, int height, int format) {
-	printf("Init buffers\n");
+int set_drm_fcc(struct drm_sun4i_fcc_params *fcc_in) {
+	return set_drm_params(&fcc, fcc_in, sizeof(fcc));
+}
 
-	uint8_t subsampling_divisor;
-	uint32_t chroma_pitches_divisor;
+int set_drm_bws(struct drm_sun8i_bws_params *bws_in) {
+	return set_drm_params(&bws, bws_in, sizeof(bws));
+}
 
-	if (format == 0x22) {
-		drm_mode_pixel_format = DRM_FORMAT_YUV420;
-		subsampling_divisor = 4;
-		chroma_pitches_divisor = 2;
-		printf("Using YUV420 format\n");
-	} else if (format == 0x21) {
-		drm_mode_pixel_format = DRM_FORMAT_YUV422;
-		subsampling_divisor = 2;
-		chroma_pitches_divisor = 2;
-		printf("Using YUV422 format\n");
-	} else if (format == 0x11) {
-		// TODO: I think the cedar may will output 422 format for 444 subsampling.
-		// However, i dont have a device that outputs 444 to test.
-		// If thats the case, adjust vars below to match 0x21 format.
-		drm_mode_pixel_format = DRM_FORMAT_YUV444;
-		subsampling_divisor = 1;
-		chroma_pitches_divisor = 1;
-		printf("MJPEG YUV444 is not tested! may need adjusts.\n");
+int set_drm_lti(struct drm_sun8i_lti_params *lti_in) {
+	return set_drm_params(&lti, lti_in, sizeof(lti));
+}
+
+static void create_buffer(struct display_source *src, int number, uint32_t width, uint32_t height, const uint32_t pitches[4], const uint32_t offsets[4], uint32_t u_size) {
+	int err;
+	struct display_buffer *buf = &src->buffers[number];
+
+	buf->gem.size = src->buffer_size;
+	buf->gem.flags = 0;
+	buf->gem.handle = 0;
+
+	err = drmIoctl(drm_fd, DRM_IOCTL_SUN4I_GEM_CREATE, &buf->gem);
+
+	if (err) {
+		printf("Failed to create GEM #%i. %i\n", number, err);
 		fflush(stdout);
-	} else {
-		// I don't know if GPU supports 0x12 (vertical subsampling only)
-		printf("MJPEG YUV format not supported %x\n", format);
 	}
 
-	find_new_plane();
+	const uint32_t bo_handles[4] = { buf->gem.handle, buf->gem.handle, buf->gem.handle, 0 };
+
+	buf->fb_id = 0;
+
+	err = drmModeAddFB2(drm_fd, width, height, src->pixel_format, bo_handles, pitches, offsets, &buf->fb_id, 0);
+
+	if (err) {
+		printf("Failed to add framebuffer #%i. %i\n", number, err);
+		fflush(stdout);
+	}
+
+	buf->dma_fd = 0;
+
+	err = drmPrimeHandleToFD(drm_fd, buf->gem.handle, DRM_RDWR, &buf->dma_fd);
+
+	buf->map = mmap(0, src->buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->dma_fd, 0);
+
+	if (buf->map == MAP_FAILED) {
+		buf->map = NULL;
+	}
+
+	if (buf->map) {
+		memset(buf->map, Y_VALUE, src->buffer_size);
+		memset(buf->map + offsets[1], U_VALUE, u_size);
+		memset(buf->map + offsets[2], V_VALUE, u_size);
+	}
+}
+
+static void clear_planes() {
+	for (int i = 0; i < count_crtcs; i++) {
+		if (new_planes[i]) {
+			drmModeSetPlane(drm_fd, new_planes[i]->plane_id, crtcs[i]->crtc_id, 0, 0, crtcs[i]->x, crtcs[i]->y, crtcs[i]->width, crtcs[i]->height, 0, 0, 0, 0);
+		}
+	}
+}
+
+static void allocate_source_buffers(struct display_source *src, uint32_t width, uint32_t height, uint8_t subsampling_divisor, uint32_t chroma_pitches_divisor) {
+	int i;
 
 	// Calc buffer size and offsets
 	uint32_t w_aligned = (width + 32) & ~32;
@@ -674,159 +1327,306 @@ void init_display(int width, int height, int format) {
 
 	uint32_t total_size = v_offset + v_size;
 
-	buffer_size = (total_size + PAGE_SIZE) & ~PAGE_SIZE;
-	data_offsets[0] = u_offset;
-	data_offsets[1] = v_offset;
+	src->buffer_size = (total_size + PAGE_SIZE) & ~PAGE_SIZE;
+	src->data_offsets[0] = u_offset;
+	src->data_offsets[1] = v_offset;
 
-	int err, i;
+	src->src_width = width << 16;
+	src->src_height = height << 16;
 
-	pthread_mutex_init(&current_values_lock, NULL);
-	pthread_cond_init(&available_buffer_cond, NULL);
+	printf("Calculated buffer size and offsets\n");
+	fflush(stdout);
 
-	current_display_buffer[0] = 1;
-	current_display_buffer[1] = 0;
-	current_display_buffer[2] = 0;
+	const uint32_t pitches[4] = { width, (width / chroma_pitches_divisor), (width / chroma_pitches_divisor), 0 };
+	const uint32_t offsets[4] = { 0, u_offset, v_offset, 0 };
 
-	current_available_buffer[0] = 2;
-	current_available_buffer[1] = 3;
-	current_available_buffer[2] = 0;
+	for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		create_buffer(src, i, width, height, pitches, offsets, u_size);
+	}
 
-	src_width = width << 16;
-	src_height = height << 16;
+	if (!src->buffers[1].fb_id) {
+		printf("Failed to create display buffers\n");
+		fflush(stdout);
+		exit(1);
+	}
+}
 
-	printf("Calculated buffer size and offsets\n");
-	fflush(stdout);
+static void free_buffer_set(struct display_buffer *buffers, uint32_t buffer_size) {
+	int err;
+	struct drm_gem_close gem_close;
+	struct display_buffer *buf;
 
-	// Create and add buffer 1
+	memset(&gem_close, 0, sizeof(gem_close));
 
-	data.size = buffer_size;
-	data.flags = 0;
-	data.handle = 0;
+	for (int i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		buf = &buffers[i];
 
-	err = drmIoctl(drm_fd, DRM_IOCTL_SUN4I_GEM_CREATE, &data);
+		if (buf->map) {
+			munmap(buf->map, buffer_size);
+			buf->map = NULL;
+		}
 
-	if (err) {
-		printf("Failed to create 1st GEM. %i\n", err);
-		fflush(stdout);
-	}
+		if (buf->dma_fd) {
+			close(buf->dma_fd);
+			buf->dma_fd = 0;
+		}
 
-        const uint32_t bo_handles[4] = { data.handle, data.handle, data.handle, 0 };
-        const uint32_t pitches[4] = { width, (width / chroma_pitches_divisor), (width / chroma_pitches_divisor), 0 };
-        const uint32_t offsets[4] = { 0, u_offset, v_offset, 0 };
+		if (buf->fb_id) {
+			drmModeRmFB(drm_fd, buf->fb_id);
+			buf->fb_id = 0;
+		}
 
-	buf_id = 0;
+		if (buf->gem.handle) {
+			gem_close.handle = buf->gem.handle;
+			err = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+			if (err) {
+				printf("Failed to close GEM #%i\n", i);
+			}
+			buf->gem.handle = 0;
+		}
+	}
+}
 
-        err = drmModeAddFB2(drm_fd, width, height, drm_mode_pixel_format, bo_handles, pitches, offsets, &buf_id, 0);
+static void free_source_buffers(struct display_source *src) {
+	free_buffer_set(src->buffers, src->buffer_size);
 
-	if (err) {
-		printf("Failed to add 1st GEM. %i\n", err);
-		fflush(stdout);
+	if (src->retired_pending) {
+		free_buffer_set(src->retired_buffers, src->retired_buffer_size);
+		src->retired_pending = 0;
 	}
+}
 
-	// Map buffer 1
+// Must be called with current_values_lock held
+static void reset_queues(struct display_source *src) {
+	src->current_display_buffer[0] = 1;
+	src->current_display_buffer[1] = 0;
+	src->current_display_buffer[2] = 0;
 
-	buf_fd = 0;
+	src->current_available_buffer[0] = 2;
+	src->current_available_buffer[1] = 3;
+	src->current_available_buffer[2] = 0;
 
-        err = drmPrimeHandleToFD(drm_fd, data.handle, DRM_RDWR, &buf_fd);
+	src->on_screen_buffer = 0;
+}
 
-        buffer_map = mmap(0, buffer_size, PROT_WRITE, MAP_SHARED, buf_fd, 0);
+void set_display_layout(int layout, int source_count) {
+	display_layout = layout;
+	layout_source_count = source_count;
 
-	if (buffer_map) {
-		memset(buffer_map, Y_VALUE, buffer_size);
-		memset(buffer_map + u_offset, U_VALUE, u_size);
-		memset(buffer_map + v_offset, V_VALUE, v_size);
+	if (layout_source_count > DISPLAY_MAX_SOURCES) {
+		layout_source_count = DISPLAY_MAX_SOURCES;
 	}
+}
 
-	// Create and add buffer 2
-
-	data2.size = buffer_size;
-	data2.flags = 0;
-	data2.handle = 0;
+// Assigns planes, destination rectangles and z order to each source of the layout.
+// Blending happens in the display engine, the CPU never touches the pixels.
+static void configure_layout() {
+	int i;
+	int inset = 0;
+	int plane_index = 1;
+	uint32_t prop_id;
+	__u64 value;
+	struct display_source *src;
+
+	if (display_layout == DISPLAY_LAYOUT_SINGLE || !crtcs[0]) {
+		return;
+	}
 
-	err = drmIoctl(drm_fd, DRM_IOCTL_SUN4I_GEM_CREATE, &data2);
+	uint32_t w = crtcs[0]->width;
+	uint32_t h = crtcs[0]->height;
 
-	if (err) {
-		printf("Failed to create 2nd Gem: %i\n", err);
+	if (hdmi_plane_count < layout_source_count) {
+		printf("Only %i planes for %i sources, falling back to VE downscaled tiles\n", hdmi_plane_count, layout_source_count);
 		fflush(stdout);
+		tiled_composition = 1;
+		return;
 	}
 
-	const uint32_t bo_handles2[4] = { data2.handle, data2.handle, data2.handle, 0 };
+	for (i = 0; i < layout_source_count; i++) {
+		src = &sources[i];
+
+		if (display_layout == DISPLAY_LAYOUT_QUAD) {
+			src->plane = hdmi_planes[i];
+			src->dst.x = (i % 2) * (w / 2);
+			src->dst.y = (i / 2) * (h / 2);
+			src->dst.w = w / 2;
+			src->dst.h = h / 2;
+			src->zpos = i;
+		} else if (i == active_source) {
+			src->plane = hdmi_planes[0];
+			src->dst.x = 0;
+			src->dst.y = 0;
+			src->dst.w = w;
+			src->dst.h = h;
+			src->zpos = 0;
+		} else {
+			inset++;
+			src->plane = hdmi_planes[plane_index++];
+			src->dst.w = w / PIP_SIZE_DIVISOR;
+			src->dst.h = h / PIP_SIZE_DIVISOR;
+			src->dst.x = w - (inset * (src->dst.w + PIP_MARGIN));
+			src->dst.y = h - src->dst.h - PIP_MARGIN;
+			src->zpos = inset;
+		}
 
-	buf_id2 = 0;
+		if (find_plane_property(src->plane->plane_id, "zpos", NULL, &prop_id, &value)) {
+			set_plane_property(src->plane->plane_id, prop_id, src->zpos);
+		}
 
-	err = drmModeAddFB2(drm_fd, width, height, drm_mode_pixel_format, bo_handles2, pitches, offsets, &buf_id2, 0);
+		printf("Source %i on plane %i at %i,%i %ux%u z %u\n", i, src->plane->plane_id, src->dst.x, src->dst.y, src->dst.w, src->dst.h, src->zpos);
+	}
 
-	if (err) {
-		printf("Failed to add 2nd framebuffer %i\n", err);
+	fflush(stdout);
+}
+
+// In tiled mode every source is decoded at half size into its quadrant of the wall buffer.
+// Returns 0 when the source could not join the wall.
+static int join_wall(int source, uint32_t width, uint32_t height, uint8_t subsampling_divisor, uint32_t chroma_pitches_divisor) {
+	struct display_source *src = &sources[source];
+	struct display_source *wall = &sources[WALL_SOURCE];
+
+	pthread_mutex_lock(&current_values_lock);
+
+	if (!wall->buffers[1].fb_id) {
+		wall->pixel_format = src->pixel_format;
+		wall->width = width;
+		wall->height = height;
+		wall->chroma_pitch_divisor = src->chroma_pitch_divisor;
+		wall->chroma_height_divisor = src->chroma_height_divisor;
+
+		allocate_source_buffers(wall, width, height, subsampling_divisor, chroma_pitches_divisor);
+		pthread_cond_init(&wall->available_buffer_cond, NULL);
+
+		reset_queues(wall);
+		wall_back_buffer = 0;
+		wall_contributions = 0;
+		wall->initialized = 1;
+	} else if (wall->width != width || wall->height != height || wall->pixel_format != src->pixel_format) {
+		pthread_mutex_unlock(&current_values_lock);
+		printf("Source %i does not match the wall format, it will not be displayed\n", source);
 		fflush(stdout);
+		return 0;
 	}
 
-	// Map buffer 2
+	uint32_t tile_x = (source % 2) * (width / 2);
+	uint32_t tile_y = ((source / 2) % 2) * (height / 2);
 
-	buf_fd2 = 0;
+	src->tile_luma_offset = (tile_y * width) + tile_x;
+	src->tile_chroma_offset = ((tile_y / src->chroma_height_divisor) * (width / src->chroma_pitch_divisor)) + (tile_x / src->chroma_pitch_divisor);
+	src->tiled = 1;
 
-	err = drmPrimeHandleToFD(drm_fd, data2.handle, DRM_RDWR, &buf_fd2);
+	wall_members |= (1 << source);
+	src->initialized = 1;
+	pthread_mutex_unlock(&current_values_lock);
 
-	buffer_map2 = mmap(0, buffer_size, PROT_WRITE, MAP_SHARED, buf_fd2, 0);
+	printf("Source %i decoding to wall tile at %u,%u\n", source, tile_x, tile_y);
+	fflush(stdout);
 
-	if (buffer_map2) {
-		memset(buffer_map2, Y_VALUE, buffer_size);
-		memset(buffer_map2 + u_offset, U_VALUE, u_size);
-		memset(buffer_map2 + v_offset, V_VALUE, v_size);
-	}
+	return 1;
+}
 
-	// Create and add buffer 3
+// Maps the JPEG sampling factors to the DRM format and plane divisors.
+// Returns 0 when the format is not supported.
+static int format_layout(int format, uint32_t *pixel_format, uint8_t *subsampling_divisor, uint32_t *chroma_pitches_divisor, uint32_t *chroma_height_divisor) {
+	*chroma_height_divisor = 1;
 
-	data3.size = buffer_size;
-	data3.flags = 0;
-	data3.handle = 0;
+	if (format == 0x22) {
+		*pixel_format = DRM_FORMAT_YUV420;
+		*subsampling_divisor = 4;
+		*chroma_pitches_divisor = 2;
+		*chroma_height_divisor = 2;
+		printf("Using YUV420 format\n");
+	} else if (format == 0x21) {
+		*pixel_format = DRM_FORMAT_YUV422;
+		*subsampling_divisor = 2;
+		*chroma_pitches_divisor = 2;
+		printf("Using YUV422 format\n");
+	} else if (format == 0x11) {
+		// TODO: I think the cedar may will output 422 format for 444 subsampling.
+		// However, i dont have a device that outputs 444 to test.
+		// If thats the case, adjust vars below to match 0x21 format.
+		*pixel_format = DRM_FORMAT_YUV444;
+		*subsampling_divisor = 1;
+		*chroma_pitches_divisor = 1;
+		printf("MJPEG YUV444 is not tested! may need adjusts.\n");
+		fflush(stdout);
+	} else {
+		// I don't know if GPU supports 0x12 (vertical subsampling only)
+		printf("MJPEG YUV format not supported %x\n", format);
+		return 0;
+	}
 
-	err = drmIoctl(drm_fd, DRM_IOCTL_SUN4I_GEM_CREATE, &data3);
+	return 1;
+}
 
-	if (err) {
-		printf("Failed to create 3st GEM. %i\n", err);
-		fflush(stdout);
+void init_display(int source, int width, int height, int format) {
+	printf("Init buffers for source %i\n", source);
+
+	if (!valid_source(source)) {
+		return;
 	}
 
-        const uint32_t bo_handles3[4] = { data3.handle, data3.handle, data3.handle, 0 };
+	struct display_source *src = &sources[source];
 
-	buf_id3 = 0;
+	uint8_t subsampling_divisor;
+	uint32_t chroma_pitches_divisor;
+	uint32_t chroma_height_divisor = 1;
+	uint32_t pixel_format;
+	int err;
 
-        err = drmModeAddFB2(drm_fd, width, height, drm_mode_pixel_format, bo_handles3, pitches, offsets, &buf_id3, 0);
+	if (!format_layout(format, &pixel_format, &subsampling_divisor, &chroma_pitches_divisor, &chroma_height_divisor)) {
+		return;
+	}
 
-	if (err) {
-		printf("Failed to add 3st GEM. %i\n", err);
+	src->pixel_format = pixel_format;
+	src->width = width;
+	src->height = height;
+	src->chroma_pitch_divisor = chroma_pitches_divisor;
+	src->chroma_height_divisor = chroma_height_divisor;
+
+	pthread_mutex_lock(&init_lock);
+
+	// Planes are shared by all sources, so they are picked with the format of the first one.
+	if (new_planes == NULL) {
+		drm_mode_pixel_format = pixel_format;
+		find_new_plane();
+		configure_layout();
+	} else if (pixel_format != drm_mode_pixel_format) {
+		printf("Source %i uses a different pixel format from the plane format, display may fail\n", source);
 		fflush(stdout);
 	}
 
-	// Map buffer 3
+	pthread_cond_init(&src->available_buffer_cond, NULL);
 
-	buf_fd3 = 0;
+	if (!tiled_composition || !join_wall(source, width, height, subsampling_divisor, chroma_pitches_divisor)) {
+		allocate_source_buffers(src, width, height, subsampling_divisor, chroma_pitches_divisor);
 
-        err = drmPrimeHandleToFD(drm_fd, data3.handle, DRM_RDWR, &buf_fd3);
+		pthread_mutex_lock(&current_values_lock);
 
-        buffer_map3 = mmap(0, buffer_size, PROT_WRITE, MAP_SHARED, buf_fd3, 0);
+		reset_queues(src);
+		src->initialized = 1;
 
-	if (buffer_map3) {
-		memset(buffer_map3, Y_VALUE, buffer_size);
-		memset(buffer_map3 + u_offset, U_VALUE, u_size);
-		memset(buffer_map3 + v_offset, V_VALUE, v_size);
-	}
+		pthread_cond_signal(&display_buffer_cond);
 
-	if (buf_id) {
-		printf("Setting color format on planes\n");
-		fflush(stdout);
-		setPlanesColorFormat();
+		pthread_mutex_unlock(&current_values_lock);
+	}
 
-		printf("Starting display thread\n");
+	if (run_video_update) {
+		pthread_mutex_unlock(&init_lock);
+		printf("Display initialized for source %i\n", source);
 		fflush(stdout);
-		run_video_update = 1;
-		err = pthread_create(&display_thread, NULL, display_thread_loop, NULL);
-	} else {
-		printf("Skipped starting display thread\n");
-		err = 1;
+		return;
 	}
 
+	printf("Setting color format on planes\n");
+	fflush(stdout);
+	setPlanesColorFormat();
+
+	printf("Starting display thread\n");
+	fflush(stdout);
+	run_video_update = 1;
+	err = pthread_create(&display_thread, NULL, display_thread_loop, NULL);
+
 	if (err) {
 		printf("Failed to start draw thread\n");
 		fflush(stdout);
@@ -835,94 +1635,230 @@ void init_display(int width, int height, int format) {
 		printf("Display initialized\n");
 		fflush(stdout);
 	}
+
+	pthread_mutex_unlock(&init_lock);
 }
 
-void terminate_display()
-{
-	void *thread_return;
+int reconfigure_display(int source, int width, int height, int format) {
+	struct display_source staging;
+	struct display_buffer unused[DISPLAY_BUFFER_COUNT + 1];
+	uint32_t unused_size = 0;
+	uint8_t subsampling_divisor;
+	uint32_t chroma_pitches_divisor;
+	uint32_t chroma_height_divisor;
+	uint32_t pixel_format;
 
-	if (src_width == 0 && src_height == 0) {
-		return;
+	if (!valid_source(source)) {
+		return 0;
 	}
 
-	display_initialized = 0;
-	run_video_update = 0;
-	pthread_cond_signal(&display_buffer_cond);
-	pthread_join(display_thread, &thread_return);
+	struct display_source *src = &sources[source];
 
-	src_width = 0;
-	src_height = 0;
+	// The wall is shared by every tiled source, it is not rebuilt under the others
+	if (!src->initialized || src->tiled) {
+		return 0;
+	}
 
-	for (int i = 0; i < count_crtcs; i++) {
-		if (new_planes[i]) {
-			drmModeSetPlane(drm_fd, new_planes[i]->plane_id, crtcs[i]->crtc_id, 0, 0, crtcs[i]->x, crtcs[i]->y, crtcs[i]->width, crtcs[i]->height, 0, 0, src_width, src_height);
-		}
+	if (!format_layout(format, &pixel_format, &subsampling_divisor, &chroma_pitches_divisor, &chroma_height_divisor)) {
+		return 0;
 	}
 
-	pthread_mutex_destroy(&current_values_lock);
-	pthread_cond_destroy(&available_buffer_cond);
-}
+	printf("Source %i changed to %ix%i format %x, rebuilding buffers\n", source, width, height, format);
+	fflush(stdout);
 
-void deallocate_buffers() {
-	int err;
-	struct drm_gem_close gem_close;
+	uint64_t start = now_ns();
 
-	memset(&gem_close, 0, sizeof(gem_close));
+	// Built without any lock, the display thread keeps flipping the other sources and the
+	// old frame of this one stays on screen meanwhile
+	memset(&staging, 0, sizeof(staging));
+	staging.pixel_format = pixel_format;
+	allocate_source_buffers(&staging, width, height, subsampling_divisor, chroma_pitches_divisor);
+
+	uint64_t built = now_ns();
 
-	if (buffer_map) {
-		munmap(buffer_map, buffer_size);
+	pthread_mutex_lock(&present_lock);
+	pthread_mutex_lock(&current_values_lock);
+
+	if (src->retired_pending) {
+		// Changed again before any frame of the previous set was shown, that set was
+		// never on screen and the retired one still is
+		memcpy(unused, src->buffers, sizeof(unused));
+		unused_size = src->buffer_size;
+	} else {
+		memcpy(src->retired_buffers, src->buffers, sizeof(src->retired_buffers));
+		src->retired_buffer_size = src->buffer_size;
+		src->retired_pending = 1;
+		src->reconfigure_start_ns = start;
 	}
 
-	if (buffer_map2) {
-		munmap(buffer_map2, buffer_size);
+	src->reconfigure_built_ns = built;
+
+	memcpy(src->buffers, staging.buffers, sizeof(src->buffers));
+	src->buffer_size = staging.buffer_size;
+	memcpy(src->data_offsets, staging.data_offsets, sizeof(src->data_offsets));
+	src->src_width = staging.src_width;
+	src->src_height = staging.src_height;
+
+	src->pixel_format = pixel_format;
+	src->width = width;
+	src->height = height;
+	src->chroma_pitch_divisor = chroma_pitches_divisor;
+	src->chroma_height_divisor = chroma_height_divisor;
+
+	// Queued frames of the old set are dropped, the first frame put in the new set is
+	// flipped in its place
+	memset(src->current_display_buffer, 0, sizeof(buffer_t));
+
+	for (int i = 0; i < DISPLAY_BUFFER_COUNT; i++) {
+		src->current_available_buffer[i] = i + 1;
 	}
 
-	if (buffer_map3) {
-		munmap(buffer_map3, buffer_size);
+	src->on_screen_buffer = 0;
+	src->generation++;
+
+	pthread_cond_broadcast(&src->available_buffer_cond);
+
+	pthread_mutex_unlock(&current_values_lock);
+	pthread_mutex_unlock(&present_lock);
+
+	if (unused_size) {
+		free_buffer_set(unused, unused_size);
 	}
 
-	close(buf_fd);
-	close(buf_fd2);
-	close(buf_fd3);
+	if (pixel_format != drm_mode_pixel_format) {
+		printf("Source %i uses a different pixel format from the plane format, display may fail\n", source);
+		fflush(stdout);
+	}
 
-	if (buf_id) {
-		drmModeRmFB(drm_fd, buf_id);
+	return 1;
+}
+
+void terminate_display(int source)
+{
+	void *thread_return;
+	int any_initialized = 0;
+	int clear = 0;
+	struct display_source *src;
+	struct display_source *wall = &sources[WALL_SOURCE];
+
+	if (!valid_source(source)) {
+		return;
 	}
 
-	if (data.handle) {
-		gem_close.handle = data.handle;
-		err = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		if (err) {
-			printf("Failed to close GEM #1\n");
+	src = &sources[source];
+
+	pthread_mutex_lock(&init_lock);
+
+	if (!src->initialized) {
+		pthread_mutex_unlock(&init_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&present_lock);
+	pthread_mutex_lock(&current_values_lock);
+
+	src->initialized = 0;
+	src->on_screen_buffer = 0;
+	memset(src->current_display_buffer, 0, sizeof(buffer_t));
+	memset(src->current_available_buffer, 0, sizeof(buffer_t));
+	pthread_cond_broadcast(&src->available_buffer_cond);
+
+	if (src->tiled) {
+		src->tiled = 0;
+		wall_members &= ~(1 << source);
+		wall_contributions &= ~(1 << source);
+
+		if (wall_members == 0) {
+			wall->initialized = 0;
+			wall->on_screen_buffer = 0;
+			wall_back_buffer = 0;
+			memset(wall->current_display_buffer, 0, sizeof(buffer_t));
+			memset(wall->current_available_buffer, 0, sizeof(buffer_t));
+			pthread_cond_broadcast(&wall->available_buffer_cond);
+			clear = 1;
+		} else {
+			flip_wall_if_complete();
 		}
+	} else if (source_visible(source)) {
+		clear = 1;
 	}
 
-	if (buf_id2) {
-		drmModeRmFB(drm_fd, buf_id2);
+	for (int i = 0; i < DISPLAY_MAX_SOURCES; i++) {
+		any_initialized |= sources[i].initialized;
 	}
 
-	if (data2.handle) {
-		gem_close.handle = data2.handle;
-		err = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		if (err) {
-			printf("Failed to close GEM #2\n");
-		}
+	pthread_mutex_unlock(&current_values_lock);
+
+	if (clear && src->plane && !tiled_composition) {
+		drmModeSetPlane(drm_fd, src->plane->plane_id, crtcs[0]->crtc_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	} else if (clear) {
+		clear_planes();
 	}
 
-	if (buf_id3) {
-		drmModeRmFB(drm_fd, buf_id3);
+	pthread_mutex_unlock(&present_lock);
+
+	if (!any_initialized && run_video_update) {
+		display_initialized = 0;
+
+		pthread_mutex_lock(&current_values_lock);
+		run_video_update = 0;
+		pthread_cond_signal(&display_buffer_cond);
+		pthread_mutex_unlock(&current_values_lock);
+
+		pthread_join(display_thread, &thread_return);
 	}
 
-	if (data3.handle) {
-		gem_close.handle = data3.handle;
-		err = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		if (err) {
-			printf("Failed to close GEM #3\n");
-		}
+	src->src_width = 0;
+	src->src_height = 0;
+
+	pthread_cond_destroy(&src->available_buffer_cond);
+
+	pthread_mutex_unlock(&init_lock);
+}
+
+void deallocate_buffers(int source) {
+	struct display_source *wall = &sources[WALL_SOURCE];
+
+	if (!valid_source(source)) {
+		return;
+	}
+
+	pthread_mutex_lock(&init_lock);
+
+	free_source_buffers(&sources[source]);
+
+	// The wall goes away with its last member
+	if (wall_members == 0 && wall->buffers[1].fb_id) {
+		free_source_buffers(wall);
+		pthread_cond_destroy(&wall->available_buffer_cond);
+		wall->src_width = 0;
+		wall->src_height = 0;
+	}
+
+	pthread_mutex_unlock(&init_lock);
+}
+
+int get_tile(int source, uint32_t *luma_offset, uint32_t *chroma_offset, uint32_t *line_stride) {
+	if (!valid_source(source) || !sources[source].tiled) {
+		return 0;
 	}
+
+	*luma_offset = sources[source].tile_luma_offset;
+	*chroma_offset = sources[source].tile_chroma_offset;
+	*line_stride = sources[WALL_SOURCE].width;
+
+	return 1;
 }
 
 void stop_drm() {
+	// hdmi_planes[0] is new_planes[0], released below
+	for (int i = 1; i < hdmi_plane_count; i++) {
+		drmModeSetPlane(drm_fd, hdmi_planes[i]->plane_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		drmModeFreePlane(hdmi_planes[i]);
+	}
+
+	hdmi_plane_count = 0;
+
 	if (new_planes) {
 		for (int i = 0; i < count_crtcs; i++) {
 			if (new_planes[i]) {
@@ -939,31 +1875,27 @@ void stop_drm() {
 	drmClose(drm_fd);
 }
 
-int get_dma_fd1() {
-	return buf_fd;
-}
-
-uint8_t* get_buffer_1() {
-	return (uint8_t*)buffer_map;
-}
+int get_dma_fd(int source, int buffer_number) {
+	if (!valid_source(source) || buffer_number < 1 || buffer_number > DISPLAY_BUFFER_COUNT) {
+		return 0;
+	}
 
-uint8_t* get_buffer_2() {
-	return (uint8_t*)buffer_map2;
+	return source_buffers(source)->buffers[buffer_number].dma_fd;
 }
 
-uint8_t* get_buffer_3() {
-	return (uint8_t*)buffer_map3;
-}
+uint8_t* get_buffer_map(int source, int buffer_number) {
+	if (!valid_source(source) || buffer_number < 1 || buffer_number > DISPLAY_BUFFER_COUNT) {
+		return NULL;
+	}
 
-int get_dma_fd2() {
-	return buf_fd2;
+	return (uint8_t*)source_buffers(source)->buffers[buffer_number].map;
 }
 
-int get_dma_fd3() {
-	return buf_fd3;
-}
+void get_offsets(int source, uint32_t *u_offset, uint32_t *v_offset) {
+	if (!valid_source(source)) {
+		return;
+	}
 
-void get_offsets(uint32_t *u_offset, uint32_t *v_offset) {
-	*u_offset = data_offsets[0];
-	*v_offset = data_offsets[1];
+	*u_offset = source_buffers(source)->data_offsets[0];
+	*v_offset = source_buffers(source)->data_offsets[1];
 }
@@ -5,6 +5,13 @@
 #include <inttypes.h>
 #include <drm/sun4i_drm.h>
 
+#define DISPLAY_MAX_SOURCES 4
+#define DISPLAY_BUFFER_COUNT 3
+
+#define DISPLAY_LAYOUT_SINGLE 0
+#define DISPLAY_LAYOUT_QUAD 1
+#define DISPLAY_LAYOUT_PIP 2
+
 void start_drm();
 void stop_drm();
 
@@ -17,21 +24,42 @@ int set_drm_bws(struct drm_sun8i_bws_params *bws_in);
 void get_drm_lti(struct drm_sun8i_lti_params *lti_out);
 int set_drm_lti(struct drm_sun8i_lti_params *lti_in);
 
-void init_display(int width, int height, int format);
-void terminate_display();
-void deallocate_buffers();
+#define DISPLAY_MAX_HUE 180
+#define DISPLAY_MAX_TINT 64
+
+// Hue in degrees, tint toward magenta (negative toward green), for every camera. Done by the
+// FCC as gains on top of the fcc params when it can, applied on the next flip, it can't tint
+// greys. Hues past about 22 degrees, or a display without FCC, use the software grade of
+// every source instead. Returns 0 when the software grade does it.
+int set_drm_hue_tint(int hue, int tint);
+
+void init_display(int source, int width, int height, int format);
+// Swaps the buffers of an initialized source for a new size or format. The old frame stays
+// on screen until the first frame put in the new buffers is flipped. Returns 0 when the
+// source can't be reconfigured in place (tiled, or unsupported format).
+int reconfigure_display(int source, int width, int height, int format);
+void terminate_display(int source);
+void deallocate_buffers(int source);
+
+void set_display_layout(int layout, int source_count);
+void set_active_source(int source);
+int get_active_source();
+
+// Of the HDMI output, 0 before start_drm or when it has no mode
+int get_display_refresh_rate();
 
-int get_buffer_number();
-void put_buffer(uint8_t buffer_number);
+// The camera of the source stopped or resumed streaming, its buffers are kept. A stopped
+// source no longer holds back the flips of the tiled wall.
+void set_source_streaming(int source, int streaming);
 
-int get_dma_fd1();
-int get_dma_fd2();
-int get_dma_fd3();
+int get_buffer_number(int source);
+// capture_ns is the CLOCK_MONOTONIC capture time of the frame, 0 when unknown
+void put_buffer(int source, uint8_t buffer_number, uint64_t capture_ns);
 
-uint8_t* get_buffer_1();
-uint8_t* get_buffer_2();
-uint8_t* get_buffer_3();
+int get_dma_fd(int source, int buffer_number);
+uint8_t* get_buffer_map(int source, int buffer_number);
 
-void get_offsets(uint32_t *u_offset, uint32_t *v_offset);
+void get_offsets(int source, uint32_t *u_offset, uint32_t *v_offset);
+int get_tile(int source, uint32_t *luma_offset, uint32_t *chroma_offset, uint32_t *line_stride);
 
 #endif
@@ -0,0 +1,96 @@
+#include <string.h>
+
+#include "display.h"
+#include "display_params.h"
+
+#define PARAM_FIELD(group, type, field) { \
+	#group "." #field, #group, #field, \
+	offsetof(display_params_t, group) + offsetof(type, field), \
+	sizeof(((type*)0)->field) \
+}
+#define FCC_FIELD(field) PARAM_FIELD(fcc, struct drm_sun4i_fcc_params, field)
+#define BWS_FIELD(field) PARAM_FIELD(bws, struct drm_sun8i_bws_params, field)
+#define LTI_FIELD(field) PARAM_FIELD(lti, struct drm_sun8i_lti_params, field)
+
+const display_param_t display_param_fields[] = {
+	FCC_FIELD(enable),
+	FCC_FIELD(hr_hue_min), FCC_FIELD(hr_hue_max),
+	FCC_FIELD(hg_hue_min), FCC_FIELD(hg_hue_max),
+	FCC_FIELD(hb_hue_min), FCC_FIELD(hb_hue_max),
+	FCC_FIELD(hc_hue_min), FCC_FIELD(hc_hue_max),
+	FCC_FIELD(hm_hue_min), FCC_FIELD(hm_hue_max),
+	FCC_FIELD(hy_hue_min), FCC_FIELD(hy_hue_max),
+	FCC_FIELD(hr_hue_gain), FCC_FIELD(hr_sat_gain),
+	FCC_FIELD(hg_hue_gain), FCC_FIELD(hg_sat_gain),
+	FCC_FIELD(hb_hue_gain), FCC_FIELD(hb_sat_gain),
+	FCC_FIELD(hc_hue_gain), FCC_FIELD(hc_sat_gain),
+	FCC_FIELD(hm_hue_gain), FCC_FIELD(hm_sat_gain),
+	FCC_FIELD(hy_hue_gain), FCC_FIELD(hy_sat_gain),
+
+	BWS_FIELD(enable),
+	BWS_FIELD(min), BWS_FIELD(black), BWS_FIELD(white), BWS_FIELD(max),
+	BWS_FIELD(slope0), BWS_FIELD(slope1), BWS_FIELD(slope2), BWS_FIELD(slope3),
+
+	LTI_FIELD(enable),
+	LTI_FIELD(c0), LTI_FIELD(c1), LTI_FIELD(c2), LTI_FIELD(c3), LTI_FIELD(c4),
+	LTI_FIELD(fir_gain), LTI_FIELD(cor_th), LTI_FIELD(diff_offset), LTI_FIELD(diff_slope),
+	LTI_FIELD(edge_gain), LTI_FIELD(core_x), LTI_FIELD(clip_y), LTI_FIELD(peak_limit),
+	LTI_FIELD(win_expansion), LTI_FIELD(edge_level_th),
+};
+
+const int display_param_count = sizeof(display_param_fields) / sizeof(display_param_fields[0]);
+
+void display_params_get(display_params_t *params) {
+	get_drm_fcc(&params->fcc);
+	get_drm_bws(&params->bws);
+	get_drm_lti(&params->lti);
+}
+
+int display_params_set(display_params_t *params) {
+	int changed = set_drm_fcc(&params->fcc);
+	changed |= set_drm_bws(&params->bws);
+	changed |= set_drm_lti(&params->lti);
+
+	return changed;
+}
+
+int display_param_find(const char *name) {
+	for (int i = 0; i < display_param_count; i++) {
+		if (strcmp(display_param_fields[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int32_t display_param_value(const display_params_t *params, int index) {
+	const display_param_t *field = &display_param_fields[index];
+	const uint8_t *ptr = (const uint8_t*) params + field->offset;
+
+	switch (field->size) {
+		case 1:
+			return *(const uint8_t*) ptr;
+		case 2:
+			return *(const uint16_t*) ptr;
+		default:
+			return *(const int32_t*) ptr;
+	}
+}
+
+void display_param_set_value(display_params_t *params, int index, int32_t value) {
+	const display_param_t *field = &display_param_fields[index];
+	uint8_t *ptr = (uint8_t*) params + field->offset;
+
+	switch (field->size) {
+		case 1:
+			*(uint8_t*) ptr = value;
+			break;
+		case 2:
+			*(uint16_t*) ptr = value;
+			break;
+		default:
+			*(int32_t*) ptr = value;
+			break;
+	}
+}
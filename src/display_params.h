@@ -0,0 +1,37 @@
+#ifndef _DISPLAY_PARAMS_H_
+#define _DISPLAY_PARAMS_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <drm/sun4i_drm.h>
+
+// Snapshot of every display enhancement param
+typedef struct {
+    struct drm_sun4i_fcc_params fcc;
+    struct drm_sun8i_bws_params bws;
+    struct drm_sun8i_lti_params lti;
+} display_params_t;
+
+// One field of display_params_t, named "<group>.<key>", like "fcc.hr_hue_min"
+typedef struct {
+    const char *name;
+    const char *group;
+    const char *key;
+    size_t offset;
+    size_t size;
+} display_param_t;
+
+extern const display_param_t display_param_fields[];
+extern const int display_param_count;
+
+void display_params_get(display_params_t *params);
+// Returns 1 if any param changed
+int display_params_set(display_params_t *params);
+
+// Index into display_param_fields, -1 if there is no such param
+int display_param_find(const char *name);
+
+int32_t display_param_value(const display_params_t *params, int index);
+void display_param_set_value(display_params_t *params, int index, int32_t value);
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "frame_timing.h"
+#include "display.h"
+#include "metrics.h"
+
+#define REPORT_LINE_SIZE 512
+
+struct source_timing {
+	// Written by the capture loop and the display thread
+	pthread_mutex_t lock;
+
+	uint64_t window_start;
+
+	uint8_t has_previous;
+	uint32_t previous_sequence;
+	uint64_t previous_timestamp_ns;
+
+	timing_histogram_t interval;
+	uint32_t sequence_gaps;
+	uint64_t total_sequence_gaps;
+	uint32_t unstamped_frames;
+
+	timing_histogram_t dequeue;
+	timing_histogram_t decode;
+	timing_histogram_t display;
+	timing_histogram_t total;
+};
+
+static struct source_timing timings[DISPLAY_MAX_SOURCES];
+static pthread_once_t timings_once = PTHREAD_ONCE_INIT;
+
+static void init_timings() {
+	for (int i = 0; i < DISPLAY_MAX_SOURCES; i++) {
+		pthread_mutex_init(&timings[i].lock, NULL);
+	}
+}
+
+static struct source_timing* source_timing(int source) {
+	if (source < 0 || source >= DISPLAY_MAX_SOURCES) {
+		return NULL;
+	}
+
+	pthread_once(&timings_once, init_timings);
+
+	return &timings[source];
+}
+
+// Below 32 the index is the value. Above, the top bit picks a group of 32 buckets and the
+// next 5 bits the bucket in it.
+static uint32_t bucket_index(uint64_t us) {
+	if (us < FRAME_TIMING_SUB_BUCKETS) {
+		return us;
+	}
+
+	uint32_t exponent = 63 - __builtin_clzll(us);
+	uint32_t shift = exponent - FRAME_TIMING_SUB_BITS;
+	uint64_t index = (uint64_t)(shift + 1) * FRAME_TIMING_SUB_BUCKETS + ((us >> shift) & (FRAME_TIMING_SUB_BUCKETS - 1));
+
+	return index < FRAME_TIMING_BUCKETS ? index : FRAME_TIMING_BUCKETS - 1;
+}
+
+static uint64_t bucket_middle(uint32_t index) {
+	if (index < FRAME_TIMING_SUB_BUCKETS) {
+		return index;
+	}
+
+	uint32_t shift = index / FRAME_TIMING_SUB_BUCKETS - 1;
+	uint64_t low = (uint64_t)(FRAME_TIMING_SUB_BUCKETS + index % FRAME_TIMING_SUB_BUCKETS) << shift;
+
+	return low + ((1ULL << shift) >> 1);
+}
+
+void timing_histogram_add(timing_histogram_t *histogram, uint64_t value_ns) {
+	uint64_t us = value_ns / 1000;
+
+	histogram->counts[bucket_index(us)]++;
+	histogram->count++;
+
+	if (us > histogram->max_us) {
+		histogram->max_us = us;
+	}
+}
+
+uint64_t timing_histogram_percentile(const timing_histogram_t *histogram, uint32_t percent) {
+	uint64_t rank = ((uint64_t)histogram->count * percent + 99) / 100;
+	uint64_t seen = 0;
+
+	if (histogram->count == 0) {
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < FRAME_TIMING_BUCKETS; i++) {
+		seen += histogram->counts[i];
+
+		if (seen >= rank) {
+			uint64_t middle = bucket_middle(i);
+			return middle < histogram->max_us ? middle : histogram->max_us;
+		}
+	}
+
+	return histogram->max_us;
+}
+
+// Clocks can be stepped back around a restart, those samples are left out
+static void add_elapsed(timing_histogram_t *histogram, uint64_t from_ns, uint64_t to_ns) {
+	if (from_ns && to_ns >= from_ns) {
+		timing_histogram_add(histogram, to_ns - from_ns);
+	}
+}
+
+void frame_timing_decoded(int source, uint32_t sequence, uint64_t timestamp_ns, int monotonic, uint32_t skipped, uint64_t dequeued_ns, uint64_t decoded_ns) {
+	struct source_timing *timing = source_timing(source);
+
+	if (timing == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&timing->lock);
+
+	if (timing->window_start == 0) {
+		timing->window_start = dequeued_ns;
+	}
+
+	// The sequence counts every frame the driver filled, so over a gap the interval is
+	// averaged and the frames missing from the count were dropped before userspace.
+	if (timing->has_previous && sequence > timing->previous_sequence && timestamp_ns > timing->previous_timestamp_ns) {
+		uint32_t frames = sequence - timing->previous_sequence;
+
+		timing_histogram_add(&timing->interval, (timestamp_ns - timing->previous_timestamp_ns) / frames);
+
+		if (frames > skipped + 1) {
+			timing->sequence_gaps += frames - skipped - 1;
+			timing->total_sequence_gaps += frames - skipped - 1;
+		}
+	}
+
+	timing->has_previous = 1;
+	timing->previous_sequence = sequence;
+	timing->previous_timestamp_ns = timestamp_ns;
+
+	if (monotonic) {
+		add_elapsed(&timing->dequeue, timestamp_ns, dequeued_ns);
+	} else {
+		timing->unstamped_frames++;
+	}
+
+	add_elapsed(&timing->decode, dequeued_ns, decoded_ns);
+
+	pthread_mutex_unlock(&timing->lock);
+}
+
+void frame_timing_presented(int source, uint64_t capture_ns, uint64_t queued_ns, uint64_t presented_ns) {
+	struct source_timing *timing = source_timing(source);
+
+	if (timing == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&timing->lock);
+
+	add_elapsed(&timing->display, queued_ns, presented_ns);
+	add_elapsed(&timing->total, capture_ns, presented_ns);
+
+	pthread_mutex_unlock(&timing->lock);
+}
+
+void frame_timing_restart(int source) {
+	struct source_timing *timing = source_timing(source);
+
+	if (timing == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&timing->lock);
+	timing->has_previous = 0;
+	pthread_mutex_unlock(&timing->lock);
+}
+
+static int append_stage(char *line, int length, const char *name, const timing_histogram_t *histogram) {
+	if (length >= REPORT_LINE_SIZE || histogram->count == 0) {
+		return length;
+	}
+
+	return length + snprintf(line + length, REPORT_LINE_SIZE - length, ", %s p50 %.2f p99 %.2f max %.2f ms",
+		name,
+		(double)timing_histogram_percentile(histogram, 50) / 1000.0,
+		(double)timing_histogram_percentile(histogram, 99) / 1000.0,
+		(double)histogram->max_us / 1000.0
+	);
+}
+
+void frame_timing_report(int source, const char *name, uint64_t now_ns) {
+	struct source_timing *timing = source_timing(source);
+	char line[REPORT_LINE_SIZE];
+	int length;
+
+	if (timing == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&timing->lock);
+
+	if (timing->window_start == 0 || now_ns - timing->window_start < METRICS_REPORT_INTERVAL_NS) {
+		pthread_mutex_unlock(&timing->lock);
+		return;
+	}
+
+	// Jitter is how far the slow frames are from the typical interval
+	uint64_t interval_p50 = timing_histogram_percentile(&timing->interval, 50);
+	uint64_t interval_p99 = timing_histogram_percentile(&timing->interval, 99);
+
+	length = snprintf(line, REPORT_LINE_SIZE, "[%s] interval p50 %.2f ms jitter %.2f ms max %.2f ms, %u sequence gaps (%llu total)",
+		name,
+		(double)interval_p50 / 1000.0,
+		(double)(interval_p99 - interval_p50) / 1000.0,
+		(double)timing->interval.max_us / 1000.0,
+		timing->sequence_gaps,
+		(unsigned long long)timing->total_sequence_gaps
+	);
+
+	length = append_stage(line, length, "dequeue", &timing->dequeue);
+	length = append_stage(line, length, "decode", &timing->decode);
+	length = append_stage(line, length, "display", &timing->display);
+	length = append_stage(line, length, "total", &timing->total);
+
+	if (timing->unstamped_frames && length < REPORT_LINE_SIZE) {
+		snprintf(line + length, REPORT_LINE_SIZE - length, ", %u frames without monotonic timestamps", timing->unstamped_frames);
+	}
+
+	memset(&timing->interval, 0, sizeof(timing_histogram_t));
+	memset(&timing->dequeue, 0, sizeof(timing_histogram_t));
+	memset(&timing->decode, 0, sizeof(timing_histogram_t));
+	memset(&timing->display, 0, sizeof(timing_histogram_t));
+	memset(&timing->total, 0, sizeof(timing_histogram_t));
+	timing->sequence_gaps = 0;
+	timing->unstamped_frames = 0;
+	timing->window_start = now_ns;
+
+	pthread_mutex_unlock(&timing->lock);
+
+	printf("%s\n", line);
+	fflush(stdout);
+}
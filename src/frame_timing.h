@@ -0,0 +1,51 @@
+#ifndef _FRAME_TIMING_H_
+#define _FRAME_TIMING_H_
+
+#include <inttypes.h>
+
+// Where the time of a frame goes, from the kernel capture timestamp of the V4L2 buffer to
+// the plane update that put it on screen:
+//
+//   interval   between camera frames, from the capture timestamps. Jitter here comes from
+//              the camera or the USB transfer, sequence gaps are frames the kernel dropped.
+//   dequeue    capture timestamp to the capture loop picking the frame up
+//   decode     the capture loop picking the frame up to the buffer put to the display
+//   display    the buffer put to the display to the plane update returning
+//   total      capture timestamp to the plane update returning
+//
+// Each is an online histogram of fixed size, reported and cleared every
+// METRICS_REPORT_INTERVAL_NS. The stages from the capture timestamp are only measured when
+// the driver stamps buffers with CLOCK_MONOTONIC.
+
+// In us, exact below 32 us then 32 buckets per power of two (3% wide) up to 16 s, the last
+// bucket also holds anything longer
+#define FRAME_TIMING_SUB_BITS 5
+#define FRAME_TIMING_SUB_BUCKETS (1 << FRAME_TIMING_SUB_BITS)
+#define FRAME_TIMING_MAX_EXPONENT 23
+#define FRAME_TIMING_BUCKETS (FRAME_TIMING_SUB_BUCKETS * (FRAME_TIMING_MAX_EXPONENT - FRAME_TIMING_SUB_BITS + 2))
+
+typedef struct {
+    uint32_t counts[FRAME_TIMING_BUCKETS];
+    uint32_t count;
+    uint64_t max_us;
+} timing_histogram_t;
+
+void timing_histogram_add(timing_histogram_t *histogram, uint64_t value_ns);
+// Middle of the bucket holding the percentile, in us
+uint64_t timing_histogram_percentile(const timing_histogram_t *histogram, uint32_t percent);
+
+// From the capture loop once a frame is decoded. skipped are the frames dropped by the
+// latest frame mode since the previous one, they are not counted as sequence gaps.
+void frame_timing_decoded(int source, uint32_t sequence, uint64_t timestamp_ns, int monotonic, uint32_t skipped, uint64_t dequeued_ns, uint64_t decoded_ns);
+
+// From the display thread once the frame of the source is on screen. capture_ns is 0 when
+// the capture timestamp of the frame is not CLOCK_MONOTONIC.
+void frame_timing_presented(int source, uint64_t capture_ns, uint64_t queued_ns, uint64_t presented_ns);
+
+// From the capture loop, prints and clears the stats once the report interval is over
+void frame_timing_report(int source, const char *name, uint64_t now_ns);
+
+// The stream (re)started, the next frame has no previous one to measure the interval from
+void frame_timing_restart(int source);
+
+#endif
@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "jpeg.h"
 
 #define M_SOF0  0xc0
@@ -57,103 +58,224 @@ static int process_dqt(struct jpeg_t *jpeg, const uint8_t *data, const int len)
 			printf("Only 8bit Quantization Tables supported\n");
 			return 0;
 		}
+		if (pos + 65 > len)
+			return 0;
+
 		jpeg->quant[data[pos] & 0x03] = (struct quant_t *)&(data[pos + 1]);
 	}
 
 	return 1;
 }
 
+// Sum of the 16 code counts of a huffman table, four counts per 32 bit word.
+// Two 16 bit lanes hold at most 8 * 255, so they can't overflow.
+static int huffman_code_count(const uint8_t *num)
+{
+	uint32_t words[4];
+	uint32_t acc = 0;
+	int i;
+
+	memcpy(words, num, sizeof(words));
+
+	for (i = 0; i < 4; i++)
+		acc += (words[i] & 0x00ff00ff) + ((words[i] >> 8) & 0x00ff00ff);
+
+	return (acc & 0xffff) + (acc >> 16);
+}
+
 static int process_dht(struct jpeg_t *jpeg, const uint8_t *data, const int len)
 {
 	int pos = 0;
 
 	while (pos < len)
 	{
+		if ((data[pos] & 0xec) != 0 || pos + 17 > len)
+			return 0;
+
 		uint8_t id = ((data[pos] & 0x03) << 1) | ((data[pos] & 0x10) >> 4);
 
+		int sum = huffman_code_count(&data[pos + 1]);
+
+		// codes[] holds at most 256 symbols
+		if (sum > 256 || pos + 17 + sum > len)
+			return 0;
+
 		jpeg->huffman[id] = (struct huffman_t *)&(data[pos + 1]);
+		pos += 17 + sum;
+	}
+	return 1;
+}
+
+static int process_sof(struct jpeg_t *jpeg, const uint8_t *data, const int len)
+{
+	int i;
+	int seen = 0;
+
+	if (len < 6)
+		return 0;
+
+	uint8_t count = data[5];
 
-		int i;
-		pos += 17;
-		for (i = 0; i < 16; i++)
-			pos += jpeg->huffman[id]->num[i];
+	if (count != 3)
+	{
+		printf("only YCbCr supported\n");
+		return 0;
+	}
+
+	if (len < 6 + 3 * count)
+		return 0;
+
+	jpeg->bits = data[0];
+	jpeg->width = ((uint16_t)data[3]) << 8 | (uint16_t)data[4];
+	jpeg->height = ((uint16_t)data[1]) << 8 | (uint16_t)data[2];
+
+	if (jpeg->bits != 8 || jpeg->width == 0 || jpeg->height == 0)
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		uint8_t id = data[6 + 3 * i] - 1;
+		uint8_t samp = data[7 + 3 * i];
+		uint8_t qt = data[8 + 3 * i];
+
+		if (id > 2)
+		{
+			printf("only YCbCr supported\n");
+			return 0;
+		}
+		// Both sampling factors in 1..4, a factor of 0 borrows into the mask
+		if (((samp - 0x11) & 0xcc) != 0 || qt > 3)
+			return 0;
+
+		seen |= 1 << id;
+		jpeg->comp[id].samp_h = samp >> 4;
+		jpeg->comp[id].samp_v = samp & 0x0f;
+		jpeg->comp[id].qt = qt;
 	}
+
+	// Catches repeated component ids
+	return seen == 0x07;
+}
+
+static int process_sos(struct jpeg_t *jpeg, const uint8_t *data, const int len)
+{
+	int i;
+
+	if (len < 1)
+		return 0;
+
+	uint8_t count = data[0];
+
+	if (count < 1 || count > 3 || len < 4 + 2 * count)
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		// SOF came first and defined all three components
+		uint8_t id = data[1 + 2 * i] - 1;
+		if (id > 2)
+		{
+			printf("only YCbCr supported\n");
+			return 0;
+		}
+
+		uint8_t tables = data[2 + 2 * i];
+
+		// Both table ids 0..3
+		if ((tables & 0xcc) != 0)
+			return 0;
+
+		jpeg->comp[id].ht_dc = tables >> 4;
+		jpeg->comp[id].ht_ac = tables & 0x0f;
+	}
+
+	// The decoder loads the quantization tables of the components, they must all be present
+	for (i = 0; i < 3; i++)
+	{
+		if (!jpeg->quant[jpeg->comp[i].qt])
+			return 0;
+	}
+
 	return 1;
 }
 
+/*
+ * Single pass over the headers up to SOS. Every segment is checked against len
+ * before it is read and tables point into data, so nothing is allocated.
+ * A corrupted frame is rejected instead of being read out of bounds.
+ */
 int parse_jpeg(struct jpeg_t *jpeg, const uint8_t *data, const int len)
 {
-	if (len < 2 || data[0] != 0xff || data[1] != M_SOI)
+	if (len < 4 || data[0] != 0xff || data[1] != M_SOI)
 		return 0;
 
-	int pos = 2;
-	int sos = 0;
-	while (!sos)
+	const uint8_t *pos = &data[2];
+	const uint8_t *end = &data[len];
+	int sof = 0;
+	for (;;)
 	{
-		int i;
+		// Every segment ended before end, so pos is still in the buffer
+		if (*pos != 0xff)
+			return 0;
 
-		while (pos < len && data[pos] == 0xff)
+		// Fill bytes before the marker
+		do
 			pos++;
+		while (end - pos > 2 && *pos == 0xff);
 
-		if (!(pos + 2 < len))
+		// The marker and the segment length
+		if (end - pos <= 2)
 			return 0;
 
-		uint8_t marker = data[pos++];
-		uint16_t seg_len = ((uint16_t)data[pos]) << 8 | (uint16_t)data[pos + 1];
+		uint8_t marker = pos[0];
+		uint16_t seg_len = ((uint16_t)pos[1]) << 8 | (uint16_t)pos[2];
 
-		if (!(pos + seg_len < len))
+		const uint8_t *seg = &pos[3];
+		int seg_data_len = seg_len - 2;
+
+		// The segment is followed by at least one byte. A length below 2 wraps
+		// around, so one compare checks both ends.
+		if ((unsigned int)seg_data_len >= (unsigned int)(end - seg))
 			return 0;
 
+		pos += 1 + seg_len;
+
 		switch (marker)
 		{
 		case M_DQT:
-			if (!process_dqt(jpeg, &data[pos + 2], seg_len - 2))
+			if (!process_dqt(jpeg, seg, seg_data_len))
 				return 0;
 
 			break;
 
 		case M_DHT:
-			if (!process_dht(jpeg, &data[pos + 2], seg_len - 2))
+			if (!process_dht(jpeg, seg, seg_data_len))
 				return 0;
 
 			break;
 
 		case M_SOF0:
-			jpeg->bits = data[pos + 2];
-			jpeg->width = ((uint16_t)data[pos + 5]) << 8 | (uint16_t)data[pos + 6];
-			jpeg->height = ((uint16_t)data[pos + 3]) << 8 | (uint16_t)data[pos + 4];
-			for (i = 0; i < data[pos + 7]; i++)
-			{
-				uint8_t id = data[pos + 8 + 3 * i] - 1;
-				if (id > 2)
-				{
-					fprintf(stderr, "only YCbCr supported\n");
-					return 0;
-				}
-				jpeg->comp[id].samp_h = data[pos + 9 + 3 * i] >> 4;
-				jpeg->comp[id].samp_v = data[pos + 9 + 3 * i] & 0x0f;
-				jpeg->comp[id].qt = data[pos + 10 + 3 * i];
-			}
+			if (sof || !process_sof(jpeg, seg, seg_data_len))
+				return 0;
+
+			sof = 1;
 			break;
 
 		case M_DRI:
-			jpeg->restart_interval = ((uint16_t)data[pos + 2]) << 8 | (uint16_t)data[pos + 3];
+			if (seg_data_len < 2)
+				return 0;
+
+			jpeg->restart_interval = ((uint16_t)seg[0]) << 8 | (uint16_t)seg[1];
 			break;
 
 		case M_SOS:
-			for (i = 0; i < data[pos + 2]; i++)
-			{
-				uint8_t id = data[pos + 3 + 2 * i] - 1;
-				if (id > 2)
-				{
-					fprintf(stderr, "only YCbCr supported\n");
-					return 0;
-				}
-				jpeg->comp[id].ht_dc = data[pos + 4 + 2 * i] >> 4;
-				jpeg->comp[id].ht_ac = data[pos + 4 + 2 * i] & 0x0f;
-			}
-			sos = 1;
-			break;
+			if (!sof || !process_sos(jpeg, seg, seg_data_len))
+				return 0;
+
+			jpeg->data = (uint8_t *)pos;
+			jpeg->data_len = end - pos;
+
+			return 1;
 
 		case M_DAC:
 			printf("Arithmetic Coding unsupported\n");
@@ -183,13 +305,7 @@ int parse_jpeg(struct jpeg_t *jpeg, const uint8_t *data, const int len)
 			//fprintf(stderr, "unknown marker: 0x%02x len: %u\n", marker, seg_len);
 			break;
 		}
-		pos += seg_len;
 	}
-
-	jpeg->data = (uint8_t *)&(data[pos]);
-	jpeg->data_len = len - pos;
-
-	return 1;
 }
 
 void dump_jpeg(const struct jpeg_t *jpeg)
@@ -38,19 +38,22 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "jpeg.h"
 #include "ve.h"
 #include "display.h"
 #include "memory.h"
+#include "jpeg_dec_main.h"
+#include "ve_scheduler.h"
 
 void set_quantization_tables(struct jpeg_t *jpeg, void *regs)
 {
 	int i;
 	for (i = 0; i < 64; i++)
-		writel((uint32_t)(64 + i) << 8 | jpeg->quant[0]->coeff[i], regs + VE_MPEG_IQ_MIN_INPUT);
+		writel((uint32_t)(64 + i) << 8 | jpeg->quant[jpeg->comp[0].qt]->coeff[i], regs + VE_MPEG_IQ_MIN_INPUT);
 	for (i = 0; i < 64; i++)
-		writel((uint32_t)(i) << 8 | jpeg->quant[1]->coeff[i], regs + VE_MPEG_IQ_MIN_INPUT);
+		writel((uint32_t)(i) << 8 | jpeg->quant[jpeg->comp[1].qt]->coeff[i], regs + VE_MPEG_IQ_MIN_INPUT);
 }
 
 void set_huffman_tables(struct jpeg_t *jpeg, void *regs)
@@ -145,58 +148,30 @@ void set_size(struct jpeg_t *jpeg, void *regs)
 	writel((uint32_t)h << 16 | w, regs + VE_MPEG_JPEG_SIZE);
 }
 
-static uint8_t display_initialized = 0;
+// Scale down ratio is at bits 8-9 of SDROT_CTRL (1/2, 1/4, 1/8) according to the
+// reverse engineered register notes. Not yet verified with a board.
+#define VE_MPEG_SDROT_SCALE_HALF (0x1 << 8)
 
-static uint8_t *input_buffer = NULL;
-
-static uint8_t *luma_output = NULL;
-static uint8_t *chroma_u_output = NULL;
-static uint8_t *chroma_v_output = NULL;
-
-static uint8_t *luma_output1 = NULL;
-static uint8_t *chroma_u_output1 = NULL;
-static uint8_t *chroma_v_output1 = NULL;
-
-static uint8_t *luma_output2 = NULL;
-static uint8_t *chroma_u_output2 = NULL;
-static uint8_t *chroma_v_output2 = NULL;
-
-static uint8_t *luma_output3 = NULL;
-static uint8_t *chroma_u_output3 = NULL;
-static uint8_t *chroma_v_output3 = NULL;
-
-static uint8_t *luma_output_virt = NULL;
-static uint8_t *chroma_u_output_virt = NULL;
-static uint8_t *chroma_v_output_virt = NULL;
-
-static uint8_t *luma_output1_virt = NULL;
-static uint8_t *chroma_u_output1_virt = NULL;
-static uint8_t *chroma_v_output1_virt = NULL;
-
-static uint8_t *luma_output2_virt = NULL;
-static uint8_t *chroma_u_output2_virt = NULL;
-static uint8_t *chroma_v_output2_virt = NULL;
-
-static uint8_t *luma_output3_virt = NULL;
-static uint8_t *chroma_u_output3_virt = NULL;
-static uint8_t *chroma_v_output3_virt = NULL;
-
-static uint8_t write_buffer = 0;
-
-static void* ve_regs = NULL;
-
-static uint8_t *phy_input;
+static pthread_mutex_t dma_vaddrs_lock = PTHREAD_MUTEX_INITIALIZER;
+static int active_decoders = 0;
+// Bumped by ve_put_dma_vaddrs, decoders with older mappings map their outputs again
+static uint32_t dma_vaddrs_epoch = 0;
 
 void log_time(struct timespec *a, struct timespec *b) {
 	long deltams = (b->tv_sec * 1000 + b->tv_nsec / 1000000) - (a->tv_sec * 1000 + a->tv_nsec / 1000000);
 	// printf(": Step took %ld ms\n", deltams);
 }
 
-void hw_decode_jpeg(struct jpeg_t *jpeg)
+void hw_decode_jpeg(jpeg_decoder_t *dec, struct jpeg_t *jpeg, void *ve_regs)
 {
 	int width = jpeg->width;
 	int height = jpeg->height;
 
+	uint8_t *luma_output = dec->luma_output[dec->write_buffer];
+	uint8_t *chroma_u_output = dec->chroma_u_output[dec->write_buffer];
+	uint8_t *chroma_v_output = dec->chroma_v_output[dec->write_buffer];
+	uint8_t *phy_input = (uint8_t*) dec->phy_input;
+
 	int v_offset = chroma_v_output - chroma_u_output;
 
 	int result;
@@ -213,6 +188,11 @@ void hw_decode_jpeg(struct jpeg_t *jpeg)
 
 	int input_size =(jpeg->data_len + 65535) & ~65535;
 	int line_stride = ((jpeg->width + 31) & ~31);
+
+	if (dec->tiled) {
+		// Output rows are written into a tile of a larger buffer
+		line_stride = dec->line_stride;
+	}
 	// uint8_t *input_buffer = ve_malloc(input_size);
 	int output_size = line_stride * ((jpeg->height + 31) & ~31);
 	// uint8_t *luma_output = ve_malloc(output_size);
@@ -228,7 +208,7 @@ void hw_decode_jpeg(struct jpeg_t *jpeg)
 	writel(line_stride | (line_stride << 16), ve_regs + 0xc8);
 
 	// activate MPEG engine
-	// void *ve_regs = ve_get(VE_ENGINE_MPEG, 0);
+	// The engine is acquired per frame by hw_decode_jpeg_main
 
 	// set restart interval
 	writel(jpeg->restart_interval, ve_regs + VE_MPEG_JPEG_RES_INT);
@@ -243,8 +223,8 @@ void hw_decode_jpeg(struct jpeg_t *jpeg)
 	// set size
 	set_size(jpeg, ve_regs);
 
-	// ??
-	writel(0x00000000, ve_regs + VE_MPEG_SDROT_CTRL);
+	// Scale down, used for the tiled composition
+	writel(dec->tiled ? VE_MPEG_SDROT_SCALE_HALF : 0x00000000, ve_regs + VE_MPEG_SDROT_CTRL);
 
 	// input end
 	writel((uint32_t)(phy_input + input_size - 1), ve_regs + VE_MPEG_VLD_END);
@@ -278,148 +258,264 @@ void hw_decode_jpeg(struct jpeg_t *jpeg)
 	writel(0x0000c00f, ve_regs + VE_MPEG_STATUS);
 }
 
-void hw_init(int width, int height) {
-	printf("hw_init. %ix%i\n", width, height);
+int hw_init(jpeg_decoder_t *dec, int source, int width, int height) {
+	printf("hw_init. source %i %ix%i\n", source, width, height);
 	fflush(stdout);
-	ve_regs = ve_get(VE_ENGINE_MPEG, 0);
 
-        int input_size = ((width * height * 3) + 65535) & ~65535;
-        input_buffer = ve_malloc(input_size, 1);
+	memset(dec, 0, sizeof(jpeg_decoder_t));
+	dec->source = source;
+	dec->width = width;
+	dec->height = height;
 
-	printf("Input buffer %p\n", input_buffer);
+	dec->input_size = ((width * height * 3) + 65535) & ~65535;
+	dec->input_buffer = ve_malloc(dec->input_size, 1);
+
+	if (dec->input_buffer == NULL) {
+		printf("Can't allocate the %i byte input buffer of source %i\n", dec->input_size, source);
+		fflush(stdout);
+		dec->input_size = 0;
+		return -1;
+	}
+
+	dec->phy_input = ve_virt2phys(dec->input_buffer);
+
+	printf("Input buffer %p\n", dec->input_buffer);
 	fflush(stdout);
+
+	return 0;
 }
 
-void hw_init_display(struct jpeg_t *jpeg) {
-	init_display(jpeg->width, jpeg->height, get_format(jpeg));
+// Points the decoder outputs at the display buffers of the source
+static void hw_map_outputs(jpeg_decoder_t *dec, struct jpeg_t *jpeg) {
+	int i;
+	int source = dec->source;
 
 	printf("Getting outputs\n");
 
-	int dma_fd1 = get_dma_fd1();
-	int dma_fd2 = get_dma_fd2();
-	int dma_fd3 = get_dma_fd3();
+	uint32_t u_offset;
+	uint32_t v_offset;
+	uint32_t tile_luma_offset = 0;
+	uint32_t tile_chroma_offset = 0;
+
+	get_offsets(source, &u_offset, &v_offset);
+
+	dec->tiled = get_tile(source, &tile_luma_offset, &tile_chroma_offset, &dec->line_stride);
+
+	// The planes as laid out by init_display
+	switch (get_format(jpeg)) {
+		case 0x22:
+			dec->chroma_size = (jpeg->width / 2) * (jpeg->height / 2);
+			break;
+		case 0x21:
+			dec->chroma_size = (jpeg->width / 2) * jpeg->height;
+			break;
+		case 0x11:
+			dec->chroma_size = jpeg->width * jpeg->height;
+			break;
+		default:
+			dec->chroma_size = 0;
+			break;
+	}
 
-	printf("Will get dma vaddr\n");
-	fflush(stdout);
+	if (dec->tiled) {
+		dec->chroma_size = 0;
+	}
 
-	void *vaddr1 = ve_get_dma_vaddr(dma_fd1);
-	void *vaddr2 = ve_get_dma_vaddr(dma_fd2);
-	void *vaddr3 = ve_get_dma_vaddr(dma_fd3);
+	dec->luma_offset = tile_luma_offset;
+	dec->chroma_u_offset = u_offset + tile_chroma_offset;
+	dec->chroma_v_offset = v_offset + tile_chroma_offset;
 
-	void *dma_phy1 = vaddr1 - 0xc0000000;
-	void *dma_phy2 = vaddr2 - 0xc0000000;
-	void *dma_phy3 = vaddr3 - 0xc0000000;
+	for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+		uint8_t *virt = get_buffer_map(source, i);
 
-	uint32_t u_offset;
-	uint32_t v_offset;
+		dec->luma_output_virt[i] = virt + dec->luma_offset;
+		dec->chroma_u_output_virt[i] = virt + dec->chroma_u_offset;
+		dec->chroma_v_output_virt[i] = virt + dec->chroma_v_offset;
+	}
 
-	get_offsets(&u_offset, &v_offset);
+	// Mapped in the VE by hw_refresh_mappings, holding the engine
+	dec->outputs_mapped = 0;
 
-	luma_output1 = dma_phy1;
-	chroma_u_output1 = luma_output1 + u_offset;
-	chroma_v_output1 = luma_output1 + v_offset;
+	dec->display_width = jpeg->width;
+	dec->display_height = jpeg->height;
+	dec->display_format = get_format(jpeg);
+	dec->write_buffer = 0;
+}
+
+// The driver only drops the DMA mappings all at once. A decoder that replaced its buffers
+// drops them, then every decoder maps its outputs again before its next decode. Called
+// holding the engine, so no decode writes through a mapping while it is dropped.
+static void hw_refresh_mappings(jpeg_decoder_t *dec) {
+	int i;
+
+	pthread_mutex_lock(&dma_vaddrs_lock);
+
+	if (dec->drop_mappings) {
+		ve_put_dma_vaddrs();
+		dma_vaddrs_epoch++;
+		dec->drop_mappings = 0;
+	}
 
-	luma_output2 = dma_phy2;
-        chroma_u_output2 = luma_output2 + u_offset;
-        chroma_v_output2 = luma_output2 + v_offset;
+	if (!dec->outputs_mapped || dec->mapped_epoch != dma_vaddrs_epoch) {
+		printf("Will get dma vaddr\n");
+		fflush(stdout);
 
-	luma_output3 = dma_phy3;
-        chroma_u_output3 = luma_output3 + u_offset;
-        chroma_v_output3 = luma_output3 + v_offset;
+		for (i = 1; i <= DISPLAY_BUFFER_COUNT; i++) {
+			void *vaddr = ve_get_dma_vaddr(get_dma_fd(dec->source, i));
+			uint8_t *dma_phy = vaddr - 0xc0000000;
 
-	luma_output = NULL;
-	chroma_u_output = NULL;
-	chroma_v_output = NULL;
+			dec->luma_output[i] = dma_phy + dec->luma_offset;
+			dec->chroma_u_output[i] = dma_phy + dec->chroma_u_offset;
+			dec->chroma_v_output[i] = dma_phy + dec->chroma_v_offset;
+		}
 
-	luma_output1_virt = get_buffer_1();
-	chroma_u_output1_virt = luma_output1_virt + u_offset;
-	chroma_v_output1_virt = luma_output1_virt + v_offset;
+		dec->outputs_mapped = 1;
+		dec->mapped_epoch = dma_vaddrs_epoch;
+	}
+
+	pthread_mutex_unlock(&dma_vaddrs_lock);
+}
 
-	luma_output2_virt = get_buffer_2();
-	chroma_u_output2_virt = luma_output2_virt + u_offset;
-	chroma_v_output2_virt = luma_output2_virt + v_offset;
+void hw_init_display(jpeg_decoder_t *dec, struct jpeg_t *jpeg) {
+	init_display(dec->source, jpeg->width, jpeg->height, get_format(jpeg));
 
-	luma_output3_virt = get_buffer_3();
-	chroma_u_output3_virt = luma_output3_virt + u_offset;
-	chroma_v_output3_virt = luma_output3_virt + v_offset;
+	pthread_mutex_lock(&dma_vaddrs_lock);
+	active_decoders++;
+	pthread_mutex_unlock(&dma_vaddrs_lock);
 
-	luma_output_virt = NULL;
-	chroma_u_output_virt = NULL;
-	chroma_v_output_virt = NULL;
+	hw_map_outputs(dec, jpeg);
 
-	display_initialized = 1;
+	dec->display_initialized = 1;
 	printf("Display initialize finished\n");
 }
 
-void hw_close() {
-	ve_put();
-	ve_free(input_buffer);
-	terminate_display();
-	ve_put_dma_vaddrs();
-	deallocate_buffers();
-	display_initialized = 0;
+static void hw_release_display(jpeg_decoder_t *dec) {
+	terminate_display(dec->source);
+
+	// The DMA vaddrs are released all at once, so only do it when no decoder uses them.
+	pthread_mutex_lock(&dma_vaddrs_lock);
+	active_decoders--;
+
+	if (active_decoders == 0) {
+		ve_put_dma_vaddrs();
+		dma_vaddrs_epoch++;
+	}
+
+	pthread_mutex_unlock(&dma_vaddrs_lock);
+
+	deallocate_buffers(dec->source);
+
+	dec->display_initialized = 0;
 }
 
-void get_buffer() {
-	write_buffer = get_buffer_number();
-
-	if (write_buffer == 2) {
-                luma_output = luma_output2;
-                chroma_u_output = chroma_u_output2;
-                chroma_v_output = chroma_v_output2;
-
-                luma_output_virt = luma_output2_virt;
-                chroma_u_output_virt = chroma_u_output2_virt;
-                chroma_v_output_virt = chroma_v_output2_virt;
-	} else if (write_buffer == 3) {
-                luma_output = luma_output3;
-                chroma_u_output = chroma_u_output3;
-                chroma_v_output = chroma_v_output3;
-
-                luma_output_virt = luma_output3_virt;
-                chroma_u_output_virt = chroma_u_output3_virt;
-                chroma_v_output_virt = chroma_v_output3_virt;
-	} else {
-		luma_output = luma_output1;
-		chroma_u_output = chroma_u_output1;
-		chroma_v_output = chroma_v_output1;
-
-                luma_output_virt = luma_output1_virt;
-                chroma_u_output_virt = chroma_u_output1_virt;
-                chroma_v_output_virt = chroma_v_output1_virt;
+// The frame differs from what the display buffers were made for. Returns 0 when the
+// frame has to be skipped.
+static int hw_reconfigure_display(jpeg_decoder_t *dec, struct jpeg_t *jpeg) {
+	int input_size = ((jpeg->width * jpeg->height * 3) + 65535) & ~65535;
+
+	if (input_size > dec->input_size) {
+		ve_free(dec->input_buffer);
+		dec->input_size = input_size;
+		dec->input_buffer = ve_malloc(dec->input_size, 1);
+
+		if (dec->input_buffer == NULL) {
+			dec->input_size = 0;
+			return 0;
+		}
+
+		dec->phy_input = ve_virt2phys(dec->input_buffer);
 	}
+
+	if (dec->tiled) {
+		// The wall is shared with the other sources, this one leaves and joins again
+		hw_release_display(dec);
+		hw_init_display(dec, jpeg);
+		dec->drop_mappings = 1;
+		return 1;
+	}
+
+	if (!reconfigure_display(dec->source, jpeg->width, jpeg->height, get_format(jpeg))) {
+		return 0;
+	}
+
+	hw_map_outputs(dec, jpeg);
+	dec->drop_mappings = 1;
+
+	return 1;
 }
 
-void hw_decode_jpeg_main(uint8_t* data, long dataLen) {
-    struct jpeg_t jpeg;
-	uint8_t *virt_input;
+int hw_matches(jpeg_decoder_t *dec, int width, int height) {
+	return dec->input_buffer != NULL && dec->width == width && dec->height == height;
+}
 
-    memset(&jpeg, 0, sizeof(jpeg));
+void hw_close(jpeg_decoder_t *dec) {
+	ve_free(dec->input_buffer);
+	dec->input_buffer = NULL;
 
-    if (!parse_jpeg(&jpeg, data, dataLen)) {
-        printf("ERROR: Can't parse JPEG\n");
+	if (dec->display_initialized) {
+		hw_release_display(dec);
+	}
+
+	chroma_grade_release(&dec->grade);
+}
+
+void hw_decode_jpeg_main(jpeg_decoder_t *dec, uint8_t* data, long dataLen, uint64_t capture_ns, uint64_t deadline) {
+	struct jpeg_t jpeg;
+	void *ve_regs;
+
+	memset(&jpeg, 0, sizeof(jpeg));
+
+	if (!parse_jpeg(&jpeg, data, dataLen)) {
+		printf("ERROR: Can't parse JPEG\n");
+		return;
+	}
+
+	if (get_format(&jpeg) == 0) {
+		// This frame seems buggy, let's try another one
+		printf("Invalid subsampling found!\n");
 		return;
 	}
 
-	if (!display_initialized) {
-		if (get_format(&jpeg) == 0) {
-			// This frame seems buggy, let's try another one
-			printf("Invalid subsampling found!\n");
+	if (!dec->display_initialized) {
+		hw_init_display(dec, &jpeg);
+	} else if (jpeg.width != dec->display_width || jpeg.height != dec->display_height || get_format(&jpeg) != dec->display_format) {
+		if (!hw_reconfigure_display(dec, &jpeg)) {
 			return;
 		}
+	}
 
-		hw_init_display(&jpeg);
+	if (jpeg.data_len > dec->input_size) {
+		printf("JPEG data too large for input buffer. skipping decode.\n");
+		return;
 	}
 
-	phy_input = (uint8_t*) ve_virt2phys(input_buffer);
-	virt_input = input_buffer;
 	// printf("Will do memcpy dst: %p src: %p len: %i\n", input_buffer, jpeg.data, jpeg.data_len);
 	// fflush(stdout);
-	memcpy(input_buffer, jpeg.data, jpeg.data_len);
+	memcpy(dec->input_buffer, jpeg.data, jpeg.data_len);
+
+	ve_flush_cache(dec->input_buffer, jpeg.data_len);
+
+	dec->write_buffer = get_buffer_number(dec->source);
+
+	if (dec->write_buffer == 0) {
+		return;
+	}
+
+	// Hold the engine only for the decode itself, other cameras are waiting for it.
+	ve_regs = ve_sched_acquire(dec->source, deadline);
+
+	if (ve_regs == NULL) {
+		put_buffer(dec->source, dec->write_buffer, 0);
+		return;
+	}
+
+	hw_refresh_mappings(dec);
+
+	hw_decode_jpeg(dec, &jpeg, ve_regs);
+	ve_sched_release();
 
-	ve_flush_cache(virt_input, jpeg.data_len);
+	// On the CPU once the engine is free for the other cameras
+	chroma_grade_apply(&dec->grade, dec->source, dec->chroma_u_output_virt[dec->write_buffer], dec->chroma_v_output_virt[dec->write_buffer], dec->chroma_size);
 
-	get_buffer();
-    hw_decode_jpeg(&jpeg);
-	put_buffer(write_buffer);
+	put_buffer(dec->source, dec->write_buffer, capture_ns);
 }
@@ -3,8 +3,62 @@
 
 #include <inttypes.h>
 
-void hw_decode_jpeg_main(uint8_t* data, long dataLen);
-void hw_init(int width, int height);
-void hw_close();
+#include "display.h"
+#include "chroma_grade.h"
+
+typedef struct {
+    int source;
+    uint8_t display_initialized;
+
+    // Capture size the buffers were made for
+    int width;
+    int height;
+
+    // Frame format the display buffers were made for, checked on every frame
+    int display_width;
+    int display_height;
+    uint8_t display_format;
+
+    uint8_t *input_buffer;
+    uint32_t phy_input;
+    int input_size;
+
+    // Indexed by display buffer number (1 based)
+    uint8_t *luma_output[DISPLAY_BUFFER_COUNT + 1];
+    uint8_t *chroma_u_output[DISPLAY_BUFFER_COUNT + 1];
+    uint8_t *chroma_v_output[DISPLAY_BUFFER_COUNT + 1];
+
+    uint8_t *luma_output_virt[DISPLAY_BUFFER_COUNT + 1];
+    uint8_t *chroma_u_output_virt[DISPLAY_BUFFER_COUNT + 1];
+    uint8_t *chroma_v_output_virt[DISPLAY_BUFFER_COUNT + 1];
+
+    // Offsets of the planes in the display buffers, the outputs are mapped in the VE from
+    // these on the first decode and again after the mappings were dropped
+    uint32_t luma_offset;
+    uint32_t chroma_u_offset;
+    uint32_t chroma_v_offset;
+    uint8_t outputs_mapped;
+    uint32_t mapped_epoch;
+    // The buffer set was replaced, its VE mappings are dropped before the next decode
+    uint8_t drop_mappings;
+
+    // Set when decoding downscaled into a tile of the shared wall buffer
+    uint8_t tiled;
+    uint32_t line_stride;
+
+    // Samples in each chroma plane, 0 when tiled as the tile is not a whole plane
+    uint32_t chroma_size;
+    chroma_grade_t grade;
+
+    uint8_t write_buffer;
+} jpeg_decoder_t;
+
+void hw_decode_jpeg_main(jpeg_decoder_t *dec, uint8_t* data, long dataLen, uint64_t capture_ns, uint64_t deadline);
+// Returns 0 on success, -1 when the VE input buffer can't be allocated
+int hw_init(jpeg_decoder_t *dec, int source, int width, int height);
+void hw_close(jpeg_decoder_t *dec);
+
+// Whether the decoder was set up for this size and can be kept across a reconnect
+int hw_matches(jpeg_decoder_t *dec, int width, int height);
 
 #endif
@@ -14,6 +14,9 @@
 #include <linux/videodev2.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "main.h"
 #include "display.h"
@@ -21,25 +24,87 @@
 #include "device.h"
 #include "control-file.h"
 #include "cec_controls.h"
+#include "cec_transport.h"
+#include "control_socket.h"
+#include "presets.h"
 #include "ve.h"
+#include "ve_scheduler.h"
+#include "metrics.h"
+#include "frame_timing.h"
+#include "capture.h"
 
 #define SLEEP_LARGE_SECONDS 5
-#define CAPTURE_BUFFER_COUNT 3
+#define MAX_CAMERAS VE_SCHED_MAX_SLOTS
+
+// Changes are written to the control file this long after the first one, batching bursts
+#define CONTROL_WRITE_DELAY_MS 2000
+#define CONTROL_MAX_EVENTS 8
+
+// A stream with no frame for this many frame intervals is restarted, the first frame after
+// STREAMON gets at least CAPTURE_WATCHDOG_MIN_MS. After CAPTURE_MAX_RESTARTS restarts in a
+// row without a frame the device is reopened.
+#define CAPTURE_WATCHDOG_FRAMES 10
+#define CAPTURE_WATCHDOG_MIN_MS 2000
+#define CAPTURE_MAX_RESTARTS 2
+#define CAPTURE_MAX_EVENTS 2
+
+// Returned by capture_loop when the stream never started. The device is then reopened after
+// CAPTURE_START_BACKOFF_MS, doubled on each failure in a row up to CAPTURE_START_MAX_BACKOFF_MS.
+#define CAPTURE_START_FAILED ((void*)1)
+#define CAPTURE_START_BACKOFF_MS (SLEEP_LARGE_SECONDS * 1000)
+#define CAPTURE_START_MAX_BACKOFF_MS 60000
+
+typedef struct {
+    int index;
+
+    capture_source_t capture;
+
+    jpeg_decoder_t decoder;
+    camera_metrics_t metrics;
+
+    // When the camera came back after a disconnect, 0 otherwise. Cleared by the first frame.
+    uint64_t resume_from_ns;
+
+    int capture_loop_run;
+    int control_loop_run;
+    // Wake the loops when they have to stop
+    int capture_wake_fd;
+    int control_wake_fd;
+
+    // Stream restarts by the frame watchdog
+    uint32_t capture_restarts;
+
+    pthread_t device_thread_id;
+    pthread_t capture_thread_id;
+    pthread_t control_thread_id;
+} camera_t;
 
 static int device_loop_run = 0;
-static int capture_loop_run = 0;
-static int control_loop_run = 0;
 
-static video_device_t video_device;
+// Decode only the newest ready frame, older ones are requeued right away
+static int latest_frame_mode = 0;
 
-static struct v4l2_format current_format;
-static struct v4l2_fmtdesc current_format_desc;
+static camera_t cameras[MAX_CAMERAS];
+static int camera_count = 0;
 
-static void *buffer_memory_map[CAPTURE_BUFFER_COUNT];
-static unsigned int buffer_memory_map_size[CAPTURE_BUFFER_COUNT];
+static void wake(int fd) {
+    uint64_t one = 1;
 
-static pthread_t capture_thread_id;
-static pthread_t control_thread_id;
+    if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+        // Nothing to do, the counter is already non zero
+    }
+}
+
+// Also called from the signal handler, eventfd writes are async signal safe
+static void stop_control_loop(camera_t *camera) {
+    camera->control_loop_run = 0;
+    wake(camera->control_wake_fd);
+}
+
+static void stop_capture_loop(camera_t *camera) {
+    camera->capture_loop_run = 0;
+    wake(camera->capture_wake_fd);
+}
 
 void signal_callback_handler(int signum)
 {
@@ -50,67 +115,201 @@ void signal_callback_handler(int signum)
 		case SIGINT:
 			/* Terminate program */
 			device_loop_run = 0;
-            capture_loop_run = 0;
-            control_loop_run = 0;
+
+            for (int i = 0; i < camera_count; i++) {
+                stop_capture_loop(&cameras[i]);
+                stop_control_loop(&cameras[i]);
+            }
 			break;
 
 	}
 }
 
-void* capture_loop(void* args) {
-    enum v4l2_buf_type buffer_type = current_format_desc.type;
+static void epoll_watch(int epoll_fd, int fd) {
+    struct epoll_event event;
 
-    printf("Enabling stream\n");
-    fflush(stdout);
+    if (fd < 0) {
+        return;
+    }
 
-    if (ioctl(video_device.device_file, VIDIOC_STREAMON, &buffer_type) != 0) {
-        printf("Failed to enable stream: %s\n", strerror(errno));
-        fflush(stdout);
-        capture_loop_run = 0;
-        control_loop_run = 0;
-        return 0;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        printf("Failed to watch fd %i: %s\n", fd, strerror(errno));
     }
+}
+
+// A slow first frame after STREAMON is normal, UVC cameras settle exposure first
+static int watchdog_timeout_ms(camera_t *camera, int streaming) {
+    int timeout_ms = camera->capture.frame_interval_ns * CAPTURE_WATCHDOG_FRAMES / 1000000ULL;
+
+    if (!streaming || timeout_ms <= 0) {
+        timeout_ms = timeout_ms > CAPTURE_WATCHDOG_MIN_MS ? timeout_ms : CAPTURE_WATCHDOG_MIN_MS;
+    }
+
+    return timeout_ms;
+}
 
-    while (capture_loop_run) {
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
+// Waits for a frame, restarting the stream when none comes. streaming is set once a frame
+// arrived since the last STREAMON. 0 with a frame, -1 when the loop has to end.
+static int wait_frame(camera_t *camera, int epoll_fd, int *streaming, capture_frame_t *frame) {
+    struct epoll_event events[CAPTURE_MAX_EVENTS];
+    int restarts = 0;
+    uint64_t count;
 
-        buf.type = buffer_type;
+    while (camera->capture_loop_run) {
+        int result = capture_dequeue(&camera->capture, frame);
+
+        if (result != CAPTURE_AGAIN) {
+            *streaming |= result == 0;
+            return result;
+        }
+
+        int timeout_ms = watchdog_timeout_ms(camera, *streaming);
+        int n = epoll_wait(epoll_fd, events, CAPTURE_MAX_EVENTS, timeout_ms);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        if (ioctl(video_device.device_file, VIDIOC_DQBUF, &buf) == 0) {
-            hw_decode_jpeg_main(buffer_memory_map[buf.index], buf.bytesused);
+            printf("Capture loop epoll failed: %s\n", strerror(errno));
+            return -1;
+        }
 
-            if (ioctl(video_device.device_file, VIDIOC_QBUF, &buf) != 0) {
-                printf("VIDIOC_QBUF Failed: %s\n", strerror(errno));
+        if (n == 0) {
+            if (restarts == CAPTURE_MAX_RESTARTS) {
+                printf("%s: no frame after %i stream restarts, reopening the device\n", camera->capture.path, restarts);
                 fflush(stdout);
+                return -1;
+            }
+
+            printf("%s: no frame for %i ms, restarting the stream\n", camera->capture.path, timeout_ms);
+            fflush(stdout);
+
+            restarts++;
+            camera->capture_restarts++;
+            *streaming = 0;
+
+            if (capture_restart(&camera->capture) != 0) {
+                return -1;
+            }
+
+            frame_timing_restart(camera->index);
+
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == camera->capture_wake_fd && read(camera->capture_wake_fd, &count, sizeof(count)) < 0) {
+                // Already drained
             }
-        } else {
-            printf("VIDIOC_DQBUF Failed: %s\n", strerror(errno));
+        }
+    }
+
+    return -1;
+}
+
+void* capture_loop(void* args) {
+    camera_t *camera = (camera_t*) args;
+    capture_frame_t frame;
+    uint64_t dequeued_at;
+    uint64_t decoded_at;
+    int streaming = 0;
+    int skipped = 0;
+
+    if (capture_start(&camera->capture) != 0) {
+        camera->capture_loop_run = 0;
+        stop_control_loop(camera);
+        return CAPTURE_START_FAILED;
+    }
+
+    metrics_reset(&camera->metrics);
+    frame_timing_restart(camera->index);
+    set_source_streaming(camera->index, 1);
+
+    // Sources without an fd block in dequeue and never get here with CAPTURE_AGAIN
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    epoll_watch(epoll_fd, capture_event_fd(&camera->capture));
+    epoll_watch(epoll_fd, camera->capture_wake_fd);
+
+    while (camera->capture_loop_run) {
+        if (wait_frame(camera, epoll_fd, &streaming, &frame) != 0) {
+            break;
+        }
+
+        if (latest_frame_mode) {
+            skipped = capture_drain(&camera->capture, &frame);
+
+            if (skipped < 0) {
+                break;
+            }
+
+            metrics_stale(&camera->metrics, skipped);
+        }
+
+        dequeued_at = ve_sched_now_ns();
+
+        hw_decode_jpeg_main(&camera->decoder, frame.data, frame.length, frame.monotonic ? frame.timestamp_ns : 0, dequeued_at + camera->capture.frame_interval_ns);
+
+        decoded_at = ve_sched_now_ns();
+
+        metrics_frame(&camera->metrics, camera->capture.path, dequeued_at, decoded_at);
+        frame_timing_decoded(camera->index, frame.sequence, frame.timestamp_ns, frame.monotonic, skipped, dequeued_at, decoded_at);
+        frame_timing_report(camera->index, camera->capture.path, decoded_at);
+
+        if (camera->resume_from_ns) {
+            printf("%s resumed, first frame %llu ms after the device came back\n",
+                camera->capture.path, (unsigned long long)(ve_sched_now_ns() - camera->resume_from_ns) / 1000000ULL);
             fflush(stdout);
+            camera->resume_from_ns = 0;
+        }
 
-            capture_loop_run = 0;
-            control_loop_run = 0;
+        if (capture_requeue(&camera->capture, &frame) != 0) {
+            break;
         }
     }
 
-    if (ioctl(video_device.device_file, VIDIOC_STREAMOFF, &buffer_type) != 0) {
-        printf("STREAMOFF failed: %s\n", strerror(errno));
+    camera->capture_loop_run = 0;
+    stop_control_loop(camera);
+    set_source_streaming(camera->index, 0);
+
+    if (camera->capture_restarts) {
+        printf("%s capture stopped, %u stream restarts so far\n", camera->capture.path, camera->capture_restarts);
         fflush(stdout);
     }
+
+    close(epoll_fd);
+    capture_stop(&camera->capture);
+
+    return 0;
 }
 
+// Sleeps until the control file changes, a CEC message or socket command arrives, the write timer fires or it is stopped.
 void* control_loop(void* args) {
+    camera_t *camera = (camera_t*) args;
+    video_device_t *video_device = capture_video_device(&camera->capture);
+    struct epoll_event events[CONTROL_MAX_EVENTS];
+    struct itimerspec write_delay;
     int has_changes = 0;
-    int loop_count = 0;
+    int write_pending = 0;
     int changes_loaded = 0;
+    int needs_write = 0;
+    uint64_t count;
+
+    presets_load();
 
     printf("Loading control file\n");
     fflush(stdout);
-    load_file_controls(&video_device, &has_changes);
+    load_file_controls(video_device, &has_changes, &needs_write);
 
-    write_file_controls(&video_device);
+    write_file_controls(video_device);
+    has_changes = 0;
 
-    start_inotify_control_file();
+    int inotify_fd = start_inotify_control_file();
 
     printf("Calling inotify_poll\n");
     fflush(stdout);
@@ -120,244 +319,338 @@ void* control_loop(void* args) {
     printf("finished inotify_poll\n");
     fflush(stdout);
 
-    while (control_loop_run) {
-        changes_loaded = 0;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int cec_fd = cec_controls_event_fd();
+    int socket_fd = control_socket_start(video_device);
+    // Sets rate limited control values once they are due
+    int flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec flush_at;
+
+    epoll_watch(epoll_fd, inotify_fd);
+    epoll_watch(epoll_fd, cec_fd);
+    epoll_watch(epoll_fd, socket_fd);
+    epoll_watch(epoll_fd, flush_fd);
+    epoll_watch(epoll_fd, timer_fd);
+    epoll_watch(epoll_fd, camera->control_wake_fd);
+
+    // Messages queued before the loop started
+    has_changes |= poll_cec_events(video_device);
+
+    while (camera->control_loop_run) {
+        if (has_changes && !write_pending) {
+            memset(&write_delay, 0, sizeof(write_delay));
+            write_delay.it_value.tv_sec = CONTROL_WRITE_DELAY_MS / 1000;
+            write_delay.it_value.tv_nsec = (CONTROL_WRITE_DELAY_MS % 1000) * 1000000L;
+
+            timerfd_settime(timer_fd, 0, &write_delay, NULL);
+            write_pending = 1;
+        }
+
+        uint64_t next_flush = control_catalog_next_flush_ns(&video_device->controls);
+
+        if (next_flush != 0) {
+            memset(&flush_at, 0, sizeof(flush_at));
+            flush_at.it_value.tv_sec = next_flush / 1000000000ULL;
+            flush_at.it_value.tv_nsec = next_flush % 1000000000ULL;
 
-        if (inotify_poll() > 0) {
-            load_file_controls(&video_device, &changes_loaded);
+            timerfd_settime(flush_fd, TFD_TIMER_ABSTIME, &flush_at, NULL);
         }
 
-        has_changes |= changes_loaded;
-        has_changes |= poll_cec_events(&video_device);
+        int n = epoll_wait(epoll_fd, events, CONTROL_MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            printf("Control loop epoll failed: %s\n", strerror(errno));
+            break;
+        }
 
-        if (has_changes) {
-            loop_count++;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
 
-            if (loop_count > 20) {
-                write_file_controls(&video_device);
-                has_changes = 0;
-                loop_count = 0;
+            if (fd == inotify_fd) {
+                if (inotify_poll() > 0) {
+                    load_file_controls(video_device, &changes_loaded, &needs_write);
+                    has_changes |= changes_loaded || needs_write;
+                }
+            } else if (fd == cec_fd) {
+                has_changes |= poll_cec_events(video_device);
+            } else if (fd == socket_fd) {
+                has_changes |= control_socket_poll(video_device);
+            } else if (fd == flush_fd) {
+                if (read(flush_fd, &count, sizeof(count)) > 0) {
+                    has_changes |= control_catalog_flush(&video_device->controls, video_device->device_file) > 0;
+                }
+            } else if (fd == timer_fd) {
+                if (read(timer_fd, &count, sizeof(count)) > 0) {
+                    write_file_controls(video_device);
+                    has_changes = 0;
+                    write_pending = 0;
+                }
+            } else if (fd == camera->control_wake_fd) {
+                if (read(camera->control_wake_fd, &count, sizeof(count)) < 0) {
+                    // Already drained
+                }
             }
         }
 
-        usleep(100000);
+        control_socket_publish(video_device);
     }
 
     if (has_changes) {
-        write_file_controls(&video_device);
+        write_file_controls(video_device);
     }
 
-    stop_inotify_control_file();
-}
+    printf("Control updates: %u submitted, %u applied, %u coalesced\n",
+        video_device->controls.submitted,
+        video_device->controls.applied,
+        video_device->controls.coalesced
+    );
+    fflush(stdout);
 
-int main(int argc, char *argv[])
-{
+    close(timer_fd);
+    close(flush_fd);
+    close(epoll_fd);
 
-    printf("Starting camview\n");
+    control_socket_stop();
 
-    signal(SIGINT, signal_callback_handler);
+    stop_inotify_control_file();
+    release_file_controls();
 
-    start_drm();
-    ve_open();
+    return 0;
+}
 
-    device_loop_run = 1;
+// A camera that drops out keeps its decoder, so the VE input buffer and the display buffers
+// survive and the last frame stays on screen. The device node is watched and streaming
+// resumes as soon as it is back, the pipeline is only rebuilt when the size changed.
+void* device_loop(void *args) {
+    camera_t *camera = (camera_t*) args;
+    int connected_before = 0;
+    int start_backoff_ms = CAPTURE_START_BACKOFF_MS;
+    void *capture_status;
 
-    while (device_loop_run) {
-        fflush(stdout);
-        sleep(SLEEP_LARGE_SECONDS);
+    // The control file and CEC are bound to the first camera only, when it has device controls.
+    int has_controls = camera->index == 0 && capture_video_device(&camera->capture) != NULL;
 
-        printf("Opening video device\n");
+    // CEC does not depend on the camera, it stays up across reconnects
+    if (has_controls) {
+        printf("Try init CEC controls\n");
         fflush(stdout);
+        init_cec_controls();
+    }
 
-        video_device.device_file = open("/dev/video0", O_RDWR);
+    fflush(stdout);
+    sleep(SLEEP_LARGE_SECONDS);
+
+    while (device_loop_run) {
+        uint64_t open_at = ve_sched_now_ns();
 
-        if (video_device.device_file == -1) {
-            printf("Failed opening video device: %s\n", strerror(errno));
-            sleep(SLEEP_LARGE_SECONDS);
+        if (capture_open(&camera->capture) != 0) {
+            // Bounded, so a stop request is noticed
+            capture_wait(&camera->capture, SLEEP_LARGE_SECONDS * 1000);
             continue;
         }
 
-        memset(&current_format_desc, 0, sizeof(current_format_desc));
-        current_format_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-        int found_format_desc = 0;
-
-        while (1) {
-            int result = ioctl(video_device.device_file, VIDIOC_ENUM_FMT, &current_format_desc);
-            if (result == 0) {
-                if (current_format_desc.pixelformat == V4L2_PIX_FMT_MJPEG) {
-                    found_format_desc = 1;
-                    break;
-                }
-                printf("Found format desc type: %s\n", current_format_desc.description);
-            } else {
-                result = errno;
-
-                if (result != EINVAL) {
-                    printf("Failed enumerating formats: %s", strerror(result));
-                }
-                break;
+        if (!hw_matches(&camera->decoder, camera->capture.width, camera->capture.height)) {
+            if (camera->decoder.input_buffer != NULL) {
+                printf("%s size changed, rebuilding the decoder\n", camera->capture.path);
+                hw_close(&camera->decoder);
             }
 
-            current_format_desc.index++;
-        }
-
-        if (!found_format_desc) {
-            printf("Cannot find MJPEG format.\n");
-            fflush(stdout);
-            close(video_device.device_file);
-            continue;
+            if (hw_init(&camera->decoder, camera->index, camera->capture.width, camera->capture.height) != 0) {
+                capture_close(&camera->capture);
+                capture_wait(&camera->capture, SLEEP_LARGE_SECONDS * 1000);
+                continue;
+            }
         }
 
-        printf("Setting format\n");
-        fflush(stdout);
+        camera->resume_from_ns = connected_before ? open_at : 0;
+        camera->capture_loop_run = 1;
+        camera->control_loop_run = has_controls;
 
-        current_format.type = current_format_desc.type;
-        current_format.fmt.pix.pixelformat = current_format_desc.type;
-        current_format.fmt.pix.width  = 1920;
-        current_format.fmt.pix.height = 1080;
-        current_format.fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+        pthread_create(&camera->capture_thread_id, 0, capture_loop, camera);
 
-        if (ioctl(video_device.device_file, VIDIOC_S_FMT, &current_format) != 0) {
-            printf("Failed setting device video format: %s\n", strerror(errno));
+        if (has_controls) {
+            pthread_create(&camera->control_thread_id, 0, control_loop, camera);
         }
 
-        printf("Getting format\n");
+        printf("Threads started for %s\n", camera->capture.path);
         fflush(stdout);
 
-        if (ioctl(video_device.device_file, VIDIOC_G_FMT, &current_format) != 0) {
-            printf("Failed getting device video format: %s\n", strerror(errno));
-            close(video_device.device_file);
-            continue;
-        }
+        // The capture loop ends on shutdown or when the camera is gone, it stops the control
+        // loop as it leaves. Both wake from their epoll on the eventfds, no cancel is needed.
+        pthread_join(camera->capture_thread_id, &capture_status);
 
-        if (current_format.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
-            printf("Fail: device does not output to MJPEG.\n");
-            close(video_device.device_file);
-            continue;
+        if (has_controls) {
+            pthread_join(camera->control_thread_id, 0);
         }
 
-        struct v4l2_requestbuffers req;
-        memset(&req, 0, sizeof(req));//setting the buffer count as 1
-        req.count  = CAPTURE_BUFFER_COUNT;
-        req.type   = current_format_desc.type;//use the mmap for mapping the buffer
-        req.memory = V4L2_MEMORY_MMAP;
+        capture_close(&camera->capture);
 
-        printf("Requesting Buffers\n");
-        fflush(stdout);
+        // The device opens but does not stream (busy, or no bandwidth left at any mode).
+        // Reopening at once would redo the negotiation and restart the control loop nonstop.
+        if (capture_status == CAPTURE_START_FAILED) {
+            printf("%s failed to start streaming, retrying in %i s\n", camera->capture.path, start_backoff_ms / 1000);
+            fflush(stdout);
 
-        if (ioctl(video_device.device_file, VIDIOC_REQBUFS, &req) != 0) {
-            printf("Failed to request buffers: %s\n", strerror(errno));
-            close(video_device.device_file);
-            continue;
-        }
+            // Bounded, so a stop request is noticed
+            for (int waited = 0; waited < start_backoff_ms && device_loop_run; waited += SLEEP_LARGE_SECONDS * 1000) {
+                uint64_t wait_from = capture_now_ns();
 
-        printf("Querying Buffers\n");
-        fflush(stdout);
+                capture_wait(&camera->capture, SLEEP_LARGE_SECONDS * 1000);
 
-        int has_buffer_mapped = 0;
-
-        for (int i = 0; i < CAPTURE_BUFFER_COUNT; i++) {
-            struct v4l2_buffer buf;
-            memset(&buf, 0, sizeof(buf));
-            buf.type = req.type;
-            buf.memory = req.memory;
-            buf.index = i;
-
-            if (ioctl(video_device.device_file, VIDIOC_QUERYBUF, &buf) == 0) {
-                buffer_memory_map[i] = mmap(NULL /* start anywhere */,
-                    buf.length,
-                    PROT_READ | PROT_WRITE /* required */,
-                    MAP_SHARED /* recommended */,
-                    video_device.device_file,
-                    buf.m.offset
-                );
-
-                if (buffer_memory_map[i] == MAP_FAILED) {
+                // Woken early by a change to the device node, it is worth trying now
+                if (capture_now_ns() - wait_from < SLEEP_LARGE_SECONDS * 1000000000ULL) {
                     break;
                 }
+            }
 
-                buffer_memory_map_size[i] = buf.length;
+            start_backoff_ms *= 2;
 
-                if (ioctl(video_device.device_file, VIDIOC_QBUF, &buf) == 0) {
-                    has_buffer_mapped = 1;
-                } else {
-                    printf("Failed to QBUF #%i: %s\n", i, strerror(errno));
-                    break;
-                }
-            } else {
-                buffer_memory_map[i] = MAP_FAILED;
-                buffer_memory_map_size[i] = 0;
-                printf("Failed to query video buffer #%i: %s\n", i, strerror(errno));
-                break;
+            if (start_backoff_ms > CAPTURE_START_MAX_BACKOFF_MS) {
+                start_backoff_ms = CAPTURE_START_MAX_BACKOFF_MS;
             }
-        }
 
-        if (!has_buffer_mapped) {
-            printf("No buffers where mapped. will retry opening device.");
-            close(video_device.device_file);
             continue;
         }
 
-        printf("Try init CEC controls\n");
-        fflush(stdout);
-        init_cec_controls();
+        start_backoff_ms = CAPTURE_START_BACKOFF_MS;
+        connected_before = 1;
 
-        hw_init(current_format.fmt.pix.width, current_format.fmt.pix.height);
+        if (device_loop_run) {
+            printf("%s lost, keeping the last frame until it is back\n", camera->capture.path);
+            fflush(stdout);
+        }
+    }
 
-        capture_loop_run = 1;
-        control_loop_run = 1;
+    hw_close(&camera->decoder);
 
-        pthread_create(&capture_thread_id, 0, capture_loop, 0);
-        pthread_create(&control_thread_id, 0, control_loop, 0);
+    if (has_controls) {
+        stop_cec_controls();
+    }
 
-        printf("Threads started\n");
-        fflush(stdout);
+    return 0;
+}
 
-        struct timespec ts;
+void print_usage(const char *name) {
+    printf("Usage: %s [-d] [-a active_camera] [-l single|quad|pip] [-r control_rate] [-c cec_adapter] [-s WIDTHxHEIGHT] [-f max|display] [-b buffers] [-L] [video_device|replay:file[@fps]...]\n", name);
+    printf("  -d  Use deadline ordering to share the VE between cameras (default is round robin)\n");
+    printf("  -a  Index of the camera shown on the display (default 0)\n");
+    printf("  -l  Monitor wall layout for multiple cameras (default single)\n");
+    printf("  -r  Updates per second a camera control is set at most, bursts keep the latest value (default %i, 0 unlimited)\n", CONTROL_CATALOG_DEFAULT_MAX_RATE);
+    printf("  -c  CEC adapter, a /dev/cecN node or replay:file to play back recorded CEC traffic (default %s)\n", CEC_DEFAULT_ADAPTER);
+    printf("  -s  Capture size, the largest MJPEG size inside it when the camera has no exact match (default %ix%i)\n", CAPTURE_MODE_DEFAULT_WIDTH, CAPTURE_MODE_DEFAULT_HEIGHT);
+    printf("  -f  Capture frame rate, the highest (max) or the highest the display refresh rate is a multiple of (display). Default max\n");
+    printf("  -b  Capture buffers requested from the driver, 1 to %i (default %i)\n", CAPTURE_MAX_BUFFER_COUNT, CAPTURE_DEFAULT_BUFFER_COUNT);
+    printf("  -L  Latest frame mode, frames that queued up while decoding are skipped\n");
+    printf("  replay:file@fps replays MJPEG or AVI/MJPEG files, '-' reads stdin. fps 0 runs as fast as possible\n");
+    fflush(stdout);
+}
 
-        while (1) {
-            usleep(100000);
+int main(int argc, char *argv[])
+{
+    int opt;
+    int sched_policy = VE_SCHED_ROUND_ROBIN;
+    int active_camera = 0;
+    int layout = DISPLAY_LAYOUT_SINGLE;
+    int mode_policy = CAPTURE_MODE_MAX_FPS;
+    uint32_t capture_width = CAPTURE_MODE_DEFAULT_WIDTH;
+    uint32_t capture_height = CAPTURE_MODE_DEFAULT_HEIGHT;
+    int buffer_count = CAPTURE_DEFAULT_BUFFER_COUNT;
 
-            if (capture_loop_run == 0 && control_loop_run == 0) {
-                clock_gettime(CLOCK_REALTIME, &ts);
+    printf("Starting camview\n");
 
-                ts.tv_sec += 2;
-                ts.tv_nsec = 0;
+    while ((opt = getopt(argc, argv, "da:l:r:c:s:f:b:Lh")) != -1) {
+        switch (opt) {
+            case 'd':
+                sched_policy = VE_SCHED_DEADLINE;
+                break;
+            case 'a':
+                active_camera = atoi(optarg);
+                break;
+            case 'l':
+                if (strcmp(optarg, "quad") == 0) {
+                    layout = DISPLAY_LAYOUT_QUAD;
+                } else if (strcmp(optarg, "pip") == 0) {
+                    layout = DISPLAY_LAYOUT_PIP;
+                } else {
+                    layout = DISPLAY_LAYOUT_SINGLE;
+                }
+                break;
+            case 'r':
+                control_catalog_set_max_rate(atoi(optarg));
+                break;
+            case 'c':
+                cec_controls_set_adapter(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%ux%u", &capture_width, &capture_height) != 2) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'f':
+                mode_policy = strcmp(optarg, "display") == 0 ? CAPTURE_MODE_DISPLAY_RATE : CAPTURE_MODE_MAX_FPS;
+                break;
+            case 'b':
+                buffer_count = atoi(optarg);
 
-                if (pthread_timedjoin_np(capture_thread_id, 0, &ts) != 0) {
-                    printf("Canceling capture thread...\n");
-                    fflush(stdout);
-                    pthread_cancel(capture_thread_id);
+                if (buffer_count < 1 || buffer_count > CAPTURE_MAX_BUFFER_COUNT) {
+                    print_usage(argv[0]);
+                    return 1;
                 }
+                break;
+            case 'L':
+                latest_frame_mode = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
 
-                clock_gettime(CLOCK_REALTIME, &ts);
+    for (int i = optind; i < argc && camera_count < MAX_CAMERAS; i++) {
+        capture_init(&cameras[camera_count].capture, argv[i]);
+        camera_count++;
+    }
 
-                ts.tv_sec += 2;
-                ts.tv_nsec = 0;
+    if (optind + camera_count < argc) {
+        printf("Only %i cameras are supported, ignoring the remaining devices\n", MAX_CAMERAS);
+    }
 
-                if (pthread_timedjoin_np(control_thread_id, 0, &ts) != 0) {
-                    printf("Canceling control thread...\n");
-                    fflush(stdout);
-                    pthread_cancel(control_thread_id);
-                }
+    if (camera_count == 0) {
+        capture_init(&cameras[0].capture, "/dev/video0");
+        camera_count = 1;
+    }
 
-                break;
-            }
-        }
+    for (int i = 0; i < camera_count; i++) {
+        cameras[i].capture.buffer_count = buffer_count;
+        cameras[i].capture_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        cameras[i].control_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
 
-        for (int i = 0; i < CAPTURE_BUFFER_COUNT; i++) {
-            if (buffer_memory_map[i] != MAP_FAILED) {
-                munmap(buffer_memory_map[i], buffer_memory_map_size[i]);
-                buffer_memory_map[i] = MAP_FAILED;
-                buffer_memory_map_size[i] = 0;
-            }
-        }
+    signal(SIGINT, signal_callback_handler);
 
-        close(video_device.device_file);
-        hw_close();
+    start_drm();
+    capture_mode_set_policy(mode_policy, capture_width, capture_height, get_display_refresh_rate());
+    ve_open();
+    ve_sched_init(sched_policy);
 
-        stop_cec_controls();
+    set_active_source(active_camera < camera_count ? active_camera : 0);
+    set_display_layout(camera_count > 1 ? layout : DISPLAY_LAYOUT_SINGLE, camera_count);
+
+    device_loop_run = 1;
+
+    for (int i = 0; i < camera_count; i++) {
+        cameras[i].index = i;
+        pthread_create(&cameras[i].device_thread_id, 0, device_loop, &cameras[i]);
+    }
+
+    for (int i = 0; i < camera_count; i++) {
+        pthread_join(cameras[i].device_thread_id, 0);
     }
 
     stop_drm();
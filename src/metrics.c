@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+void metrics_reset(camera_metrics_t *metrics) {
+	memset(metrics, 0, sizeof(camera_metrics_t));
+}
+
+void metrics_frame(camera_metrics_t *metrics, const char *name, uint64_t start_ns, uint64_t end_ns) {
+	uint64_t latency = end_ns - start_ns;
+	uint64_t window;
+
+	if (metrics->window_start == 0) {
+		metrics->window_start = start_ns;
+	}
+
+	metrics->frames++;
+	metrics->total_frames++;
+	metrics->latency_sum += latency;
+
+	if (latency > metrics->latency_max) {
+		metrics->latency_max = latency;
+	}
+
+	window = end_ns - metrics->window_start;
+
+	if (window < METRICS_REPORT_INTERVAL_NS) {
+		return;
+	}
+
+	printf("[%s] %.2f fps, decode latency avg %.2f ms max %.2f ms, %u stale frames skipped (%llu total)\n",
+		name,
+		(double)metrics->frames * 1000000000.0 / (double)window,
+		(double)metrics->latency_sum / (double)metrics->frames / 1000000.0,
+		(double)metrics->latency_max / 1000000.0,
+		metrics->stale_frames,
+		(unsigned long long)metrics->total_stale_frames
+	);
+	fflush(stdout);
+
+	metrics->window_start = end_ns;
+	metrics->frames = 0;
+	metrics->latency_sum = 0;
+	metrics->latency_max = 0;
+	metrics->stale_frames = 0;
+}
+
+void metrics_stale(camera_metrics_t *metrics, uint32_t count) {
+	metrics->stale_frames += count;
+	metrics->total_stale_frames += count;
+}
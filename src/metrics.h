@@ -0,0 +1,24 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <inttypes.h>
+
+#define METRICS_REPORT_INTERVAL_NS 5000000000ULL
+
+typedef struct {
+    uint64_t window_start;
+    uint32_t frames;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t total_frames;
+
+    // Latest frame mode, frames requeued undecoded because a newer one was ready
+    uint32_t stale_frames;
+    uint64_t total_stale_frames;
+} camera_metrics_t;
+
+void metrics_reset(camera_metrics_t *metrics);
+void metrics_frame(camera_metrics_t *metrics, const char *name, uint64_t start_ns, uint64_t end_ns);
+void metrics_stale(camera_metrics_t *metrics, uint32_t count);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/videodev2.h>
+
+#include "presets.h"
+#include "display_params.h"
+
+/*
+ * File layout, native byte order as it never leaves the board:
+ *
+ *   presets_file_header_t
+ *   for each saved slot:
+ *     preset_record_t
+ *     int32_t display values, in display_param_fields order
+ *     preset_control_t controls[control_count]
+ *
+ * Display values are stored by field rather than as the kernel structs, a version
+ * bump is only needed when the field list changes.
+ */
+#define PRESETS_MAGIC 0x53505643
+#define PRESETS_VERSION 1
+#define PRESETS_TMP_FILE PRESETS_FILE ".tmp"
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_count;
+	uint16_t display_param_count;
+	uint16_t reserved;
+} presets_file_header_t;
+
+typedef struct {
+	uint8_t slot;
+	uint8_t reserved;
+	uint16_t control_count;
+	char name[PRESET_NAME_MAX];
+} preset_record_t;
+
+typedef struct {
+	uint32_t id;
+	int32_t value;
+} preset_control_t;
+
+typedef struct {
+	uint8_t used;
+	char name[PRESET_NAME_MAX];
+
+	display_params_t display;
+
+	int control_count;
+	preset_control_t controls[CONTROL_CATALOG_MAX];
+} preset_t;
+
+static preset_t presets[PRESET_MAX_SLOTS];
+static uint64_t last_recall_ns = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int write_presets() {
+	presets_file_header_t header;
+	preset_record_t record;
+	int32_t value;
+
+	FILE *out = fopen(PRESETS_TMP_FILE, "wb");
+
+	if (out == NULL) {
+		printf("Failed to write presets: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PRESETS_MAGIC;
+	header.version = PRESETS_VERSION;
+	header.display_param_count = display_param_count;
+
+	for (int i = 0; i < PRESET_MAX_SLOTS; i++) {
+		header.slot_count += presets[i].used;
+	}
+
+	int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+
+	for (int i = 0; i < PRESET_MAX_SLOTS && !failed; i++) {
+		preset_t *preset = &presets[i];
+
+		if (!preset->used) {
+			continue;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.slot = i;
+		record.control_count = preset->control_count;
+		memcpy(record.name, preset->name, sizeof(record.name));
+
+		failed |= fwrite(&record, sizeof(record), 1, out) != 1;
+
+		for (int j = 0; j < display_param_count; j++) {
+			value = display_param_value(&preset->display, j);
+			failed |= fwrite(&value, sizeof(value), 1, out) != 1;
+		}
+
+		failed |= fwrite(preset->controls, sizeof(preset_control_t), preset->control_count, out) != (size_t) preset->control_count;
+	}
+
+	failed |= fflush(out) != 0 || fsync(fileno(out)) != 0;
+	failed |= fclose(out) != 0;
+
+	if (failed || rename(PRESETS_TMP_FILE, PRESETS_FILE) != 0) {
+		printf("Failed to write presets: %s\n", strerror(errno));
+		unlink(PRESETS_TMP_FILE);
+		return -1;
+	}
+
+	return 0;
+}
+
+void presets_load() {
+	presets_file_header_t header;
+	preset_record_t record;
+	int32_t value;
+
+	memset(presets, 0, sizeof(presets));
+
+	FILE *in = fopen(PRESETS_FILE, "rb");
+
+	if (in == NULL) {
+		return;
+	}
+
+	if (
+		fread(&header, sizeof(header), 1, in) != 1 ||
+		header.magic != PRESETS_MAGIC ||
+		header.version != PRESETS_VERSION ||
+		header.display_param_count != display_param_count
+	) {
+		printf("Presets file has an unknown format, ignoring it\n");
+		fclose(in);
+		return;
+	}
+
+	for (int i = 0; i < header.slot_count; i++) {
+		if (
+			fread(&record, sizeof(record), 1, in) != 1 ||
+			record.slot >= PRESET_MAX_SLOTS ||
+			record.control_count > CONTROL_CATALOG_MAX
+		) {
+			printf("Presets file is truncated or corrupted\n");
+			break;
+		}
+
+		preset_t *preset = &presets[record.slot];
+
+		memset(&preset->display, 0, sizeof(preset->display));
+
+		for (int j = 0; j < display_param_count && fread(&value, sizeof(value), 1, in) == 1; j++) {
+			display_param_set_value(&preset->display, j, value);
+		}
+
+		if (fread(preset->controls, sizeof(preset_control_t), record.control_count, in) != record.control_count) {
+			printf("Presets file is truncated or corrupted\n");
+			break;
+		}
+
+		memcpy(preset->name, record.name, sizeof(preset->name));
+		preset->name[PRESET_NAME_MAX - 1] = 0;
+		preset->control_count = record.control_count;
+		preset->used = 1;
+	}
+
+	fclose(in);
+}
+
+int preset_save(video_device_t *my_vd, int slot, const char *name) {
+	if (slot < 0 || slot >= PRESET_MAX_SLOTS) {
+		return -1;
+	}
+
+	preset_t *preset = &presets[slot];
+
+	preset->control_count = 0;
+
+	for (int i = 0; i < my_vd->controls.count; i++) {
+		control_entry_t *entry = &my_vd->controls.entries[i];
+
+		if (!entry->value_valid || (entry->flags & V4L2_CTRL_FLAG_READ_ONLY) || entry->type == V4L2_CTRL_TYPE_BUTTON) {
+			continue;
+		}
+
+		preset->controls[preset->control_count].id = entry->id;
+		preset->controls[preset->control_count].value = entry->value;
+		preset->control_count++;
+	}
+
+	display_params_get(&preset->display);
+
+	snprintf(preset->name, sizeof(preset->name), "%s", name);
+	preset->used = 1;
+
+	printf("Preset %i \"%s\" saved with %i controls\n", slot, preset->name, preset->control_count);
+	fflush(stdout);
+
+	return write_presets();
+}
+
+int preset_recall(video_device_t *my_vd, int slot) {
+	static control_batch_t batch;
+	display_params_t display;
+	uint64_t start = now_ns();
+	int changed = 0;
+
+	if (slot < 0 || slot >= PRESET_MAX_SLOTS || !presets[slot].used) {
+		return -1;
+	}
+
+	preset_t *preset = &presets[slot];
+
+	control_batch_init(&batch);
+
+	for (int i = 0; i < preset->control_count; i++) {
+		control_entry_t *entry = control_catalog_find_id(&my_vd->controls, preset->controls[i].id);
+
+		if (entry == NULL) {
+			continue;
+		}
+
+		// A value still queued by the rate limit would undo the recall
+		control_catalog_cancel(&my_vd->controls, entry);
+		control_batch_add(&batch, entry, preset->controls[i].value);
+	}
+
+	if (batch.count > 0) {
+		changed += control_batch_apply(&batch, my_vd->device_file);
+	}
+
+	display_params_get(&display);
+
+	for (int i = 0; i < display_param_count; i++) {
+		changed += display_param_value(&display, i) != display_param_value(&preset->display, i);
+	}
+
+	display_params_set(&preset->display);
+
+	last_recall_ns = now_ns() - start;
+
+	printf("Preset %i \"%s\" recalled: %i values changed in %llu us\n", slot, preset->name, changed, (unsigned long long) last_recall_ns / 1000);
+	fflush(stdout);
+
+	return changed;
+}
+
+int preset_find(const char *name) {
+	char *end;
+
+	if (name == NULL || *name == 0) {
+		return -1;
+	}
+
+	long slot = strtol(name, &end, 10);
+
+	if (*end == 0) {
+		return slot >= 0 && slot < PRESET_MAX_SLOTS ? slot : -1;
+	}
+
+	for (int i = 0; i < PRESET_MAX_SLOTS; i++) {
+		if (presets[i].used && strcmp(presets[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+const char* preset_name(int slot) {
+	if (slot < 0 || slot >= PRESET_MAX_SLOTS || !presets[slot].used) {
+		return NULL;
+	}
+
+	return presets[slot].name;
+}
+
+uint64_t preset_last_recall_ns() {
+	return last_recall_ns;
+}
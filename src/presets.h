@@ -0,0 +1,34 @@
+#ifndef _PRESETS_H_
+#define _PRESETS_H_
+
+#include <inttypes.h>
+
+#include "device.h"
+
+#ifndef PRESETS_FILE
+#define PRESETS_FILE "/var/www/camview/presets.bin"
+#endif
+
+#define PRESET_MAX_SLOTS 10
+#define PRESET_NAME_MAX 24
+
+// Reads the saved presets, an unknown file version leaves every slot empty
+void presets_load();
+
+// Captures every readable device control and the display params into the slot and saves the file
+int preset_save(video_device_t *my_vd, int slot, const char *name);
+
+// Applies only the values that differ from the current ones, device controls in one batch.
+// Returns the number of values changed, -1 if the slot is empty.
+int preset_recall(video_device_t *my_vd, int slot);
+
+// Slot by name or number, -1 if there is none
+int preset_find(const char *name);
+
+// NULL for an empty slot
+const char* preset_name(int slot);
+
+// Time the last recall took, from the call until every value was applied
+uint64_t preset_last_recall_ns();
+
+#endif
@@ -190,10 +190,8 @@ void *ve_malloc(int size, int write)
 		return NULL;
 	}
 
-	/*
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
 		return NULL;
-	*/
 
 	void *addr = NULL;
 
@@ -246,7 +244,7 @@ void *ve_malloc(int size, int write)
 	}
 
 out:
-	// pthread_rwlock_unlock(&ve.memory_lock);
+	pthread_rwlock_unlock(&ve.memory_lock);
 	return addr;
 }
 
@@ -258,10 +256,9 @@ void ve_free(void *ptr)
 	if (ptr == NULL)
 		return;
 
-	/*
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
 		return;
-*/
+
 	struct memchunk_t *c;
 	for (c = &ve.first_memchunk; c != NULL; c = c->next)
 	{
@@ -287,7 +284,7 @@ void ve_free(void *ptr)
 		}
 	}
 
-	// pthread_rwlock_unlock(&ve.memory_lock);
+	pthread_rwlock_unlock(&ve.memory_lock);
 }
 
 uint32_t ve_virt2phys(void *ptr)
@@ -295,10 +292,9 @@ uint32_t ve_virt2phys(void *ptr)
 	if (ve.fd == -1)
 		return 0;
 
-	/*
 	if (pthread_rwlock_rdlock(&ve.memory_lock))
 		return 0;
-*/
+
 	uint32_t addr = 0;
 
 	struct memchunk_t *c;
@@ -319,7 +315,7 @@ uint32_t ve_virt2phys(void *ptr)
 		}
 	}
 
-	// pthread_rwlock_unlock(&ve.memory_lock);
+	pthread_rwlock_unlock(&ve.memory_lock);
 	return addr;
 }
 
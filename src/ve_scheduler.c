@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ve.h"
+#include "ve_scheduler.h"
+
+// Decodes from all the cameras share a single VE.
+// Every frame is a submission: the camera thread waits here until it is its turn,
+// holds the engine for exactly one decode and then hands it over.
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int policy;
+	int busy;
+	int last_slot;
+	uint8_t waiting[VE_SCHED_MAX_SLOTS];
+	uint64_t deadline[VE_SCHED_MAX_SLOTS];
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.policy = VE_SCHED_ROUND_ROBIN,
+	.last_slot = VE_SCHED_MAX_SLOTS - 1
+};
+
+uint64_t ve_sched_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void ve_sched_init(int policy) {
+	pthread_mutex_lock(&sched.lock);
+
+	sched.policy = policy;
+	sched.busy = 0;
+	sched.last_slot = VE_SCHED_MAX_SLOTS - 1;
+	memset(sched.waiting, 0, sizeof(sched.waiting));
+	memset(sched.deadline, 0, sizeof(sched.deadline));
+
+	pthread_mutex_unlock(&sched.lock);
+
+	printf("VE scheduler using %s policy\n", policy == VE_SCHED_DEADLINE ? "deadline" : "round robin");
+	fflush(stdout);
+}
+
+// Must be called with sched.lock held
+static int pick_next_slot() {
+	int next = -1;
+	int slot;
+
+	// Walk starting after the last owner, so ties are always broken in round robin order.
+	for (int i = 1; i <= VE_SCHED_MAX_SLOTS; i++) {
+		slot = (sched.last_slot + i) % VE_SCHED_MAX_SLOTS;
+
+		if (!sched.waiting[slot]) {
+			continue;
+		}
+
+		if (sched.policy != VE_SCHED_DEADLINE) {
+			return slot;
+		}
+
+		if (next < 0 || sched.deadline[slot] < sched.deadline[next]) {
+			next = slot;
+		}
+	}
+
+	return next;
+}
+
+void* ve_sched_acquire(int slot, uint64_t deadline) {
+	if (slot < 0 || slot >= VE_SCHED_MAX_SLOTS) {
+		printf("VE scheduler: invalid slot %i\n", slot);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sched.lock);
+
+	sched.waiting[slot] = 1;
+	sched.deadline[slot] = deadline;
+
+	while (sched.busy || pick_next_slot() != slot) {
+		pthread_cond_wait(&sched.cond, &sched.lock);
+	}
+
+	sched.waiting[slot] = 0;
+	sched.busy = 1;
+	sched.last_slot = slot;
+
+	pthread_mutex_unlock(&sched.lock);
+
+	void *regs = ve_get(VE_ENGINE_MPEG, 0);
+
+	// The caller does not release an engine it did not get, the others must not wait on it
+	if (regs == NULL) {
+		pthread_mutex_lock(&sched.lock);
+
+		sched.busy = 0;
+		pthread_cond_broadcast(&sched.cond);
+
+		pthread_mutex_unlock(&sched.lock);
+	}
+
+	return regs;
+}
+
+void ve_sched_release() {
+	ve_put();
+
+	pthread_mutex_lock(&sched.lock);
+
+	sched.busy = 0;
+	pthread_cond_broadcast(&sched.cond);
+
+	pthread_mutex_unlock(&sched.lock);
+}
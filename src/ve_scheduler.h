@@ -0,0 +1,22 @@
+#ifndef _VE_SCHEDULER_H_
+#define _VE_SCHEDULER_H_
+
+#include <inttypes.h>
+
+#define VE_SCHED_MAX_SLOTS 4
+
+#define VE_SCHED_ROUND_ROBIN 0
+#define VE_SCHED_DEADLINE 1
+
+void ve_sched_init(int policy);
+
+// Blocks until the slot is granted the engine, then returns the VE registers, NULL when
+// the engine could not be taken. deadline is a CLOCK_MONOTONIC timestamp in ns, only used
+// by VE_SCHED_DEADLINE.
+void* ve_sched_acquire(int slot, uint64_t deadline);
+// Only after a successful ve_sched_acquire
+void ve_sched_release();
+
+uint64_t ve_sched_now_ns();
+
+#endif